@@ -0,0 +1,69 @@
+#include "AllocCounter.hpp"
+
+#ifdef NETTHING_ALLOC_COUNTING
+
+static volatile uint32_t alloc_count = 0;
+static volatile uint32_t alloc_bytes = 0;
+static volatile uint32_t free_count = 0;
+
+extern "C" {
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  alloc_count++;
+  alloc_bytes += nmemb * size;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  if (ptr) {
+    free_count++;
+  }
+  __real_free(ptr);
+}
+
+}
+
+uint32_t AllocCounter::count() {
+  return alloc_count;
+}
+
+uint32_t AllocCounter::bytes() {
+  return alloc_bytes;
+}
+
+uint32_t AllocCounter::frees() {
+  return free_count;
+}
+
+#else
+
+uint32_t AllocCounter::count() {
+  return 0;
+}
+
+uint32_t AllocCounter::bytes() {
+  return 0;
+}
+
+uint32_t AllocCounter::frees() {
+  return 0;
+}
+
+#endif
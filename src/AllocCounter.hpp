@@ -0,0 +1,21 @@
+#ifndef ALLOCCOUNTER_HPP
+#define ALLOCCOUNTER_HPP
+
+#include <Arduino.h>
+
+// Heap allocation accounting, enabled by building with:
+//   -DNETTHING_ALLOC_COUNTING
+//   -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc -Wl,--wrap=free
+// operator new/new[] and String go through malloc/realloc, so they are
+// counted too. Without the define every call returns zero.
+// Allocations while handling keepalive, ping or a file_data chunk are
+// counted in net_hot_path_allocs; -DNETTHING_ALLOC_STRICT aborts instead.
+
+class AllocCounter {
+ public:
+  static uint32_t count();
+  static uint32_t bytes();
+  static uint32_t frees();
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include "ClockDiscipline.hpp"
+
+// local monotonic milliseconds, doesn't wrap like millis()
+uint64_t ClockDiscipline::localMs() {
+  return micros64() / 1000;
+}
+
+int64_t ClockDiscipline::model(uint64_t local) {
+  int64_t elapsed = (int64_t)(local - base_local);
+  int64_t wall = base_wall + elapsed + elapsed * drift_ppb / 1000000000LL;
+  if (slew_ppb) {
+    int64_t slewed = local < slew_until ? elapsed : (int64_t)(slew_until - base_local);
+    wall += slewed * slew_ppb / 1000000000LL;
+  }
+  return wall;
+}
+
+void ClockDiscipline::correct(uint64_t local, int64_t offset) {
+  int64_t target = (int64_t)local + offset;
+  if (!synced) {
+    base_local = local;
+    base_wall = target;
+    slew_ppb = 0;
+    last_error = 0;
+    synced = true;
+    return;
+  }
+  int64_t current = model(local);
+  int64_t error = target - current;
+  last_error = error;
+  base_local = local;
+  base_wall = current;
+  if (error > CLOCK_STEP_MS || error < -CLOCK_STEP_MS) {
+    // too far out to slew, nowMs() holds still rather than step backwards
+    base_wall = target;
+    slew_ppb = 0;
+    step_count++;
+    return;
+  }
+  int64_t slew = error * 1000000000LL / CLOCK_SLEW_MS;
+  if (slew > CLOCK_MAX_SLEW_PPB) {
+    slew = CLOCK_MAX_SLEW_PPB;
+  } else if (slew < -CLOCK_MAX_SLEW_PPB) {
+    slew = -CLOCK_MAX_SLEW_PPB;
+  }
+  slew_ppb = slew;
+  slew_until = local + (slew ? error * 1000000000LL / slew : 0);
+}
+
+// t1 and t4 are localMs() when the probe left and the reply arrived,
+// t2 and t3 are the server's wall clock on receipt and transmission
+void ClockDiscipline::addSample(uint64_t t1, int64_t t2, int64_t t3, uint64_t t4) {
+  if (t4 < t1 || t3 < t2) {
+    return;
+  }
+  int64_t rtt = (int64_t)(t4 - t1) - (t3 - t2);
+  Sample &s = samples[sample_head];
+  s.local = t1 + (t4 - t1) / 2;
+  s.offset = ((t2 - (int64_t)t1) + (t3 - (int64_t)t4)) / 2;
+  s.delay = rtt > 0 ? rtt : 0;
+  sample_head = (sample_head + 1) % CLOCK_SAMPLES;
+  if (sample_count < CLOCK_SAMPLES) {
+    sample_count++;
+  }
+
+  // the least delayed exchange has the least asymmetry
+  const Sample *best = &samples[0];
+  for (uint8_t i = 1; i < sample_count; i++) {
+    if (samples[i].delay < best->delay) {
+      best = &samples[i];
+    }
+  }
+
+  if (!ref_valid) {
+    ref_local = best->local;
+    ref_offset = best->offset;
+    ref_valid = true;
+  } else if (best->local - ref_local >= CLOCK_DRIFT_MIN_MS) {
+    int64_t measured = (best->offset - ref_offset) * 1000000000LL / (int64_t)(best->local - ref_local);
+    if (measured > CLOCK_MAX_DRIFT_PPB) {
+      measured = CLOCK_MAX_DRIFT_PPB;
+    } else if (measured < -CLOCK_MAX_DRIFT_PPB) {
+      measured = -CLOCK_MAX_DRIFT_PPB;
+    }
+    drift_ppb += (measured - drift_ppb) / 4;
+    ref_local = best->local;
+    ref_offset = best->offset;
+  }
+
+  // project the trusted offset forward to now
+  uint64_t now = localMs();
+  int64_t offset = best->offset + (int64_t)(now - best->local) * drift_ppb / 1000000000LL;
+  correct(now, offset);
+}
+
+// whole or fractional seconds from a time packet, used until exchanges arrive
+void ClockDiscipline::setCoarse(int64_t wall_ms) {
+  if (sample_count == 0) {
+    uint64_t now = localMs();
+    correct(now, wall_ms - (int64_t)now);
+  }
+}
+
+bool ClockDiscipline::isSynced() {
+  return synced;
+}
+
+// milliseconds since the epoch, 0 until synchronised
+int64_t ClockDiscipline::nowMs() {
+  if (!synced) {
+    return 0;
+  }
+  int64_t wall = model(localMs());
+  if (wall < last_returned) {
+    wall = last_returned;
+  }
+  last_returned = wall;
+  return wall;
+}
+
+// wall clock time for an earlier localMs() reading, not clamped
+int64_t ClockDiscipline::toWallMs(uint64_t local) {
+  return synced ? model(local) : 0;
+}
+
+int32_t ClockDiscipline::driftPpb() {
+  return drift_ppb;
+}
+
+int64_t ClockDiscipline::lastError() {
+  return last_error;
+}
+
+uint32_t ClockDiscipline::lastDelay() {
+  if (sample_count == 0) {
+    return 0;
+  }
+  return samples[(sample_head + CLOCK_SAMPLES - 1) % CLOCK_SAMPLES].delay;
+}
+
+uint32_t ClockDiscipline::steps() {
+  return step_count;
+}
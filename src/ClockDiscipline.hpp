@@ -0,0 +1,58 @@
+#ifndef CLOCKDISCIPLINE_HPP
+#define CLOCKDISCIPLINE_HPP
+
+#include <Arduino.h>
+
+#define CLOCK_SAMPLES 8 // recent exchanges, the lowest delay one is trusted
+#define CLOCK_STEP_MS 1000 // larger errors are stepped rather than slewed
+#define CLOCK_SLEW_MS 16000 // small errors are corrected over this period
+#define CLOCK_MAX_SLEW_PPB 5000000L // 0.5%, fast enough for CLOCK_STEP_MS in ~3 minutes
+#define CLOCK_MAX_DRIFT_PPB 500000L // 500ppm, anything more isn't a crystal
+#define CLOCK_DRIFT_MIN_MS 60000 // minimum spacing of drift measurements
+
+// Disciplines a millisecond wall clock from NTP-style exchanges: the local
+// send and receive times of a probe plus the server's receive and transmit
+// times. The offset comes from the lowest delay sample of the last few,
+// crystal drift from successive offsets. Corrections are slewed where
+// possible and nowMs() never goes backwards.
+class ClockDiscipline {
+ private:
+  struct Sample {
+    uint64_t local; // local ms at the middle of the exchange
+    int64_t offset; // server - local
+    uint32_t delay; // round trip less server processing
+  };
+  Sample samples[CLOCK_SAMPLES];
+  uint8_t sample_count = 0;
+  uint8_t sample_head = 0;
+  // model: wall(t) = base_wall + (t - base_local) * (1 + drift) + slew over [base_local, slew_until]
+  uint64_t base_local = 0;
+  int64_t base_wall = 0;
+  int32_t drift_ppb = 0;
+  int32_t slew_ppb = 0;
+  uint64_t slew_until = 0;
+  // drift reference
+  uint64_t ref_local = 0;
+  int64_t ref_offset = 0;
+  bool ref_valid = false;
+  int64_t last_returned = 0;
+  int64_t last_error = 0;
+  uint32_t step_count = 0;
+  bool synced = false;
+  int64_t model(uint64_t local);
+  void correct(uint64_t local, int64_t offset);
+
+ public:
+  static uint64_t localMs();
+  void addSample(uint64_t t1, int64_t t2, int64_t t3, uint64_t t4);
+  void setCoarse(int64_t wall_ms);
+  bool isSynced();
+  int64_t nowMs();
+  int64_t toWallMs(uint64_t local);
+  int32_t driftPpb();
+  int64_t lastError();
+  uint32_t lastDelay();
+  uint32_t steps();
+};
+
+#endif
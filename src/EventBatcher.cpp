@@ -0,0 +1,67 @@
+#include "EventBatcher.hpp"
+
+bool EventBatcher::fits(const char *event, const char *message) {
+  size_t needed = strlen(event) + 1 + (message ? strlen(message) + 1 : 0);
+  return entry_count < EVENTBATCHER_MAX_EVENTS && pool_used + needed <= EVENTBATCHER_POOL_SIZE;
+}
+
+bool EventBatcher::add(unsigned long ms, const char *event, const char *message) {
+  if (!fits(event, message)) {
+    return false;
+  }
+  if (entry_count == 0) {
+    base_millis = ms;
+  }
+  Entry &entry = entries[entry_count++];
+  entry.delta = ms - base_millis;
+  entry.event = pool_used;
+  strcpy(pool + pool_used, event);
+  pool_used += strlen(event) + 1;
+  if (message) {
+    entry.message = pool_used;
+    strcpy(pool + pool_used, message);
+    pool_used += strlen(message) + 1;
+  } else {
+    entry.message = -1;
+  }
+  return true;
+}
+
+// the caller adds cmd and any wall clock fields, the pool must stay
+// untouched until the document has been serialized
+void EventBatcher::serialize(JsonDocument &doc) {
+  doc["millis"] = base_millis;
+  JsonArray events = doc.createNestedArray("events");
+  for (uint8_t i = 0; i < entry_count; i++) {
+    JsonArray entry = events.createNestedArray();
+    entry.add(entries[i].delta);
+    entry.add((const char *)(pool + entries[i].event));
+    if (entries[i].message >= 0) {
+      entry.add((const char *)(pool + entries[i].message));
+    }
+  }
+}
+
+void EventBatcher::clear() {
+  entry_count = 0;
+  pool_used = 0;
+}
+
+uint8_t EventBatcher::count() {
+  return entry_count;
+}
+
+bool EventBatcher::empty() {
+  return entry_count == 0;
+}
+
+unsigned long EventBatcher::baseMillis() {
+  return base_millis;
+}
+
+// message is NULL for an event without one
+void EventBatcher::get(uint8_t index, unsigned long *ms, const char **event, const char **message) {
+  *ms = base_millis + entries[index].delta;
+  *event = pool + entries[index].event;
+  *message = entries[index].message >= 0 ? pool + entries[index].message : NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef EVENTBATCHER_HPP
+#define EVENTBATCHER_HPP
+
+#include <Arduino.h>
+#include "ArduinoJson.h"
+
+#ifndef EVENTBATCHER_MAX_EVENTS
+#define EVENTBATCHER_MAX_EVENTS 16
+#endif
+
+#ifndef EVENTBATCHER_POOL_SIZE
+#define EVENTBATCHER_POOL_SIZE 512
+#endif
+
+// capacity needed by serialize() for a full batch, strings are not copied
+#define EVENTBATCHER_JSON_SIZE (JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(EVENTBATCHER_MAX_EVENTS) + EVENTBATCHER_MAX_EVENTS * JSON_ARRAY_SIZE(3))
+
+// Collects events into a fixed pool so that many can share one frame:
+// {"cmd":"events","millis":base,"events":[[delta,"event","message"],...]}
+// Each event is a compact array with its millis() offset from the first.
+class EventBatcher {
+ private:
+  struct Entry {
+    uint32_t delta;
+    uint16_t event; // offsets into pool
+    int16_t message; // -1 for none
+  };
+  Entry entries[EVENTBATCHER_MAX_EVENTS];
+  char pool[EVENTBATCHER_POOL_SIZE];
+  uint8_t entry_count = 0;
+  size_t pool_used = 0;
+  unsigned long base_millis = 0;
+
+ public:
+  bool add(unsigned long ms, const char *event, const char *message);
+  bool fits(const char *event, const char *message);
+  void serialize(JsonDocument &doc);
+  void clear();
+  uint8_t count();
+  bool empty();
+  unsigned long baseMillis();
+  void get(uint8_t index, unsigned long *ms, const char **event, const char **message);
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "FileReader.hpp"
+
+FileReader::FileReader(FS &filesystem) : fs(&filesystem) {
+  strncpy(_filename, "", sizeof(_filename));
+}
+
+void FileReader::setFileSystem(FS &filesystem) {
+  if (active) {
+    abort();
+  }
+  fs = &filesystem;
+}
+
+void FileReader::abort() {
+  if (file_handle) {
+    file_handle.close();
+  }
+  if (buffer) {
+    delete[] buffer;
+    buffer = NULL;
+  }
+  strncpy(_filename, "", sizeof(_filename));
+  _size = 0;
+  active = false;
+}
+
+bool FileReader::begin(const char *filename, size_t position, size_t chunk, size_t window) {
+  if (active) {
+    Serial.println("FileReader: begin(): aborting existing task first");
+    abort();
+  }
+  if (strlen(filename) >= sizeof(_filename)) {
+    // replies carry the name, refuse it rather than cut it short
+    return false;
+  }
+  file_handle = fs->open(filename, "r");
+  if (!file_handle) {
+    return false;
+  }
+  _size = file_handle.size();
+  if (position > _size) {
+    file_handle.close();
+    return false;
+  }
+  if (chunk < 1 || chunk > FILEREADER_MAX_CHUNK) {
+    chunk = FILEREADER_DEFAULT_CHUNK;
+  }
+  if (window < 1 || window > FILEREADER_MAX_WINDOW) {
+    window = FILEREADER_DEFAULT_WINDOW;
+  }
+  buffer = new uint8_t[chunk];
+  strcpy(_filename, filename);
+  chunk_size = chunk;
+  this->window = window;
+  hash_pos = 0;
+  next_pos = position;
+  acked_pos = position;
+  md5.begin();
+  last_activity = millis();
+  active = true;
+  return true;
+}
+
+void FileReader::ack(size_t position, size_t window) {
+  last_activity = millis();
+  if (position > next_pos) {
+    position = next_pos;
+  }
+  if (position > acked_pos) {
+    acked_pos = position;
+  }
+  if (window >= 1 && window <= FILEREADER_MAX_WINDOW) {
+    this->window = window;
+  }
+}
+
+bool FileReader::hashing() {
+  // a resumed read must first fold the skipped prefix into the digest
+  return active && hash_pos < acked_pos && hash_pos < next_pos;
+}
+
+void FileReader::hashStep() {
+  if (!hashing()) {
+    return;
+  }
+  size_t len = next_pos - hash_pos;
+  if (len > chunk_size) {
+    len = chunk_size;
+  }
+  if (!file_handle.seek(hash_pos, SeekSet)) {
+    abort();
+    return;
+  }
+  size_t got = file_handle.read(buffer, len);
+  if (got != len) {
+    abort();
+    return;
+  }
+  md5.add(buffer, got);
+  hash_pos += got;
+}
+
+bool FileReader::ready() {
+  if (!active || hashing() || eof()) {
+    return false;
+  }
+  return next_pos - acked_pos < window * chunk_size;
+}
+
+int FileReader::read(const uint8_t **data, size_t *position) {
+  if (!ready()) {
+    return 0;
+  }
+  size_t len = _size - next_pos;
+  if (len > chunk_size) {
+    len = chunk_size;
+  }
+  if (file_handle.position() != next_pos && !file_handle.seek(next_pos, SeekSet)) {
+    return -1;
+  }
+  size_t got = file_handle.read(buffer, len);
+  if (got != len) {
+    return -1;
+  }
+  md5.add(buffer, got);
+  hash_pos += got;
+  *data = buffer;
+  *position = next_pos;
+  next_pos += got;
+  last_activity = millis();
+  return got;
+}
+
+bool FileReader::eof() {
+  return next_pos >= _size;
+}
+
+String FileReader::digest() {
+  md5.calculate();
+  return md5.toString();
+}
+
+bool FileReader::running() {
+  return active;
+}
+
+int FileReader::idleMillis() {
+  if (active) {
+    return millis() - last_activity;
+  } else {
+    return -1;
+  }
+}
+
+const char *FileReader::filename() {
+  return _filename;
+}
+
+size_t FileReader::size() {
+  return _size;
+}
+
+size_t FileReader::chunkSize() {
+  return chunk_size;
+}
@@ -0,0 +1,57 @@
+#ifndef FILEREADER_HPP
+#define FILEREADER_HPP
+
+#include <Arduino.h>
+#include <FS.h>
+
+#ifndef NETTHING_DEFAULT_FS
+#ifdef NETTHING_LITTLEFS
+#include <LittleFS.h>
+#define NETTHING_DEFAULT_FS LittleFS
+#else
+#define NETTHING_DEFAULT_FS SPIFFS
+#endif
+#endif
+
+#define FILEREADER_DEFAULT_CHUNK 512
+#define FILEREADER_MAX_CHUNK 1024
+#define FILEREADER_DEFAULT_WINDOW 4
+#define FILEREADER_MAX_WINDOW 16
+#define FILEREADER_NAME_LEN 32 // as SPIFFS, including the terminator
+
+class FileReader {
+ private:
+  FS *fs;
+  File file_handle;
+  MD5Builder md5;
+  char _filename[FILEREADER_NAME_LEN];
+  size_t _size = 0;
+  size_t hash_pos = 0; // bytes folded into the digest so far
+  size_t next_pos = 0; // offset of the next chunk to send
+  size_t acked_pos = 0; // highest offset acknowledged by the server
+  size_t chunk_size = FILEREADER_DEFAULT_CHUNK;
+  size_t window = FILEREADER_DEFAULT_WINDOW; // chunks in flight
+  uint8_t *buffer = NULL;
+  bool active = false;
+  unsigned long last_activity;
+
+ public:
+  FileReader(FS &filesystem=NETTHING_DEFAULT_FS);
+  void setFileSystem(FS &filesystem);
+  bool begin(const char *filename, size_t position, size_t chunk, size_t window);
+  void ack(size_t position, size_t window=0);
+  bool hashing();
+  void hashStep();
+  bool ready();
+  int read(const uint8_t **data, size_t *position);
+  bool eof();
+  String digest();
+  void abort();
+  bool running();
+  int idleMillis();
+  const char *filename();
+  size_t size();
+  size_t chunkSize();
+};
+
+#endif
@@ -1,17 +1,25 @@
 #include "FileWriter.hpp"
 
-FileWriter::FileWriter() {
+FileWriter::FileWriter(FS &filesystem) : fs(&filesystem) {
   strncpy(_filename, "", sizeof(_filename));
   strncpy(_tmp_filename, "", sizeof(_tmp_filename));
   strncpy(_md5, "", sizeof(_md5));
   _size = 0;
 }
 
+void FileWriter::setFileSystem(FS &filesystem) {
+  if (active) {
+    abort();
+  }
+  fs = &filesystem;
+}
+
 void FileWriter::abort() {
   if (file_handle) {
     file_handle.close();
   }
-  SPIFFS.remove(_tmp_filename);
+  releaseBuffer();
+  fs->remove(_tmp_filename);
   strncpy(_filename, "", sizeof(_filename));
   strncpy(_tmp_filename, "", sizeof(_tmp_filename));
   strncpy(_md5, "", sizeof(_md5));
@@ -36,36 +44,87 @@ bool FileWriter::begin(const char *filename, const char *md5, size_t size) {
 }
 
 bool FileWriter::add(uint8_t *data, unsigned int len) {
+  return add(data, len, buffer_pos + buffer_len);
+}
+
+bool FileWriter::add(uint8_t *data, unsigned int len, unsigned int pos) {
   last_activity = millis();
-  if (file_open) {
-    received_size += len;
-    return file_handle.write(data, len);
-  } else {
+  if (!file_open || !buffer) {
     return false;
   }
+  if (pos != buffer_pos + buffer_len) {
+    // not sequential, write out what we have and start again at pos
+    if (!flush()) {
+      return false;
+    }
+    buffer_pos = pos;
+  }
+  received_size += len;
+  while (len > 0) {
+    // fill up to the next unit boundary so that flushes stay page aligned
+    size_t limit = buffer_unit - (buffer_pos % buffer_unit);
+    size_t n = limit - buffer_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(buffer + buffer_len, data, n);
+    buffer_len += n;
+    data += n;
+    len -= n;
+    if (buffer_len == limit) {
+      if (!flush()) {
+        return false;
+      }
+    }
+  }
+  return true;
 }
 
-bool FileWriter::add(uint8_t *data, unsigned int len, unsigned int pos) {
-  last_activity = millis();
-  if (file_open) {
-    if (file_handle.seek(pos, SeekSet)) {
-      received_size += len;
-      return file_handle.write(data, len);
-    } else {
+bool FileWriter::flush() {
+  if (buffer_len == 0) {
+    return true;
+  }
+  if (file_pos != buffer_pos) {
+    if (!file_handle.seek(buffer_pos, SeekSet)) {
       return false;
     }
-  } else {
+    seeks++;
+  }
+  size_t written = file_handle.write(buffer, buffer_len);
+  flash_writes++;
+  flash_bytes += written;
+  flash_pages += (buffer_pos + written + page_size - 1) / page_size - buffer_pos / page_size;
+  file_pos = buffer_pos + written;
+  if (written != buffer_len) {
     return false;
   }
+  buffer_pos += buffer_len;
+  buffer_len = 0;
+  return true;
+}
+
+void FileWriter::releaseBuffer() {
+  if (buffer) {
+    delete[] buffer;
+    buffer = NULL;
+  }
+  buffer_len = 0;
 }
 
 bool FileWriter::commit() {
   if (file_handle) {
+    bool flushed = flush();
+    releaseBuffer();
     file_handle.close();
     file_open = false;
+    if (!flushed) {
+      Serial.println("FileWriter: commit: flush failed");
+      abort();
+      return false;
+    }
 
     MD5Builder tmp_md5;
-    File tmp_file = SPIFFS.open(_tmp_filename, "r");
+    File tmp_file = fs->open(_tmp_filename, "r");
     size_t tmp_file_size = tmp_file.size();
     tmp_md5.begin();
     while (tmp_file.available()) {
@@ -90,8 +149,8 @@ bool FileWriter::commit() {
     if (_size == tmp_file_size &&
         strcmp(tmp_md5.toString().c_str(), _md5) == 0) {
       Serial.println(" match");
-      SPIFFS.remove(_filename);
-      SPIFFS.rename(_tmp_filename, _filename);
+      fs->remove(_filename);
+      fs->rename(_tmp_filename, _filename);
       active = false;
       return true;
     } else {
@@ -105,8 +164,23 @@ bool FileWriter::commit() {
 }
 
 bool FileWriter::open() {
-  file_handle = SPIFFS.open(_tmp_filename, "w");
+  file_handle = fs->open(_tmp_filename, "w");
   if (file_handle) {
+    FSInfo info;
+    if (fs->info(info) && info.pageSize > 0 && info.pageSize <= FILEWRITER_BUFFER_SIZE) {
+      page_size = info.pageSize;
+    } else {
+      page_size = FILEWRITER_BUFFER_SIZE;
+    }
+    buffer_unit = FILEWRITER_BUFFER_SIZE - (FILEWRITER_BUFFER_SIZE % page_size);
+    releaseBuffer();
+    buffer = new uint8_t[buffer_unit];
+    buffer_pos = 0;
+    file_pos = 0;
+    flash_bytes = 0;
+    flash_writes = 0;
+    flash_pages = 0;
+    seeks = 0;
     received_size = 0;
     file_open = true;
     active = true;
@@ -131,9 +205,33 @@ int FileWriter::idleMillis() {
   }
 }
 
+const char *FileWriter::filename() {
+  return _filename;
+}
+
+size_t FileWriter::payloadBytes() {
+  return received_size;
+}
+
+size_t FileWriter::flashBytes() {
+  return flash_bytes;
+}
+
+unsigned int FileWriter::flashWrites() {
+  return flash_writes;
+}
+
+unsigned int FileWriter::flashPages() {
+  return flash_pages;
+}
+
+unsigned int FileWriter::seekCount() {
+  return seeks;
+}
+
 bool FileWriter::upToDate() {
   MD5Builder md5;
-  File f = SPIFFS.open(_filename, "r");
+  File f = fs->open(_filename, "r");
   size_t size = f.size();
   parse_md5_stream(&md5, &f);
   f.close();
@@ -4,8 +4,22 @@
 #include <Arduino.h>
 #include <FS.h>
 
+#ifndef NETTHING_DEFAULT_FS
+#ifdef NETTHING_LITTLEFS
+#include <LittleFS.h>
+#define NETTHING_DEFAULT_FS LittleFS
+#else
+#define NETTHING_DEFAULT_FS SPIFFS
+#endif
+#endif
+
+#ifndef FILEWRITER_BUFFER_SIZE
+#define FILEWRITER_BUFFER_SIZE 512 // multiple of the file system page size
+#endif
+
 class FileWriter {
  private:
+  FS *fs;
   File file_handle;
   char _filename[31];
   char _tmp_filename[32];
@@ -15,10 +29,25 @@ class FileWriter {
   bool file_open = false;
   unsigned int received_size;
   unsigned long last_activity;
+  // write coalescing
+  uint8_t *buffer = NULL;
+  size_t buffer_unit = FILEWRITER_BUFFER_SIZE; // flush boundary, page aligned
+  size_t page_size = 256;
+  size_t buffer_pos = 0; // file offset of buffer[0]
+  size_t buffer_len = 0;
+  size_t file_pos = 0; // offset of the underlying file handle
+  // statistics for the current transfer
+  size_t flash_bytes = 0;
+  unsigned int flash_writes = 0;
+  unsigned int flash_pages = 0;
+  unsigned int seeks = 0;
+  bool flush();
+  void releaseBuffer();
   void parse_md5_stream(MD5Builder *md5, Stream *stream);
 
  public:
-  FileWriter();
+  FileWriter(FS &filesystem=NETTHING_DEFAULT_FS);
+  void setFileSystem(FS &filesystem);
   bool begin(const char *filename, const char *md5, size_t size);
   bool upToDate();
   bool open();
@@ -28,6 +57,12 @@ class FileWriter {
   void abort();
   bool running();
   int idleMillis();
+  const char *filename();
+  size_t payloadBytes();
+  size_t flashBytes();
+  unsigned int flashWrites();
+  unsigned int flashPages();
+  unsigned int seekCount();
 };
 
 #endif
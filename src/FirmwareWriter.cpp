@@ -12,6 +12,7 @@ FirmwareWriter::~FirmwareWriter() {
 }
 
 void FirmwareWriter::abort() {
+  releaseStage();
   if (update_active) {
     Serial.println("FirmwareWriter: abort");
     // write some dummy data to break the MD5 check
@@ -23,6 +24,16 @@ void FirmwareWriter::abort() {
   strncpy(_md5, "", sizeof(_md5));
   _size = 0;
   begin_active = false;
+  write_failed = false;
+}
+
+void FirmwareWriter::releaseStage() {
+  if (stage) {
+    free(stage);
+    stage = NULL;
+  }
+  stage_head = 0;
+  stage_len = 0;
 }
 
 bool FirmwareWriter::add(uint8_t *data, unsigned int len) {
@@ -74,20 +85,99 @@ bool FirmwareWriter::add(uint8_t *data, unsigned int len, unsigned int pos) {
     }
     update_active = true;
   }
-  if (!update_active) {
+  if (!update_active || write_failed) {
     return false;
   }
   // Serial.print("FirmwareWriter: writing ");
   // Serial.print(len, DEC);
   // Serial.print(" bytes at position ");
   // Serial.println(_position, DEC);
-  if (Update.write(data, len) == len) {
+  if (stageData(data, len)) {
     _position += len;
     return true;
   } else {
+    return false;
+  }
+}
+
+bool FirmwareWriter::stageData(const uint8_t *data, unsigned int len) {
+  if (!stage) {
+    stage = (uint8_t *)malloc(FIRMWAREWRITER_STAGE_SIZE);
+    stage_head = 0;
+    stage_len = 0;
+  }
+  if (!stage) {
+    // no memory for the pipeline, write through as before
+    if (Update.write((uint8_t *)data, len) != len) {
+      Update.printError(Serial);
+      write_failed = true;
+      return false;
+    }
+    return true;
+  }
+  while (len > 0) {
+    if (stage_len == FIRMWAREWRITER_STAGE_SIZE) {
+      // the sender overran the advertised window, stall until there's room
+      if (!step()) {
+        return false;
+      }
+      continue;
+    }
+    size_t room = FIRMWAREWRITER_STAGE_SIZE - stage_len;
+    size_t contiguous = FIRMWAREWRITER_STAGE_SIZE - stage_head;
+    size_t n = len < room ? len : room;
+    if (n > contiguous) {
+      n = contiguous;
+    }
+    memcpy(stage + stage_head, data, n);
+    stage_head = (stage_head + n) % FIRMWAREWRITER_STAGE_SIZE;
+    stage_len += n;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Feeds at most a sector of staged data to the Updater, so that at most one
+// erase and program happens per call. Returns false if the Updater failed,
+// later add() and commit() calls will then fail.
+bool FirmwareWriter::step() {
+  if (write_failed) {
+    return false;
+  }
+  if (stage_len == 0) {
+    return true;
+  }
+  size_t tail = (stage_head + FIRMWAREWRITER_STAGE_SIZE - stage_len) % FIRMWAREWRITER_STAGE_SIZE;
+  size_t n = FLASH_SECTOR_SIZE;
+  if (n > stage_len) {
+    n = stage_len;
+  }
+  if (n > FIRMWAREWRITER_STAGE_SIZE - tail) {
+    // wrapped, the rest goes on the next call
+    n = FIRMWAREWRITER_STAGE_SIZE - tail;
+  }
+  if (Update.write(stage + tail, n) != n) {
     Update.printError(Serial);
+    write_failed = true;
+    releaseStage();
     return false;
   }
+  stage_len -= n;
+  return true;
+}
+
+// staged data waiting for step()
+bool FirmwareWriter::pending() {
+  return stage_len > 0 && !write_failed;
+}
+
+// bytes that can be accepted without stalling, advertised to the sender
+size_t FirmwareWriter::window() {
+  if (!begin_active || write_failed) {
+    return 0;
+  }
+  return FIRMWAREWRITER_STAGE_SIZE - stage_len;
 }
 
 bool FirmwareWriter::begin(const char *md5, size_t size) {
@@ -128,7 +218,12 @@ bool FirmwareWriter::begin(const char *md5, size_t size) {
 bool FirmwareWriter::commit() {
   if (update_active) {
     Serial.println("FirmwareWriter: finishing up");
-    if (Update.end()) {
+    while (pending()) {
+      step();
+    }
+    bool staged_ok = !write_failed;
+    releaseStage();
+    if (staged_ok && Update.end()) {
       Serial.println("FirmwareWriter: end() succeeded");
       return true;
     } else {
@@ -3,13 +3,26 @@
 
 #include <Arduino.h>
 
+#ifndef FIRMWAREWRITER_STAGE_SIZE
+#define FIRMWAREWRITER_STAGE_SIZE FLASH_SECTOR_SIZE
+#endif
+
+// Received firmware is staged in a sector sized ring and fed to the Updater
+// (which holds the other sector buffer) from step(), so that the erase and
+// program of each sector happens in loop() rather than in the receive path.
 class FirmwareWriter {
  private:
   char _md5[33];
   size_t _size = 0;
-  unsigned int _position = 0;
+  unsigned int _position = 0; // bytes accepted, staged or written
   bool begin_active = false;
   bool update_active = false;
+  bool write_failed = false;
+  uint8_t *stage = NULL;
+  size_t stage_head = 0; // next byte to stage
+  size_t stage_len = 0; // bytes staged, not yet passed to the Updater
+  void releaseStage();
+  bool stageData(const uint8_t *data, unsigned int len);
 
  public:
   FirmwareWriter();
@@ -21,6 +34,9 @@ class FirmwareWriter {
   bool commit();
   int getUpdaterError();
   unsigned int position();
+  size_t window();
+  bool pending();
+  bool step();
   int progress();
   bool upToDate(const char *md5);
 };
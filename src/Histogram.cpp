@@ -0,0 +1,66 @@
+#include "Histogram.hpp"
+
+Histogram::Histogram(const unsigned long *bounds, uint8_t bucket_count):
+  bounds(bounds),
+  bucket_count(bucket_count)
+{
+  if (this->bucket_count > HISTOGRAM_MAX_BUCKETS) {
+    this->bucket_count = HISTOGRAM_MAX_BUCKETS;
+  }
+  reset();
+}
+
+void Histogram::add(unsigned long value) {
+  uint8_t i = 0;
+  while (i < bucket_count && value > bounds[i]) {
+    i++;
+  }
+  counts[i]++;
+
+  if (count == 0) {
+    min = value;
+    max = value;
+    ewma_x8 = value << 3;
+  } else {
+    if (value < min) {
+      min = value;
+    }
+    if (value > max) {
+      max = value;
+    }
+    ewma_x8 = ewma_x8 - (ewma_x8 >> 3) + value;
+  }
+  last = value;
+  count++;
+}
+
+unsigned long Histogram::ewma() {
+  return ewma_x8 >> 3;
+}
+
+void Histogram::reset() {
+  for (uint8_t i = 0; i <= bucket_count; i++) {
+    counts[i] = 0;
+  }
+  ewma_x8 = 0;
+  count = 0;
+  min = 0;
+  max = 0;
+  last = 0;
+}
+
+void Histogram::serialize(JsonObject obj) {
+  obj["count"] = count;
+  obj["min"] = min;
+  obj["max"] = max;
+  obj["ewma"] = ewma();
+  obj["last"] = last;
+  JsonArray le = obj.createNestedArray("le");
+  for (uint8_t i = 0; i < bucket_count; i++) {
+    le.add(bounds[i]);
+  }
+  JsonArray buckets = obj.createNestedArray("buckets");
+  for (uint8_t i = 0; i <= bucket_count; i++) {
+    buckets.add(counts[i]);
+  }
+}
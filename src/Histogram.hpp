@@ -0,0 +1,34 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <Arduino.h>
+#include "ArduinoJson.h"
+
+#ifndef HISTOGRAM_MAX_BUCKETS
+#define HISTOGRAM_MAX_BUCKETS 12
+#endif
+
+// capacity needed by serialize()
+#define HISTOGRAM_JSON_SIZE (JSON_OBJECT_SIZE(7) + 2 * JSON_ARRAY_SIZE(HISTOGRAM_MAX_BUCKETS + 1))
+
+// Fixed-bucket histogram with min/max/EWMA, no allocation after construction.
+// Bucket i counts values <= bounds[i], the final bucket counts everything else.
+class Histogram {
+ private:
+  const unsigned long *bounds;
+  uint8_t bucket_count;
+  unsigned long counts[HISTOGRAM_MAX_BUCKETS + 1];
+  unsigned long ewma_x8 = 0; // EWMA with alpha=1/8, scaled by 8
+ public:
+  unsigned long count = 0;
+  unsigned long min = 0;
+  unsigned long max = 0;
+  unsigned long last = 0;
+  Histogram(const unsigned long *bounds, uint8_t bucket_count);
+  void add(unsigned long value);
+  unsigned long ewma();
+  void reset();
+  void serialize(JsonObject obj);
+};
+
+#endif
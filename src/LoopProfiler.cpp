@@ -0,0 +1,90 @@
+#include "LoopProfiler.hpp"
+
+static const unsigned long loop_interval_bounds[] = {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000};
+
+LoopProfiler::LoopProfiler(const char * const *names, uint8_t slot_count):
+  names(names),
+  slot_count(slot_count),
+  loop_interval(loop_interval_bounds, sizeof(loop_interval_bounds) / sizeof(loop_interval_bounds[0]))
+{
+  if (this->slot_count > LOOPPROFILER_MAX_SLOTS) {
+    this->slot_count = LOOPPROFILER_MAX_SLOTS;
+  }
+  reset();
+}
+
+void LoopProfiler::add(uint8_t slot, uint32_t us, uint32_t allocs, uint32_t alloc_bytes) {
+  if (slot >= slot_count) {
+    return;
+  }
+  slots[slot].count++;
+  slots[slot].total_us += us;
+  if (us > slots[slot].max_us) {
+    slots[slot].max_us = us;
+  }
+  slots[slot].allocs += allocs;
+  slots[slot].alloc_bytes += alloc_bytes;
+}
+
+void LoopProfiler::loopStart(uint8_t outside_slot) {
+  uint32_t now = micros();
+  if (loop_seen) {
+    unsigned long interval = now - last_loop_start;
+    if (loop_interval.count > 0) {
+      long deviation = (long)interval - (long)loop_interval.ewma();
+      if (deviation < 0) {
+        deviation = -deviation;
+      }
+      jitter_x16 = jitter_x16 - (jitter_x16 >> 4) + deviation;
+    }
+    loop_interval.add(interval);
+    add(outside_slot, now - last_loop_end);
+  }
+  last_loop_start = now;
+  loop_seen = true;
+}
+
+void LoopProfiler::loopEnd() {
+  last_loop_end = micros();
+}
+
+void LoopProfiler::reset() {
+  for (uint8_t i = 0; i < slot_count; i++) {
+    slots[i].count = 0;
+    slots[i].total_us = 0;
+    slots[i].max_us = 0;
+    slots[i].allocs = 0;
+    slots[i].alloc_bytes = 0;
+  }
+  loop_interval.reset();
+  jitter_x16 = 0;
+  loop_seen = false;
+  reset_time = millis();
+}
+
+void LoopProfiler::serialize(JsonObject obj) {
+  unsigned long elapsed = millis() - reset_time;
+  obj["elapsed_ms"] = elapsed;
+  obj["loops"] = loop_interval.count;
+  if (elapsed > 0) {
+    obj["loop_hz"] = (unsigned long)((uint64_t)loop_interval.count * 1000 / elapsed);
+  }
+  obj["loop_jitter_us"] = jitter_x16 >> 4;
+  loop_interval.serialize(obj.createNestedObject("loop_interval_us"));
+  // each phase is [count, total_ms, max_us], followed by allocs and
+  // alloc_bytes when allocation counting is built in
+  JsonObject phases = obj.createNestedObject("phases");
+  for (uint8_t i = 0; i < slot_count; i++) {
+    if (slots[i].count == 0) {
+      continue;
+    }
+    JsonArray phase = phases.createNestedArray(names[i]);
+    phase.add(slots[i].count);
+    phase.add((unsigned long)(slots[i].total_us / 1000));
+    phase.add(slots[i].max_us);
+#ifdef NETTHING_ALLOC_COUNTING
+    phase.add(slots[i].allocs);
+    phase.add(slots[i].alloc_bytes);
+#endif
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef LOOPPROFILER_HPP
+#define LOOPPROFILER_HPP
+
+#include <Arduino.h>
+#include "AllocCounter.hpp"
+#include "ArduinoJson.h"
+#include "Histogram.hpp"
+
+#ifndef LOOPPROFILER_MAX_SLOTS
+#define LOOPPROFILER_MAX_SLOTS 48
+#endif
+
+// each phase is an array member of "phases", see serialize()
+#ifdef NETTHING_ALLOC_COUNTING
+#define LOOPPROFILER_PHASE_VALUES 5
+#else
+#define LOOPPROFILER_PHASE_VALUES 3
+#endif
+
+// capacity needed by serialize() with every one of slot_count phases used,
+// about 64 bytes a phase on the ESP8266 or 96 with allocation counts
+#define LOOPPROFILER_JSON_SIZE(slot_count) (JSON_OBJECT_SIZE(6) + HISTOGRAM_JSON_SIZE + \
+  (slot_count) * (JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(LOOPPROFILER_PHASE_VALUES)))
+
+// Cumulative and maximum time spent in named phases, plus the interval
+// between successive loop() calls. Timings are inclusive, so a phase that
+// calls into another (e.g. a command invoking an application callback)
+// counts that time in both.
+class LoopProfiler {
+ private:
+  struct Slot {
+    unsigned long count;
+    uint64_t total_us;
+    unsigned long max_us;
+    unsigned long allocs;
+    unsigned long alloc_bytes;
+  };
+  const char * const *names;
+  uint8_t slot_count;
+  Slot slots[LOOPPROFILER_MAX_SLOTS];
+  uint32_t last_loop_start = 0;
+  uint32_t last_loop_end = 0;
+  bool loop_seen = false;
+  unsigned long reset_time = 0;
+  unsigned long jitter_x16 = 0; // RFC 3550 style jitter, scaled by 16
+ public:
+  Histogram loop_interval;
+  LoopProfiler(const char * const *names, uint8_t slot_count);
+  void add(uint8_t slot, uint32_t us, uint32_t allocs=0, uint32_t alloc_bytes=0);
+  void loopStart(uint8_t outside_slot);
+  void loopEnd();
+  void reset();
+  void serialize(JsonObject obj);
+};
+
+#endif
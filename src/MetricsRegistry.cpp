@@ -0,0 +1,134 @@
+#include "MetricsRegistry.hpp"
+
+int MetricsRegistry::add(const char *name, uint8_t type, MetricsGaugeReader reader, Histogram *histogram) {
+  if (entry_count >= NETTHING_METRICS_MAX) {
+    Serial.print("MetricsRegistry: no room for ");
+    Serial.println(name);
+    return -1;
+  }
+  Entry &entry = entries[entry_count];
+  entry.name = name;
+  entry.type = type;
+  entry.value = 0;
+  entry.reader = reader;
+  entry.histogram = histogram;
+  return entry_count++;
+}
+
+int MetricsRegistry::addCounter(const char *name) {
+  return add(name, METRIC_TYPE_COUNTER, NULL, NULL);
+}
+
+int MetricsRegistry::addGauge(const char *name, MetricsGaugeReader reader) {
+  return add(name, METRIC_TYPE_GAUGE, reader, NULL);
+}
+
+int MetricsRegistry::addHistogram(const char *name, Histogram *histogram) {
+  return add(name, METRIC_TYPE_HISTOGRAM, NULL, histogram);
+}
+
+uint8_t MetricsRegistry::count() {
+  return entry_count;
+}
+
+// capacity needed by serialize() for a full snapshot
+size_t MetricsRegistry::jsonCapacity() {
+  size_t capacity = JSON_OBJECT_SIZE(entry_count);
+  for (uint8_t i = 0; i < entry_count; i++) {
+    if (entries[i].histogram) {
+      capacity += HISTOGRAM_JSON_SIZE;
+    }
+  }
+  return capacity;
+}
+
+const char *MetricsRegistry::name(int id) {
+  if (id < 0 || id >= entry_count) {
+    return NULL;
+  }
+  return entries[id].name;
+}
+
+uint8_t MetricsRegistry::type(int id) {
+  return entries[id].type;
+}
+
+void MetricsRegistry::inc(int id, long by) {
+  if (id >= 0 && id < entry_count) {
+    entries[id].value += by;
+  }
+}
+
+void MetricsRegistry::set(int id, long value) {
+  if (id >= 0 && id < entry_count) {
+    entries[id].value = value;
+  }
+}
+
+void MetricsRegistry::setMax(int id, long value) {
+  if (id >= 0 && id < entry_count && value > entries[id].value) {
+    entries[id].value = value;
+  }
+}
+
+void MetricsRegistry::observe(int id, unsigned long value) {
+  if (id >= 0 && id < entry_count && entries[id].histogram) {
+    entries[id].histogram->add(value);
+  }
+}
+
+long MetricsRegistry::get(int id) {
+  if (id < 0 || id >= entry_count) {
+    return 0;
+  }
+  if (entries[id].reader) {
+    return entries[id].reader();
+  }
+  if (entries[id].histogram) {
+    return entries[id].histogram->count;
+  }
+  return entries[id].value;
+}
+
+// values must have room for count() entries, histograms read as their count
+void MetricsRegistry::read(long *values) {
+  for (uint8_t i = 0; i < entry_count; i++) {
+    values[i] = get(i);
+  }
+}
+
+// writes each metric that differs from base (all of them when base is NULL),
+// histograms are written in full whenever their count has changed
+void MetricsRegistry::serialize(JsonDocument &doc, const long *values, const long *base, uint8_t base_count) {
+  for (uint8_t i = 0; i < entry_count; i++) {
+    if (base && i < base_count && values[i] == base[i]) {
+      continue;
+    }
+    if (entries[i].histogram) {
+      entries[i].histogram->serialize(doc.createNestedObject(entries[i].name));
+    } else {
+      doc[entries[i].name] = values[i];
+    }
+  }
+}
+
+// little-endian int32 per metric in registration order, names and types
+// are available once from serializeSchema()
+size_t MetricsRegistry::serializeBinary(const long *values, uint8_t *out, size_t out_len) {
+  size_t len = 0;
+  for (uint8_t i = 0; i < entry_count && len + 4 <= out_len; i++) {
+    uint32_t v = values[i];
+    out[len++] = v & 0xFF;
+    out[len++] = (v >> 8) & 0xFF;
+    out[len++] = (v >> 16) & 0xFF;
+    out[len++] = (v >> 24) & 0xFF;
+  }
+  return len;
+}
+
+void MetricsRegistry::serializeSchema(JsonArray names, JsonArray types) {
+  for (uint8_t i = 0; i < entry_count; i++) {
+    names.add(entries[i].name);
+    types.add(entries[i].type);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef METRICSREGISTRY_HPP
+#define METRICSREGISTRY_HPP
+
+#include <Arduino.h>
+#include "ArduinoJson.h"
+#include "Histogram.hpp"
+
+#ifndef NETTHING_METRICS_MAX
+#define NETTHING_METRICS_MAX 88
+#endif
+
+#define METRIC_TYPE_COUNTER 0
+#define METRIC_TYPE_GAUGE 1
+#define METRIC_TYPE_HISTOGRAM 2
+
+// sampled when a snapshot is taken, must not allocate
+typedef long (*MetricsGaugeReader)();
+
+// Fixed-capacity set of named counters, gauges and histograms. Metrics are
+// registered during setup; updating them never allocates. Ids are indexes
+// in registration order, and -1 (registry full) is accepted and ignored
+// by every update method.
+class MetricsRegistry {
+ private:
+  struct Entry {
+    const char *name;
+    uint8_t type;
+    long value;
+    MetricsGaugeReader reader;
+    Histogram *histogram;
+  };
+  Entry entries[NETTHING_METRICS_MAX];
+  uint8_t entry_count = 0;
+  int add(const char *name, uint8_t type, MetricsGaugeReader reader, Histogram *histogram);
+ public:
+  int addCounter(const char *name);
+  int addGauge(const char *name, MetricsGaugeReader reader=NULL);
+  int addHistogram(const char *name, Histogram *histogram);
+  uint8_t count();
+  size_t jsonCapacity();
+  const char *name(int id);
+  uint8_t type(int id);
+  void inc(int id, long by=1);
+  void set(int id, long value);
+  void setMax(int id, long value);
+  void observe(int id, unsigned long value);
+  long get(int id);
+  void read(long *values);
+  void serialize(JsonDocument &doc, const long *values, const long *base=NULL, uint8_t base_count=0);
+  size_t serializeBinary(const long *values, uint8_t *out, size_t out_len);
+  void serializeSchema(JsonArray names, JsonArray types);
+};
+
+#endif
@@ -3,22 +3,180 @@
 
 using namespace std::placeholders;
 
-NetThing::NetThing(int rx_buffer_len, int tx_buffer_len) {
+static const unsigned long ping_rtt_bounds[] = {5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+static const unsigned long wake_latency_bounds[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000};
+static const unsigned long events_per_frame_bounds[] = {1, 2, 4, 8, 12, 16};
+
+enum {
+  PROFILE_APP,
+  PROFILE_PS_LOOP,
+  PROFILE_RESTART,
+  PROFILE_FILE_TIMEOUT,
+  PROFILE_FILE_READ,
+  PROFILE_FILE_SYNC,
+  PROFILE_TX_DEFERRED,
+  PROFILE_FIRMWARE_STEP,
+  PROFILE_SLEEP,
+  PROFILE_WIFI_CHECK,
+  PROFILE_PING,
+  PROFILE_METRICS_PUSH,
+  PROFILE_RECEIVE_WATCHDOG,
+  PROFILE_EVENT_FLUSH,
+  PROFILE_JSON_PARSE,
+  PROFILE_CMD_FILE_DATA,
+  PROFILE_CMD_FILE_DELETE,
+  PROFILE_CMD_FILE_DIR_QUERY,
+  PROFILE_CMD_FILE_QUERY,
+  PROFILE_CMD_FILE_READ,
+  PROFILE_CMD_FILE_READ_ACK,
+  PROFILE_CMD_FILE_RENAME,
+  PROFILE_CMD_FILE_SYNC_MANIFEST,
+  PROFILE_CMD_FILE_WRITE,
+  PROFILE_CMD_FIRMWARE_DATA,
+  PROFILE_CMD_FIRMWARE_WRITE,
+  PROFILE_CMD_LOOP_PROFILE_QUERY,
+  PROFILE_CMD_NET_LATENCY_QUERY,
+  PROFILE_CMD_NET_LATENCY_RESET,
+  PROFILE_CMD_NET_METRICS_ACK,
+  PROFILE_CMD_NET_METRICS_QUERY,
+  PROFILE_CMD_NET_METRICS_SCHEMA_QUERY,
+  PROFILE_CMD_NET_METRICS_SUBSCRIBE,
+  PROFILE_CMD_PING,
+  PROFILE_CMD_PONG,
+  PROFILE_CMD_RESTART,
+  PROFILE_CMD_SYSTEM_QUERY,
+  PROFILE_CMD_TIME,
+  PROFILE_CMD_TRACE_QUERY,
+  PROFILE_CMD_OTHER,
+  PROFILE_CB_CONNECT,
+  PROFILE_CB_DISCONNECT,
+  PROFILE_CB_RECEIVE_JSON,
+  PROFILE_CB_TRANSFER_STATUS,
+  PROFILE_SLOTS
+};
+
+static_assert(PROFILE_SLOTS <= LOOPPROFILER_MAX_SLOTS, "raise LOOPPROFILER_MAX_SLOTS for the new profile slots");
+
+static const char * const profile_names[PROFILE_SLOTS] = {
+  "app",
+  "ps_loop",
+  "restart",
+  "file_timeout",
+  "file_read",
+  "file_sync",
+  "tx_deferred",
+  "firmware_step",
+  "sleep",
+  "wifi_check",
+  "ping",
+  "metrics_push",
+  "receive_watchdog",
+  "event_flush",
+  "json_parse",
+  "cmd_file_data",
+  "cmd_file_delete",
+  "cmd_file_dir_query",
+  "cmd_file_query",
+  "cmd_file_read",
+  "cmd_file_read_ack",
+  "cmd_file_rename",
+  "cmd_file_sync_manifest",
+  "cmd_file_write",
+  "cmd_firmware_data",
+  "cmd_firmware_write",
+  "cmd_loop_profile_query",
+  "cmd_net_latency_query",
+  "cmd_net_latency_reset",
+  "cmd_net_metrics_ack",
+  "cmd_net_metrics_query",
+  "cmd_net_metrics_schema_query",
+  "cmd_net_metrics_subscribe",
+  "cmd_ping",
+  "cmd_pong",
+  "cmd_restart",
+  "cmd_system_query",
+  "cmd_time",
+  "cmd_trace_query",
+  "cmd_other",
+  "cb_connect",
+  "cb_disconnect",
+  "cb_receive_json",
+  "cb_transfer_status",
+};
+
+NetThing::NetThing(int rx_buffer_len, int tx_buffer_len):
+  shaper(metrics),
+  ping_rtt(ping_rtt_bounds, sizeof(ping_rtt_bounds) / sizeof(ping_rtt_bounds[0])),
+  wake_latency(wake_latency_bounds, sizeof(wake_latency_bounds) / sizeof(wake_latency_bounds[0])),
+  events_per_frame(events_per_frame_bounds, sizeof(events_per_frame_bounds) / sizeof(events_per_frame_bounds[0])),
+  profiler(profile_names, PROFILE_SLOTS),
+  rx_doc(512)
+{
   snprintf(chip_id, sizeof(chip_id), "%06x", ESP.getChipId());
   server_username = chip_id;
 
   setSyncInterval(3600);
 
-  last_wifi_check = millis();
   wifiEventConnectHandler = WiFi.onStationModeGotIP(std::bind(&NetThing::wifiConnectHandler, this));
   wifiEventDisconnectHandler = WiFi.onStationModeDisconnected(std::bind(&NetThing::wifiDisconnectHandler, this));
 
-  ps = new PacketStream(rx_buffer_len, tx_buffer_len);
+  metrics.addGauge("esp_free_cont_stack", []() -> long { return ESP.getFreeContStack(); });
+  metrics.addGauge("esp_free_heap", []() -> long { return ESP.getFreeHeap(); });
+  metrics.addGauge("esp_heap_fragmentation", []() -> long { return ESP.getHeapFragmentation(); });
+  metrics.addGauge("esp_max_free_block_size", []() -> long { return ESP.getMaxFreeBlockSize(); });
+
+  ps = new PacketStream(rx_buffer_len, tx_buffer_len, metrics, timers);
+  // decoded base64 is never more than 3/4 of the packet it came in
+  rx_scratch_len = rx_buffer_len * 3 / 4 + 3;
+  rx_scratch = new uint8_t[rx_scratch_len];
   ps->onConnect(std::bind(&NetThing::psConnectHandler, this));
   ps->onDisconnect(std::bind(&NetThing::psDisconnectHandler, this));
   ps->onReceivePacket(std::bind(&NetThing::psReceiveHandler, this, _1, _2));
 
-  file_writer = new FileWriter;
+  metric_json_parse_errors = metrics.addCounter("net_json_parse_errors");
+  metric_json_parse_ok = metrics.addCounter("net_json_parse_ok");
+  metric_json_parse_max_usage = metrics.addGauge("net_json_parse_max_usage");
+  metric_wifi_reconnections = metrics.addCounter("net_wifi_reconns");
+  metric_wifi_check_errors = metrics.addCounter("net_wifi_check_errors");
+  metrics.addGauge("net_wifi_rssi", []() -> long { return WiFi.RSSI(); });
+  metric_ping_sent = metrics.addCounter("net_ping_sent");
+  metric_ping_lost = metrics.addCounter("net_ping_lost");
+  metric_ping_unmatched = metrics.addCounter("net_ping_unmatched");
+  metric_file_payload_bytes = metrics.addCounter("net_file_payload_bytes");
+  metric_file_flash_bytes = metrics.addCounter("net_file_flash_bytes");
+  metric_file_flash_writes = metrics.addCounter("net_file_flash_writes");
+  metric_file_flash_pages = metrics.addCounter("net_file_flash_pages");
+  metric_file_seeks = metrics.addCounter("net_file_seeks");
+  metric_file_read_bytes = metrics.addCounter("net_file_read_bytes");
+  metric_file_read_chunks = metrics.addCounter("net_file_read_chunks");
+  metric_sleep_count = metrics.addCounter("net_sleep_count");
+  metric_sleep_ms = metrics.addCounter("net_sleep_ms");
+  metric_sleep_wakes = metrics.addCounter("net_sleep_wakes");
+  metrics.addHistogram("net_wake_latency", &wake_latency);
+  metric_clock_drift_ppb = metrics.addGauge("net_clock_drift_ppb");
+  metric_clock_error_ms = metrics.addGauge("net_clock_error_ms");
+  metric_clock_delay_ms = metrics.addGauge("net_clock_delay_ms");
+  metric_clock_steps = metrics.addCounter("net_clock_steps");
+  metric_event_frames = metrics.addCounter("net_event_frames");
+  metric_events_batched = metrics.addCounter("net_events_batched");
+  metric_events_dropped = metrics.addCounter("net_events_dropped");
+  metric_event_bytes_saved = metrics.addCounter("net_event_bytes_saved");
+  metrics.addHistogram("net_events_per_frame", &events_per_frame);
+  metrics.addHistogram("net_ping_rtt", &ping_rtt);
+#ifdef NETTHING_ALLOC_COUNTING
+  metrics.addGauge("net_alloc_count", []() -> long { return AllocCounter::count(); });
+  metrics.addGauge("net_alloc_bytes", []() -> long { return AllocCounter::bytes(); });
+  metrics.addGauge("net_free_count", []() -> long { return AllocCounter::frees(); });
+  metric_hot_path_allocs = metrics.addCounter("net_hot_path_allocs");
+#endif
+
+  for (int i = 0; i < NETTHING_FILE_WRITERS; i++) {
+    file_writers[i] = new FileWriter(*fs);
+    file_transfer_ids[i][0] = '\0';
+  }
+  file_reader = new FileReader(*fs);
+  file_read_transfer[0] = '\0';
+  file_read_filename[0] = '\0';
   firmware_writer = new FirmwareWriter;
 }
 
@@ -35,37 +193,131 @@ String NetThing::canonifyFilename(String filename) {
   }
 }
 
+void NetThing::fileTransferKey(const JsonDocument &obj, char *key, size_t key_len) {
+  // sessions are keyed by the server's transfer id, or by filename for
+  // servers that only ever run one transfer at a time
+  JsonVariantConst transfer = obj["transfer"];
+  if (transfer.is<const char*>()) {
+    strncpy(key, transfer.as<const char*>(), key_len - 1);
+    key[key_len - 1] = '\0';
+  } else if (!transfer.isNull()) {
+    snprintf(key, key_len, "#%ld", transfer.as<long>());
+  } else {
+    const char *filename = obj["filename"];
+    strncpy(key, filename ? filename : "", key_len - 1);
+    key[key_len - 1] = '\0';
+  }
+}
+
+int NetThing::findFileWriter(const char *key) {
+  for (int i = 0; i < file_writer_count; i++) {
+    if (file_writers[i]->running() && strcmp(file_transfer_ids[i], key) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int NetThing::allocFileWriter(const char *key, const char *path) {
+  int slot = -1;
+  for (int i = 0; i < file_writer_count; i++) {
+    if (!file_writers[i]->running()) {
+      if (slot < 0) {
+        slot = i;
+      }
+    } else if (strcmp(file_transfer_ids[i], key) == 0 ||
+               strcmp(file_writers[i]->filename(), path) == 0) {
+      // restarted transfer, or a newer transfer of the same file
+      file_writers[i]->abort();
+      slot = i;
+      break;
+    }
+  }
+  if (slot >= 0) {
+    strncpy(file_transfer_ids[slot], key, NETTHING_TRANSFER_ID_LEN);
+    file_transfer_ids[slot][NETTHING_TRANSFER_ID_LEN] = '\0';
+  }
+  return slot;
+}
+
+void NetThing::abortFileWriters() {
+  for (int i = 0; i < NETTHING_FILE_WRITERS; i++) {
+    if (file_writers[i]->running()) {
+      file_writers[i]->abort();
+    }
+  }
+  updateFileTimeout();
+}
+
+// The idle check only runs while a file write is in progress, so that an
+// idle device has no periodic work.
+void NetThing::updateFileTimeout() {
+  bool running = false;
+  for (int i = 0; i < NETTHING_FILE_WRITERS; i++) {
+    if (file_writers[i]->running()) {
+      running = true;
+      break;
+    }
+  }
+  if (running && !timers.active(file_timeout_timer)) {
+    file_timeout_timer = timers.add(1000, [this]() {
+      uint32_t start = micros();
+      checkFileTimeouts();
+      profiler.add(PROFILE_FILE_TIMEOUT, micros() - start);
+    }, 1000);
+  } else if (!running && file_timeout_timer >= 0) {
+    timers.cancel(file_timeout_timer);
+    file_timeout_timer = -1;
+  }
+}
+
 void NetThing::psConnectHandler() {
-  StaticJsonDocument<JSON_OBJECT_SIZE(6) + 128> doc;
+  // the static half of system_info rides along, so servers need not send
+  // system_query on every reconnect
+  StaticJsonDocument<JSON_OBJECT_SIZE(5)> doc;
   doc[cmd_key] = "hello";
   doc["clientid"] = server_username;
   doc["username"] = server_username;
   doc["password"] = server_password;
   doc["esp_chip_model"] = "ESP8266";
-  doc["esp_sketch_md5"] = ESP.getSketchMD5();
-  sendJson(doc);
+  sendControl(doc, systemIdentity());
   if (connect_callback) {
+    uint32_t start = micros();
     connect_callback();
+    profiler.add(PROFILE_CB_CONNECT, micros() - start);
   }
 }
 
 void NetThing::psDisconnectHandler() {
-  file_writer->abort();
+  abortFileWriters();
+  file_reader->abort();
+  manifestReset();
+  shaper.clear();
+  ping_outstanding = false;
+  // the server subscribes again after reconnecting
+  metrics_push_interval = 0;
+  timers.cancel(metrics_push_timer);
   if (disconnect_callback) {
+    uint32_t start = micros();
     disconnect_callback();
+    profiler.add(PROFILE_CB_DISCONNECT, micros() - start);
   }
 }
 
 void NetThing::loop() {
+  profiler.loopStart(PROFILE_APP);
   last_loop = millis();
   if (!loop_watchdog_started) {
-      loop_watchdog_ticker.attach(1, std::bind(&NetThing::loopTimeoutHandler, this));
+      startLoopWatchdog();
       loop_watchdog_started = true;
   }
 
+  uint32_t phase_start = micros();
   ps->loop();
+  profiler.add(PROFILE_PS_LOOP, micros() - phase_start);
 
   if (restart_firmware) {
+    phase_start = micros();
     if (restart_reason_callback) {
       // main application may restart if convenient
       restart_reason_callback(false, restart_firmware, NETTHING_RESTART_FIRMWARE);
@@ -77,46 +329,125 @@ void NetThing::loop() {
       restarter.restartWithReason(NETTHING_RESTART_FIRMWARE);
       delay(5000);
     }
+    profiler.add(PROFILE_RESTART, micros() - phase_start);
   }
 
-  if (file_writer) {
-    if (file_writer->idleMillis() > 30000) {
-      Serial.println("NetThing: timing-out file writer");
-      file_writer->abort();
-      StaticJsonDocument<JSON_OBJECT_SIZE(2)> doc;
-      doc[cmd_key] = "error";
-      doc["error"] = "file write timed-out";
-      sendJson(doc);
-    }
+  // periodic work, callbacks record their own profile slots
+  timers.run();
+
+  if (manifest_busy) {
+    phase_start = micros();
+    manifestStep();
+    profiler.add(PROFILE_FILE_SYNC, micros() - phase_start);
   }
 
-  if (wifi_check_interval) {
-    if ((long)(millis() - last_wifi_check) > wifi_check_interval) {
-      last_wifi_check = millis();
-      if (!WiFi.isConnected()) {
-        wifi_check_errors++;
-        Serial.println("NetThing: forcing a wifi reconnect");
-        WiFi.reconnect();
-      }
+  if (shaper.pending()) {
+    phase_start = micros();
+    shaper.drain(*ps);
+    profiler.add(PROFILE_TX_DEFERRED, micros() - phase_start);
+  }
+
+  if (firmware_writer->pending()) {
+    // at most one sector erase and program per loop
+    phase_start = micros();
+    firmware_writer->step();
+    profiler.add(PROFILE_FIRMWARE_STEP, micros() - phase_start);
+  }
+
+  if (file_reader->running()) {
+    phase_start = micros();
+    bool file_read_work = true;
+    if (file_reader->idleMillis() > (long)file_idle_timeout) {
+      TRACE(TRACE_WARN, TRACE_NT_FILE_READ_TIMEOUT, file_reader->idleMillis(), 0);
+      sendFileReadError("file read timed-out");
+      file_reader->abort();
+    } else if (file_reader->hashing()) {
+      // resumed read, catch up on the digest one chunk at a time
+      file_reader->hashStep();
+    } else if (ps->connected()) {
+      sendFileReadChunk();
+    } else {
+      // waiting for the connection, nothing to time
+      file_read_work = false;
+    }
+    if (file_read_work) {
+      profiler.add(PROFILE_FILE_READ, micros() - phase_start);
     }
   }
 
-  if (receive_watchdog_timeout > 0) {
-    if ((long)(millis() - last_packet_received) > receive_watchdog_timeout) {
-      Serial.println("NetThing: receive watchdog triggered, restarting");
-      if (restart_reason_callback) {
-        // main application may restart if convenient
-        restart_reason_callback(false, restart_firmware, NETTHING_RESTART_RECEIVE_WATCHDOG);
-      } else if (restart_callback) {
-        // main application may restart if convenient
-        restart_callback(false, restart_firmware);
-      } else {
-        // no handler available, perform our own restart immediately
-        restarter.restartWithReason(NETTHING_RESTART_RECEIVE_WATCHDOG);
-        delay(5000);
-      }
+  if (power_mode != NETTHING_POWER_NONE && enabled) {
+    powerSleep();
+  }
+
+  profiler.loopEnd();
+}
+
+void NetThing::powerSleep() {
+  long ms = nextDeadline();
+  if (ms < 0 || (unsigned long)ms > power_max_sleep) {
+    ms = power_max_sleep;
+  }
+  if (ms < NETTHING_POWER_MIN_SLEEP) {
+    return;
+  }
+  uint32_t start = micros();
+  uint32_t woken = ps->sleep(ms);
+  uint32_t end = micros();
+  metrics.inc(metric_sleep_count);
+  metrics.inc(metric_sleep_ms, (end - start) / 1000);
+  if (woken) {
+    metrics.inc(metric_sleep_wakes);
+    wake_latency.add(end - woken);
+  }
+  profiler.add(PROFILE_SLEEP, end - start);
+}
+
+void NetThing::startLoopWatchdog() {
+  // a 1s tick keeps the CPU from settling, so check less often while sleeping
+  unsigned long period = 1000;
+  if (power_mode != NETTHING_POWER_NONE && loop_watchdog_timeout / 4 > period) {
+    period = loop_watchdog_timeout / 4;
+  }
+  loop_watchdog_ticker.attach_ms(period, std::bind(&NetThing::loopTimeoutHandler, this));
+}
+
+void NetThing::checkFileTimeouts() {
+  for (int i = 0; i < file_writer_count; i++) {
+    if (file_writers[i]->idleMillis() > (long)file_idle_timeout) {
+      TRACE(TRACE_WARN, TRACE_NT_FILE_TIMEOUT, file_writers[i]->idleMillis(), i);
+      StaticJsonDocument<JSON_OBJECT_SIZE(4)> doc;
+      doc[cmd_key] = "file_write_error";
+      doc["filename"] = file_writers[i]->filename();
+      doc["transfer"] = file_transfer_ids[i];
+      doc["error"] = "file write timed-out";
+      sendControl(doc);
+      file_writers[i]->abort();
     }
   }
+  updateFileTimeout();
+}
+
+void NetThing::checkWifi() {
+  if (!WiFi.isConnected()) {
+    metrics.inc(metric_wifi_check_errors);
+    TRACE(TRACE_WARN, TRACE_NT_WIFI_FORCE_RECONNECT, metrics.get(metric_wifi_check_errors), 0);
+    WiFi.reconnect();
+  }
+}
+
+void NetThing::receiveWatchdog() {
+  TRACE(TRACE_ERROR, TRACE_NT_RECEIVE_WATCHDOG, millis() - last_packet_received, 0);
+  if (restart_reason_callback) {
+    // main application may restart if convenient
+    restart_reason_callback(false, restart_firmware, NETTHING_RESTART_RECEIVE_WATCHDOG);
+  } else if (restart_callback) {
+    // main application may restart if convenient
+    restart_callback(false, restart_firmware);
+  } else {
+    // no handler available, perform our own restart immediately
+    restarter.restartWithReason(NETTHING_RESTART_RECEIVE_WATCHDOG);
+    delay(5000);
+  }
 }
 
 void NetThing::onConnect(NetThingConnectHandler callback) {
@@ -154,17 +485,39 @@ void NetThing::allowFirmwareSync(bool allow) {
 }
 
 bool NetThing::sendJson(const JsonDocument &doc, bool now) {
-  int packet_len = measureJson(doc);
-  char *packet = new char[packet_len+1];
-  serializeJson(doc, packet, packet_len+1);
+  return sendFrame(doc, TRAFFIC_JSON);
+}
+
+bool NetThing::sendControl(const JsonDocument &doc, const char *prefix) {
+  return sendFrame(doc, TRAFFIC_CONTROL, prefix);
+}
 
+// channel -1 uses the one assigned to traffic_class by setTrafficChannel()
+bool NetThing::sendFrame(const JsonDocument &doc, uint8_t traffic_class, const char *prefix, int channel) {
+  if (channel < 0) {
+    channel = traffic_channels[traffic_class];
+  }
+  if (shaper.limited(traffic_class)) {
+    size_t header_len = ps->headerLength();
+    size_t len = measureJson(doc) + header_len;
+    if (prefix) {
+      len += strlen(prefix) + 1;
+    }
+    if (!shaper.admit(traffic_class, len, header_len, ps->txRoom(channel))) {
+      return shaper.defer(traffic_class, doc, len, header_len, prefix, channel);
+    }
+  }
+
+  size_t packet_len = 0;
+  bool result = ps->sendJson(doc, &packet_len, prefix, channel);
+
+  TRACE(TRACE_DEBUG, TRACE_NT_SEND_JSON, packet_len, doc.memoryUsage());
   if (debug_json) {
-    Serial.printf("NetThing: send usage=%d/%d len=%d json=", doc.memoryUsage(), doc.capacity(), packet_len);
-    Serial.println(packet);
+    Serial.printf("NetThing: send usage=%d/%d len=%d json=", doc.memoryUsage(), doc.capacity(), (int)packet_len);
+    serializeJson(doc, Serial);
+    Serial.println();
   }
 
-  bool result = ps->send((uint8_t*)packet, packet_len);
-  delete[] packet;
   return result;
 }
 
@@ -199,6 +552,15 @@ void NetThing::setReconnectMaxTime(unsigned long ms) {
   ps->setReconnectMaxTime(ms);
 }
 
+void NetThing::setReconnectLinkUpSplay(unsigned long ms) {
+  ps->setLinkUpSplay(ms);
+}
+
+void NetThing::setLowLatency(bool fast_receive, bool fast_send) {
+  ps->setFastReceive(fast_receive);
+  ps->setFastSend(fast_send);
+}
+
 void NetThing::setServer(const char *host, int port,
                               bool secure, bool verify,
                               const uint8_t *fingerprint1,
@@ -206,12 +568,120 @@ void NetThing::setServer(const char *host, int port,
   ps->setServer(host, port, secure, verify, fingerprint1, fingerprint2);
 }
 
+bool NetThing::addServer(const char *host, int port,
+                         bool secure, bool verify,
+                         const uint8_t *fingerprint1,
+                         const uint8_t *fingerprint2) {
+  return ps->addServer(host, port, secure, verify, fingerprint1, fingerprint2);
+}
+
+void NetThing::setServerFailover(unsigned long errors, unsigned long failback_ms) {
+  ps->setFailover(errors, failback_ms);
+}
+
+// Secure servers are always resolved by the TCP client, which needs the
+// hostname for TLS, so the cache only applies to plain ones.
+void NetThing::setDnsCache(unsigned long cache_ms, unsigned long timeout_ms) {
+  ps->setDnsCache(cache_ms, timeout_ms);
+}
+
 void NetThing::setReceiveWatchdog(unsigned long timeout) {
   receive_watchdog_timeout = timeout;
+  timers.cancel(receive_watchdog_timer);
+  receive_watchdog_timer = -1;
+  if (timeout > 0) {
+    // counts from now, or from the most recent packet, then keeps asking
+    // every second until the application restarts or a packet arrives
+    receive_watchdog_timer = timers.add(timeout, [this]() {
+      uint32_t start = micros();
+      receiveWatchdog();
+      profiler.add(PROFILE_RECEIVE_WATCHDOG, micros() - start);
+    }, 1000);
+  }
 }
 
 void NetThing::setLoopWatchdog(unsigned long timeout) {
   loop_watchdog_timeout = timeout;
+  if (loop_watchdog_started) {
+    startLoopWatchdog();
+  }
+}
+
+// Limits a traffic class (TRAFFIC_CONTROL, TRAFFIC_JSON, TRAFFIC_EVENT or
+// TRAFFIC_BULK) to rate bytes per second with bursts of up to burst bytes.
+// Frames over the limit are dropped, coalesced or deferred according to
+// policy.
+void NetThing::setRateLimit(uint8_t traffic_class, unsigned long rate, unsigned long burst, uint8_t policy) {
+  shaper.setLimit(traffic_class, rate, burst, policy);
+}
+
+// Application traffic is refused while it would leave less than this many
+// bytes free in the transmit buffer, keeping room for protocol replies.
+void NetThing::setControlReserve(size_t bytes) {
+  shaper.setReserve(bytes);
+}
+
+// Gives channel its own transmit queue of tx_buffer_len bytes, so that its
+// frames are interleaved with other channels' by weighted round-robin
+// rather than queued behind them. Channel 0 always exists.
+bool NetThing::setChannel(uint8_t channel, size_t tx_buffer_len, uint8_t weight) {
+  return ps->setChannel(channel, tx_buffer_len, weight);
+}
+
+// Requires a server that expects the channel id byte in each frame header.
+void NetThing::setChannelHeader(bool enable) {
+  ps->setChannelHeader(enable);
+}
+
+void NetThing::setTrafficChannel(uint8_t traffic_class, uint8_t channel) {
+  if (traffic_class < TRAFFIC_CLASSES && channel < PACKETSTREAM_MAX_CHANNELS) {
+    traffic_channels[traffic_class] = channel;
+  }
+}
+
+// file_read_data chunks are sent on this channel, same as
+// setTrafficChannel(TRAFFIC_BULK, channel)
+void NetThing::setBulkChannel(uint8_t channel) {
+  setTrafficChannel(TRAFFIC_BULK, channel);
+}
+
+// Raw packets received on channel, which then bypass JSON command parsing.
+void NetThing::onChannelPacket(uint8_t channel, PacketStreamReceivePacketHandler callback) {
+  ps->onReceivePacket(channel, callback);
+}
+
+// Events sent within window_ms of the first queued one share a frame, see
+// flushEvents(). Zero sends every event immediately.
+void NetThing::setEventBatching(unsigned long window_ms) {
+  if (window_ms == 0) {
+    flushEvents();
+  } else if (!event_batcher) {
+    event_batcher = new EventBatcher;
+  }
+  event_batch_window = window_ms;
+}
+
+void NetThing::setPowerSave(uint8_t mode, unsigned long max_sleep_ms) {
+  if (power_mode == NETTHING_POWER_NONE && mode != NETTHING_POWER_NONE) {
+    power_saved_sleep_mode = WiFi.getSleepMode();
+  }
+  if (power_mode != NETTHING_POWER_NONE && mode == NETTHING_POWER_NONE) {
+    WiFi.setSleepMode(power_saved_sleep_mode);
+  }
+  power_mode = mode;
+  power_max_sleep = max_sleep_ms;
+  if (loop_watchdog_timeout > 0 && power_max_sleep > loop_watchdog_timeout / 2) {
+    // never sleep through the loop watchdog
+    power_max_sleep = loop_watchdog_timeout / 2;
+  }
+  if (mode == NETTHING_POWER_LIGHT) {
+    WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
+  } else if (mode == NETTHING_POWER_MODEM) {
+    WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+  }
+  if (loop_watchdog_started) {
+    startLoopWatchdog();
+  }
 }
 
 void NetThing::setWiFi(const char *ssid, const char *password) {
@@ -220,11 +690,59 @@ void NetThing::setWiFi(const char *ssid, const char *password) {
   WiFi.enableAP(false);
   WiFi.enableSTA(true);
   WiFi.begin(ssid, password);
-  last_wifi_check = millis();
+  timers.reschedule(wifi_check_timer, wifi_check_interval);
 }
 
 void NetThing::setWifiCheckInterval(unsigned long interval) {
   wifi_check_interval = interval;
+  timers.cancel(wifi_check_timer);
+  wifi_check_timer = -1;
+  if (interval > 0) {
+    wifi_check_timer = timers.add(interval, [this]() {
+      uint32_t start = micros();
+      checkWifi();
+      profiler.add(PROFILE_WIFI_CHECK, micros() - start);
+    }, interval);
+  }
+}
+
+void NetThing::setPingInterval(unsigned long interval) {
+  ping_interval = interval;
+  timers.cancel(ping_timer);
+  ping_timer = -1;
+  if (interval > 0) {
+    ping_timer = timers.add(interval, [this]() {
+      uint32_t start = micros();
+      if (ps->connected()) {
+        sendPing();
+      }
+      profiler.add(PROFILE_PING, micros() - start);
+    }, interval);
+  }
+}
+
+void NetThing::setFileSystem(FS &filesystem) {
+  fs = &filesystem;
+  system_identity = ""; // fs_total_bytes has changed
+  file_reader->setFileSystem(filesystem);
+  for (int i = 0; i < NETTHING_FILE_WRITERS; i++) {
+    file_writers[i]->setFileSystem(filesystem);
+  }
+}
+
+void NetThing::setFileTransfers(uint8_t count, unsigned long idle_timeout) {
+  if (count < 1) {
+    count = 1;
+  } else if (count > NETTHING_FILE_WRITERS) {
+    count = NETTHING_FILE_WRITERS;
+  }
+  for (int i = count; i < NETTHING_FILE_WRITERS; i++) {
+    if (file_writers[i]->running()) {
+      file_writers[i]->abort();
+    }
+  }
+  file_writer_count = count;
+  file_idle_timeout = idle_timeout;
 }
 
 void NetThing::start() {
@@ -239,14 +757,15 @@ void NetThing::stop() {
 }
 
 void NetThing::wifiConnectHandler() {
-  last_wifi_check = millis();
-  Serial.println("NetThing: wifi connected");
-  wifi_reconnections++;
+  timers.reschedule(wifi_check_timer, wifi_check_interval);
+  TRACE(TRACE_INFO, TRACE_NT_WIFI_CONNECTED, 0, 0);
+  metrics.inc(metric_wifi_reconnections);
+  ps->linkUp();
 }
 
 void NetThing::wifiDisconnectHandler() {
-  last_wifi_check = millis();
-  Serial.println("NetThing: wifi disconnected");
+  timers.reschedule(wifi_check_timer, wifi_check_interval);
+  TRACE(TRACE_INFO, TRACE_NT_WIFI_DISCONNECTED, 0, 0);
 }
 
 void NetThing::sendFileInfo(const char *filename)
@@ -257,7 +776,7 @@ void NetThing::sendFileInfo(const char *filename)
   obj["filename"] = filename;
   obj["local_filename"] = path;
 
-  File f = SPIFFS.open(path, "r");
+  File f = fs->open(path, "r");
   if (f) {
     MD5Builder md5;
     md5.begin();
@@ -276,105 +795,232 @@ void NetThing::sendFileInfo(const char *filename)
     obj["md5"] = (char*)NULL;
   }
 
-  sendJson(obj);
+  sendControl(obj);
 }
 
 void NetThing::jsonReceiveHandler(const JsonDocument &doc) {
   last_packet_received = millis();
+  timers.reschedule(receive_watchdog_timer, receive_watchdog_timeout);
+  uint32_t start = micros();
+  uint32_t allocs_before = AllocCounter::count();
+  uint32_t alloc_bytes_before = AllocCounter::bytes();
+  uint8_t slot = PROFILE_CMD_OTHER;
   if (doc.containsKey(cmd_key)) {
     const char *cmd = doc[cmd_key];
     if (strcmp(cmd, "file_data") == 0) {
-      if (allow_file_sync) cmdFileData(doc);
+      slot = PROFILE_CMD_FILE_DATA;
+      rx_hot_path = !doc["eof"].as<bool>();
+      if (allow_file_sync) {
+        cmdFileData(doc);
+        updateFileTimeout();
+      }
     } else if (strcmp(cmd, "file_delete") == 0) {
+      slot = PROFILE_CMD_FILE_DELETE;
       if (allow_file_sync) cmdFileDelete(doc);
     } else if (strcmp(cmd, "file_dir_query") == 0) {
+      slot = PROFILE_CMD_FILE_DIR_QUERY;
       if (allow_file_sync) cmdFileDirQuery(doc);
     } else if (strcmp(cmd, "file_query") == 0) {
+      slot = PROFILE_CMD_FILE_QUERY;
       if (allow_file_sync) cmdFileQuery(doc);
+    } else if (strcmp(cmd, "file_read") == 0) {
+      slot = PROFILE_CMD_FILE_READ;
+      if (allow_file_sync) cmdFileRead(doc);
+    } else if (strcmp(cmd, "file_read_ack") == 0) {
+      slot = PROFILE_CMD_FILE_READ_ACK;
+      if (allow_file_sync) cmdFileReadAck(doc);
     } else if (strcmp(cmd, "file_rename") == 0) {
+      slot = PROFILE_CMD_FILE_RENAME;
       if (allow_file_sync) cmdFileRename(doc);
+    } else if (strcmp(cmd, "file_sync_manifest") == 0) {
+      slot = PROFILE_CMD_FILE_SYNC_MANIFEST;
+      if (allow_file_sync) cmdFileSyncManifest(doc);
     } else if (strcmp(cmd, "file_write") == 0) {
-      if (allow_file_sync) cmdFileWrite(doc);
+      slot = PROFILE_CMD_FILE_WRITE;
+      if (allow_file_sync) {
+        cmdFileWrite(doc);
+        updateFileTimeout();
+      }
     } else if (strcmp(cmd, "firmware_data") == 0) {
+      slot = PROFILE_CMD_FIRMWARE_DATA;
       if (allow_firmware_sync) cmdFirmwareData(doc);
     } else if (strcmp(cmd, "firmware_write") == 0) {
+      slot = PROFILE_CMD_FIRMWARE_WRITE;
       if (allow_firmware_sync) cmdFirmwareWrite(doc);
     } else if (strcmp(cmd, "keepalive") == 0) {
-      // ignore
+      rx_hot_path = true;
+    } else if (strcmp(cmd, "loop_profile_query") == 0) {
+      slot = PROFILE_CMD_LOOP_PROFILE_QUERY;
+      cmdLoopProfileQuery(doc);
     } else if (strcmp(cmd, "ping") == 0) {
+      slot = PROFILE_CMD_PING;
+      rx_hot_path = true;
       cmdPing(doc);
     } else if (strcmp(cmd, "pong") == 0) {
-      // ignore
+      slot = PROFILE_CMD_PONG;
+      cmdPong(doc);
     } else if (strcmp(cmd, "ready") == 0) {
       // ignore
     } else if (strcmp(cmd, "reset") == 0) {
+      slot = PROFILE_CMD_RESTART;
       cmdRestart(doc);
     } else if (strcmp(cmd, "restart") == 0) {
+      slot = PROFILE_CMD_RESTART;
       cmdRestart(doc);
+    } else if (strcmp(cmd, "net_latency_query") == 0) {
+      slot = PROFILE_CMD_NET_LATENCY_QUERY;
+      cmdNetLatencyQuery(doc);
+    } else if (strcmp(cmd, "net_latency_reset") == 0) {
+      slot = PROFILE_CMD_NET_LATENCY_RESET;
+      cmdNetLatencyReset(doc);
+    } else if (strcmp(cmd, "net_metrics_ack") == 0) {
+      slot = PROFILE_CMD_NET_METRICS_ACK;
+      cmdNetMetricsAck(doc);
     } else if (strcmp(cmd, "net_metrics_query") == 0) {
+      slot = PROFILE_CMD_NET_METRICS_QUERY;
       cmdNetMetricsQuery(doc);
+    } else if (strcmp(cmd, "net_metrics_schema_query") == 0) {
+      slot = PROFILE_CMD_NET_METRICS_SCHEMA_QUERY;
+      cmdNetMetricsSchemaQuery(doc);
+    } else if (strcmp(cmd, "net_metrics_subscribe") == 0) {
+      slot = PROFILE_CMD_NET_METRICS_SUBSCRIBE;
+      cmdNetMetricsSubscribe(doc);
     } else if (strcmp(cmd, "system_query") == 0) {
+      slot = PROFILE_CMD_SYSTEM_QUERY;
       cmdSystemQuery(doc);
     } else if (strcmp(cmd, "time") == 0) {
+      slot = PROFILE_CMD_TIME;
       cmdTime(doc);
+    } else if (strcmp(cmd, "trace_query") == 0) {
+      slot = PROFILE_CMD_TRACE_QUERY;
+      cmdTraceQuery(doc);
     } else {
       // unknown command, refer to application
       if (receivejson_callback) {
+        slot = PROFILE_CB_RECEIVE_JSON;
         receivejson_callback(doc);
       }
     }
   } else {
     // no command, refer to application
     if (receivejson_callback) {
+      slot = PROFILE_CB_RECEIVE_JSON;
       receivejson_callback(doc);
     }
   }
+  profiler.add(slot, micros() - start,
+               AllocCounter::count() - allocs_before,
+               AllocCounter::bytes() - alloc_bytes_before);
+}
+
+void NetThing::transferStatus(const char *filename, int progress, bool active, bool changed) {
+  if (transfer_status_callback) {
+    uint32_t start = micros();
+    transfer_status_callback(filename, progress, active, changed);
+    profiler.add(PROFILE_CB_TRANSFER_STATUS, micros() - start);
+  }
+}
+
+void NetThing::cmdLoopProfileQuery(const JsonDocument &doc) {
+  DynamicJsonDocument reply(JSON_OBJECT_SIZE(3) + LOOPPROFILER_JSON_SIZE(PROFILE_SLOTS));
+  reply[cmd_key] = "loop_profile_info";
+  reply["millis"] = millis();
+  profiler.serialize(reply.createNestedObject("profile"));
+  if (reply.overflowed()) {
+    // never send a profile with phases silently missing
+    reply.clear();
+    reply[cmd_key] = "loop_profile_error";
+    reply["error"] = "profile too large";
+    sendControl(reply);
+    return;
+  }
+  reply.shrinkToFit();
+  sendControl(reply);
+  if (doc["reset"]) {
+    profiler.reset();
+  }
 }
 
 void NetThing::cmdFileData(const JsonDocument &obj)
 {
+  // strings are linked from rx_doc rather than copied, so this stays on the stack
+  StaticJsonDocument<JSON_OBJECT_SIZE(9)> reply;
+  const char *filename = obj["filename"];
+
+  if (obj.containsKey("transfer")) {
+    reply["transfer"] = obj["transfer"];
+  }
+
+  char key[NETTHING_TRANSFER_ID_LEN + 1];
+  fileTransferKey(obj, key, sizeof(key));
+  int slot = findFileWriter(key);
+  if (slot < 0) {
+    reply[cmd_key] = "file_write_error";
+    reply["filename"] = filename;
+    reply["error"] = "no such transfer";
+    sendControl(reply);
+    return;
+  }
+  FileWriter *file_writer = file_writers[slot];
+
   const char *b64 = obj["data"].as<const char*>();
+  if (!b64) {
+    b64 = "";
+  }
   unsigned int binary_length = decode_base64_length((unsigned char*)b64);
-  uint8_t *binary = new uint8_t[binary_length];
-  binary_length = decode_base64((unsigned char*)b64, binary);
-
-  DynamicJsonDocument reply(512);
+  if (binary_length > rx_scratch_len) {
+    reply[cmd_key] = "file_write_error";
+    reply["filename"] = filename;
+    reply["error"] = "chunk too large";
+    file_writer->abort();
+    sendControl(reply);
+    return;
+  }
+  binary_length = decode_base64((unsigned char*)b64, rx_scratch);
 
-  if (file_writer->add(binary, binary_length, obj["position"])) {
-    delete[] binary;
+  if (file_writer->add(rx_scratch, binary_length, obj["position"])) {
     if (obj["eof"].as<bool>() == 1) {
       if (file_writer->commit()) {
         // finished and successful
+        metrics.inc(metric_file_payload_bytes, file_writer->payloadBytes());
+        metrics.inc(metric_file_flash_bytes, file_writer->flashBytes());
+        metrics.inc(metric_file_flash_writes, file_writer->flashWrites());
+        metrics.inc(metric_file_flash_pages, file_writer->flashPages());
+        metrics.inc(metric_file_seeks, file_writer->seekCount());
         reply[cmd_key] = "file_write_ok";
-        reply["filename"] = obj["filename"];
-        sendJson(reply);
-        sendFileInfo(obj["filename"]);
+        reply["filename"] = filename;
+        reply["payload_bytes"] = file_writer->payloadBytes();
+        reply["flash_bytes"] = file_writer->flashBytes();
+        reply["flash_writes"] = file_writer->flashWrites();
+        reply["flash_pages"] = file_writer->flashPages();
+        reply["seeks"] = file_writer->seekCount();
+        sendControl(reply);
+        sendFileInfo(filename);
         if (transfer_status_callback) {
-          String path = canonifyFilename(obj["filename"]);
-          transfer_status_callback(path.c_str(), 100, false, true);
+          String path = canonifyFilename(filename);
+          transferStatus(path.c_str(), 100, false, true);
         }
       } else {
         // finished but commit failed
         reply[cmd_key] = "file_write_error";
-        reply["filename"] = obj["filename"];
+        reply["filename"] = filename;
         reply["error"] = "file_writer->commit() failed";
         file_writer->abort();
-        sendJson(reply);
+        sendControl(reply);
       }
     } else {
       // more data required
       reply[cmd_key] = "file_continue";
-      reply["filename"] = obj["filename"];
+      reply["filename"] = filename;
       reply["position"] = obj["position"].as<int>() + binary_length;
-      sendJson(reply, true);
+      sendControl(reply);
     }
   } else {
-    delete[] binary;
     reply[cmd_key] = "file_write_error";
-    reply["filename"] = obj["filename"];
+    reply["filename"] = filename;
     reply["error"] = "file_writer->add() failed";
     file_writer->abort();
-    sendJson(reply);
+    sendControl(reply);
   }
 }
 
@@ -384,15 +1030,15 @@ void NetThing::cmdFileDelete(const JsonDocument &obj)
 
   String path = canonifyFilename(obj["filename"]);
 
-  if (SPIFFS.remove(path)) {
+  if (fs->remove(path)) {
     reply[cmd_key] = "file_delete_ok";
     reply["filename"] = obj["filename"];
-    sendJson(reply);
+    sendControl(reply);
   } else {
     reply[cmd_key] = "file_delete_error";
     reply["error"] = "failed to delete file";
     reply["filename"] = obj["filename"];
-    sendJson(reply);
+    sendControl(reply);
   }
 }
 
@@ -403,7 +1049,7 @@ void NetThing::cmdFileDirQuery(const JsonDocument &obj)
   JsonArray files = reply.createNestedArray("files");
   reply[cmd_key] = "file_dir_info";
   reply["path"] = obj["path"];
-  Dir dir = SPIFFS.openDir((const char*)obj["path"]);
+  Dir dir = fs->openDir((const char*)obj["path"]);
   while (dir.next()) {
     if (dir.isDirectory()) {
       dirs.add(dir.fileName());
@@ -413,7 +1059,7 @@ void NetThing::cmdFileDirQuery(const JsonDocument &obj)
     }
   }
   reply.shrinkToFit();
-  sendJson(reply);
+  sendControl(reply);
 }
 
 void NetThing::cmdFileQuery(const JsonDocument &obj)
@@ -421,6 +1067,419 @@ void NetThing::cmdFileQuery(const JsonDocument &obj)
   sendFileInfo(obj["filename"]);
 }
 
+void NetThing::cmdFileRead(const JsonDocument &obj)
+{
+  StaticJsonDocument<JSON_OBJECT_SIZE(7)> reply;
+  const char *filename = obj["filename"];
+  if (!filename) {
+    filename = "";
+  }
+
+  char key[NETTHING_TRANSFER_ID_LEN + 1] = "";
+  if (obj.containsKey("transfer")) {
+    fileTransferKey(obj, key, sizeof(key));
+  }
+  if (file_reader->running()) {
+    // a repeated file_read resumes the running read, any other replaces it
+    bool same = key[0] ? strcmp(key, file_read_transfer) == 0
+                       : !file_read_transfer[0] && strcmp(filename, file_read_filename) == 0;
+    if (!same) {
+      sendFileReadError("replaced by another file_read");
+    }
+    file_reader->abort();
+  }
+  strcpy(file_read_transfer, key);
+  strncpy(file_read_filename, filename, sizeof(file_read_filename) - 1);
+  file_read_filename[sizeof(file_read_filename) - 1] = '\0';
+
+  if (obj.containsKey("transfer")) {
+    reply["transfer"] = obj["transfer"];
+  }
+  reply["filename"] = obj["filename"];
+
+  String path = canonifyFilename(obj["filename"]);
+  size_t position = obj["position"] | 0;
+  size_t chunk = obj["chunk"] | FILEREADER_DEFAULT_CHUNK;
+  size_t window = obj["window"] | FILEREADER_DEFAULT_WINDOW;
+
+  if (file_reader->begin(path.c_str(), position, chunk, window)) {
+    if (!file_read_b64) {
+      file_read_b64 = new char[encode_base64_length(FILEREADER_MAX_CHUNK) + 1];
+    }
+    file_read_retry = false;
+    reply[cmd_key] = "file_read_start";
+    reply["size"] = file_reader->size();
+    reply["position"] = position;
+    reply["chunk"] = file_reader->chunkSize();
+    sendControl(reply);
+  } else {
+    reply[cmd_key] = "file_read_error";
+    reply["error"] = "file_reader->begin() failed";
+    sendControl(reply);
+  }
+}
+
+void NetThing::cmdFileReadAck(const JsonDocument &obj)
+{
+  if (!file_reader->running()) {
+    return;
+  }
+  if (file_read_transfer[0]) {
+    char key[NETTHING_TRANSFER_ID_LEN + 1];
+    fileTransferKey(obj, key, sizeof(key));
+    if (strcmp(key, file_read_transfer) != 0) {
+      return;
+    }
+  }
+  file_reader->ack(obj["position"] | 0, obj["window"] | 0);
+}
+
+void NetThing::sendFileReadChunk()
+{
+  // a resumed read that starts at the end still owes the final digest
+  bool final_only = file_reader->eof() && !file_read_retry;
+  if (!final_only) {
+    if (!file_read_retry && !file_reader->ready()) {
+      return;
+    }
+    // queue a chunk only once the last ones have drained
+    size_t encoded_len = encode_base64_length(file_reader->chunkSize());
+    if (ps->txRoom(traffic_channels[TRAFFIC_BULK]) < encoded_len + 192) {
+      return;
+    }
+  }
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(8)> doc;
+  doc["filename"] = (const char*)file_read_filename;
+  if (file_read_transfer[0]) {
+    doc["transfer"] = (const char*)file_read_transfer;
+  }
+
+  size_t position;
+  int len;
+  if (file_read_retry) {
+    position = file_read_retry_position;
+    len = file_read_retry_len;
+  } else {
+    const uint8_t *data = NULL;
+    position = file_reader->size();
+    len = 0;
+    if (!final_only) {
+      len = file_reader->read(&data, &position);
+    }
+    if (len < 0) {
+      TRACE(TRACE_ERROR, TRACE_NT_FILE_READ_ERROR, position, 0);
+      sendFileReadError("file_reader->read() failed");
+      file_reader->abort();
+      return;
+    }
+    encode_base64((unsigned char*)data, len, (unsigned char*)file_read_b64);
+    if (file_reader->eof()) {
+      // the digest can only be finalised once
+      strncpy(file_read_md5, file_reader->digest().c_str(), sizeof(file_read_md5) - 1);
+      file_read_md5[sizeof(file_read_md5) - 1] = '\0';
+    }
+  }
+
+  doc[cmd_key] = "file_read_data";
+  doc["position"] = position;
+  doc["data"] = (const char*)file_read_b64;
+  bool eof = file_reader->eof();
+  if (eof) {
+    doc["eof"] = true;
+    doc["size"] = file_reader->size();
+    doc["md5"] = (const char*)file_read_md5;
+  }
+  if (sendFrame(doc, TRAFFIC_BULK)) {
+    file_read_retry = false;
+    metrics.inc(metric_file_read_bytes, len);
+    metrics.inc(metric_file_read_chunks);
+    if (eof) {
+      file_reader->abort();
+    }
+  } else {
+    // the chunk is already folded into the digest, so keep it encoded and
+    // send it again, the reader's idle timeout ends a transfer that never drains
+    if (!file_read_retry) {
+      TRACE(TRACE_ERROR, TRACE_NT_FILE_READ_ERROR, position, len);
+    }
+    file_read_retry = true;
+    file_read_retry_position = position;
+    file_read_retry_len = len;
+  }
+}
+
+// ends the running read as far as the server is concerned
+void NetThing::sendFileReadError(const char *error)
+{
+  StaticJsonDocument<JSON_OBJECT_SIZE(4)> doc;
+  doc[cmd_key] = "file_read_error";
+  doc["filename"] = (const char*)file_read_filename;
+  if (file_read_transfer[0]) {
+    doc["transfer"] = (const char*)file_read_transfer;
+  }
+  doc["error"] = error;
+  sendControl(doc);
+}
+
+static uint32_t pathHash(const char *path) {
+  // FNV-1a
+  uint32_t hash = 2166136261UL;
+  while (*path) {
+    hash ^= (uint8_t)*path++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+void NetThing::manifestReset()
+{
+  if (manifest_hashes) {
+    delete[] manifest_hashes;
+    manifest_hashes = NULL;
+  }
+  if (manifest_entries) {
+    delete[] manifest_entries;
+    manifest_entries = NULL;
+  }
+  if (manifest_file) {
+    manifest_file.close();
+  }
+  manifest_count = 0;
+  manifest_next_seq = 0;
+  manifest_overflow = false;
+  manifest_entry_count = 0;
+  manifest_busy = false;
+  manifest_extra_path = "";
+}
+
+// Local files under dir_path that the manifest did not mention. Adds those
+// after the first skip, up to limit of them, and returns the total found.
+int NetThing::manifestExtras(const String &dir_path, JsonArray extra, int skip, int limit)
+{
+  const char *prefix = filename_prefix ? filename_prefix : "";
+  size_t prefix_len = strlen(prefix);
+  int count = 0;
+  Dir dir = fs->openDir(dir_path);
+  while (dir.next()) {
+    if (!dir.isFile()) {
+      continue;
+    }
+    String path = dir.fileName();
+    if (path[0] != '/') {
+      // LittleFS names are relative to the directory
+      path = dir_path + (dir_path.endsWith("/") ? "" : "/") + path;
+    }
+    if (path.endsWith("~")) {
+      // FileWriter temporary file
+      continue;
+    }
+    uint32_t hash = pathHash(path.c_str());
+    bool found = false;
+    for (int i = 0; i < manifest_count; i++) {
+      if (manifest_hashes[i] == hash) {
+        found = true;
+        break;
+      }
+    }
+    if (found) {
+      continue;
+    }
+    if (count >= skip && count < skip + limit) {
+      String name = (prefix_len && path.startsWith(prefix)) ? path.substring(prefix_len) : path;
+      extra.add(name);
+    }
+    count++;
+  }
+  return count;
+}
+
+// Entries are copied out of the packet and compared from loop(), a few
+// hundred bytes of hashing at a time. The server must wait for the final
+// file_sync_result of a frame (the one without "partial") before sending
+// the next.
+void NetThing::cmdFileSyncManifest(const JsonDocument &obj)
+{
+  unsigned long seq = obj["seq"] | 0;
+  bool more = obj["more"] | false;
+  JsonArrayConst files = obj["files"];
+  StaticJsonDocument<JSON_OBJECT_SIZE(3)> reply;
+  reply[cmd_key] = "file_sync_error";
+  reply["seq"] = seq;
+
+  if (manifest_busy) {
+    reply["error"] = "previous manifest frame still in progress";
+    sendControl(reply);
+    return;
+  }
+  if (seq == 0) {
+    manifestReset();
+    manifest_hashes = new uint32_t[NETTHING_MANIFEST_MAX];
+    manifest_entries = new NetThingManifestEntry[NETTHING_MANIFEST_FRAME_MAX];
+  }
+  if (!manifest_hashes || seq != manifest_next_seq) {
+    reply["error"] = "manifest out of sequence";
+    sendControl(reply);
+    manifestReset();
+    return;
+  }
+  if (files.size() > NETTHING_MANIFEST_FRAME_MAX) {
+    reply["error"] = "too many entries in one frame";
+    sendControl(reply);
+    manifestReset();
+    return;
+  }
+  manifest_next_seq++;
+
+  manifest_entry_count = 0;
+  for (JsonObjectConst entry : files) {
+    const char *name = entry["filename"];
+    if (!name) {
+      continue;
+    }
+    if (strlen(name) >= sizeof(manifest_entries[0].filename)) {
+      reply["error"] = "filename too long";
+      sendControl(reply);
+      manifestReset();
+      return;
+    }
+    if (manifest_count < NETTHING_MANIFEST_MAX) {
+      manifest_hashes[manifest_count++] = pathHash(canonifyFilename(name).c_str());
+    } else {
+      manifest_overflow = true;
+    }
+    NetThingManifestEntry &copy = manifest_entries[manifest_entry_count++];
+    strcpy(copy.filename, name);
+    copy.size = entry["size"] | 0;
+    const char *md5 = entry["md5"];
+    strncpy(copy.md5, md5 ? md5 : "", sizeof(copy.md5) - 1);
+    copy.md5[sizeof(copy.md5) - 1] = '\0';
+    copy.result = 0;
+  }
+
+  manifest_seq = seq;
+  manifest_more = more;
+  manifest_entry_index = 0;
+  manifest_reply_index = 0;
+  manifest_extras_sent = 0;
+  if (!more) {
+    manifest_extra_path = canonifyFilename(obj["path"] | (filename_prefix ? filename_prefix : "/"));
+  }
+  manifest_busy = true;
+}
+
+// One step of comparing the current frame: opens the next file or hashes up
+// to NETTHING_MANIFEST_HASH_STEP bytes of it. Once everything is compared the
+// results are sent, a part per call.
+void NetThing::manifestStep()
+{
+  if (manifest_entry_index >= manifest_entry_count) {
+    if (manifestSendResult()) {
+      if (manifest_more) {
+        manifest_busy = false;
+      } else {
+        manifestReset();
+      }
+    }
+    return;
+  }
+
+  NetThingManifestEntry &entry = manifest_entries[manifest_entry_index];
+  if (!manifest_file) {
+    manifest_file = fs->open(canonifyFilename(entry.filename), "r");
+    if (!manifest_file) {
+      entry.result = -1;
+      manifest_entry_index++;
+    } else if (manifest_file.size() != entry.size || !entry.md5[0]) {
+      entry.result = 1;
+      manifest_file.close();
+      manifest_entry_index++;
+    } else {
+      manifest_md5.begin();
+    }
+    return;
+  }
+
+  uint8_t buf[256];
+  size_t hashed = 0;
+  while (hashed < NETTHING_MANIFEST_HASH_STEP && manifest_file.available()) {
+    size_t buflen = manifest_file.readBytes((char*)buf, sizeof(buf));
+    if (buflen == 0) {
+      break;
+    }
+    manifest_md5.add(buf, buflen);
+    hashed += buflen;
+  }
+  if (hashed == 0 || !manifest_file.available()) {
+    manifest_md5.calculate();
+    entry.result = strcmp(manifest_md5.toString().c_str(), entry.md5) == 0 ? 0 : 1;
+    manifest_file.close();
+    manifest_entry_index++;
+  }
+}
+
+// Sends the next part of the results for the current frame, waiting for
+// room in the transmit buffer. Returns true once the last part has gone.
+bool NetThing::manifestSendResult()
+{
+  DynamicJsonDocument reply(NETTHING_MANIFEST_REPLY_SIZE);
+  reply[cmd_key] = "file_sync_result";
+  reply["seq"] = manifest_seq;
+  JsonArray changed = reply.createNestedArray("changed");
+  JsonArray missing = reply.createNestedArray("missing");
+
+  // names are linked from manifest_entries, which outlive the send
+  int names = 0;
+  uint8_t index = manifest_reply_index;
+  while (index < manifest_entry_count && names < NETTHING_MANIFEST_REPLY_MAX) {
+    NetThingManifestEntry &entry = manifest_entries[index++];
+    if (entry.result < 0) {
+      missing.add((const char*)entry.filename);
+      names++;
+    } else if (entry.result > 0) {
+      changed.add((const char*)entry.filename);
+      names++;
+    }
+  }
+  bool last = index >= manifest_entry_count;
+
+  int extras_sent = manifest_extras_sent;
+  if (last && !manifest_more) {
+    if (manifest_overflow) {
+      reply["error"] = "manifest too large to find extra files";
+    } else {
+      JsonArray extra = reply.createNestedArray("extra");
+      int limit = NETTHING_MANIFEST_REPLY_MAX - names;
+      int total = manifestExtras(manifest_extra_path, extra, extras_sent, limit);
+      extras_sent += extra.size();
+      last = extras_sent >= total;
+    }
+    if (last) {
+      reply["done"] = true;
+    }
+  }
+  if (!last) {
+    reply["partial"] = true;
+  }
+
+  if (ps->txRoom() < measureJson(reply)) {
+    // try again once the queue has drained
+    return false;
+  }
+  if (!sendControl(reply)) {
+    StaticJsonDocument<JSON_OBJECT_SIZE(3)> error;
+    error[cmd_key] = "file_sync_error";
+    error["seq"] = manifest_seq;
+    error["error"] = "result could not be queued";
+    sendControl(error);
+    manifestReset();
+    return false;
+  }
+  manifest_reply_index = index;
+  manifest_extras_sent = extras_sent;
+  return last;
+}
+
 void NetThing::cmdFileRename(const JsonDocument &obj)
 {
   DynamicJsonDocument reply(512);
@@ -428,17 +1487,17 @@ void NetThing::cmdFileRename(const JsonDocument &obj)
   String old_path = canonifyFilename(obj["old_filename"]);
   String new_path = canonifyFilename(obj["new_filename"]);
 
-  if (SPIFFS.rename(old_path, new_path)) {
+  if (fs->rename(old_path, new_path)) {
     reply[cmd_key] = "file_rename_ok";
     reply["old_filename"] = obj["old_filename"];
     reply["new_filename"] = obj["new_filename"];
-    sendJson(reply);
+    sendControl(reply);
   } else {
     reply[cmd_key] = "file_rename_error";
     reply["error"] = "failed to rename file";
     reply["old_filename"] = obj["old_filename"];
     reply["new_filename"] = obj["new_filename"];
-    sendJson(reply);
+    sendControl(reply);
   }
 }
 
@@ -448,52 +1507,78 @@ void NetThing::cmdFileWrite(const JsonDocument &obj)
 
   String path = canonifyFilename(obj["filename"]);
 
+  if (obj.containsKey("transfer")) {
+    reply["transfer"] = obj["transfer"];
+  }
+
+  char key[NETTHING_TRANSFER_ID_LEN + 1];
+  fileTransferKey(obj, key, sizeof(key));
+  int slot = allocFileWriter(key, path.c_str());
+  if (slot < 0) {
+    reply[cmd_key] = "file_write_error";
+    reply["filename"] = obj["filename"];
+    reply["error"] = "too many concurrent transfers";
+    sendControl(reply);
+    return;
+  }
+  FileWriter *file_writer = file_writers[slot];
+
   if (file_writer->begin(path.c_str(), obj["md5"], obj["size"])) {
     if (file_writer->upToDate()) {
         reply[cmd_key] = "file_write_error";
         reply["filename"] = obj["filename"];
         reply["error"] = "already up to date";
-        sendJson(reply);
+        file_writer->abort(); // free the slot
+        sendControl(reply);
     } else {
       if (file_writer->open()) {
         reply[cmd_key] = "file_continue";
         reply["filename"] = obj["filename"];
         reply["position"] = 0;
-        sendJson(reply);
+        sendControl(reply);
       } else {
         reply[cmd_key] = "file_write_error";
         reply["filename"] = obj["filename"];
         reply["error"] = "file_writer->open() failed";
-        sendJson(reply);
+        file_writer->abort();
+        sendControl(reply);
       }
     }
   } else {
     reply[cmd_key] = "file_write_error";
     reply["filename"] = obj["filename"];
     reply["error"] = "file_writer->begin() failed";
-    sendJson(reply);
+    file_writer->abort();
+    sendControl(reply);
   }
 }
 
 void NetThing::cmdFirmwareData(const JsonDocument &obj)
 {
+  StaticJsonDocument<JSON_OBJECT_SIZE(4) + 64> reply;
+
   const char *b64 = obj["data"].as<const char*>();
+  if (!b64) {
+    b64 = "";
+  }
   unsigned int binary_length = decode_base64_length((unsigned char*)b64);
-  uint8_t *binary = new uint8_t[binary_length];
-  binary_length = decode_base64((unsigned char*)b64, binary);
-
-  StaticJsonDocument<JSON_OBJECT_SIZE(3) + 64> reply;
+  if (binary_length > rx_scratch_len) {
+    reply[cmd_key] = "firmware_write_error";
+    reply["error"] = "chunk too large";
+    firmware_writer->abort();
+    sendControl(reply);
+    transferStatus("firmware", 0, false, false);
+    return;
+  }
+  binary_length = decode_base64((unsigned char*)b64, rx_scratch);
 
-  if (firmware_writer->add(binary, binary_length, obj["position"])) {
-    delete[] binary;
+  if (firmware_writer->add(rx_scratch, binary_length, obj["position"])) {
     if (obj["eof"].as<bool>() == 1) {
       if (firmware_writer->commit()) {
         // finished and successful
         reply[cmd_key] = "firmware_write_ok";
-        sendJson(reply);
-        if (transfer_status_callback) {
-          transfer_status_callback("firmware", 100, false, true);
-        }
+        sendControl(reply);
+        transferStatus("firmware", 100, false, true);
         restart_firmware = true;
       } else {
         // finished but commit failed
@@ -501,43 +1586,37 @@ void NetThing::cmdFirmwareData(const JsonDocument &obj)
         reply["error"] = "firmware_writer->commit() failed";
         reply["updater_error"] = firmware_writer->getUpdaterError();
         firmware_writer->abort();
-        sendJson(reply);
-        if (transfer_status_callback) {
-          transfer_status_callback("firmware", 0, false, false);
-        }
+        sendControl(reply);
+        transferStatus("firmware", 0, false, false);
       }
     } else {
       // more data required
       reply[cmd_key] = "firmware_continue";
       reply["position"] = firmware_writer->position();
-      sendJson(reply, true);
-      if (transfer_status_callback) {
-        transfer_status_callback("firmware", firmware_writer->progress(), true, false);
-      }
+      reply["window"] = firmware_writer->window();
+      sendControl(reply);
+      transferStatus("firmware", firmware_writer->progress(), true, false);
     }
   } else {
-    delete[] binary;
     reply[cmd_key] = "firmware_write_error";
     reply["error"] = "firmware_writer->add() failed";
     reply["updater_error"] = firmware_writer->getUpdaterError();
     firmware_writer->abort();
-    sendJson(reply);
-    if (transfer_status_callback) {
-      transfer_status_callback("firmware", 0, false, false);
-    }
+    sendControl(reply);
+    transferStatus("firmware", 0, false, false);
   }
 }
 
 void NetThing::cmdFirmwareWrite(const JsonDocument &obj)
 {
-  StaticJsonDocument<JSON_OBJECT_SIZE(4) + 64> reply;
+  StaticJsonDocument<JSON_OBJECT_SIZE(5) + 64> reply;
 
   if (firmware_writer->upToDate(obj["md5"])) {
     reply[cmd_key] = "firmware_write_error";
     reply["md5"] = obj["md5"];
     reply["error"] = "already up to date";
     reply["updater_error"] = firmware_writer->getUpdaterError();
-    sendJson(reply);
+    sendControl(reply);
     return;
   }
 
@@ -545,48 +1624,124 @@ void NetThing::cmdFirmwareWrite(const JsonDocument &obj)
     reply[cmd_key] = "firmware_continue";
     reply["md5"] = obj["md5"];
     reply["position"] = firmware_writer->position();
-    sendJson(reply);
+    reply["window"] = firmware_writer->window();
+    sendControl(reply);
   } else {
     reply[cmd_key] = "firmware_write_error";
     reply["md5"] = obj["md5"];
     reply["error"] = "firmware_writer->begin() failed";
     reply["updater_error"] = firmware_writer->getUpdaterError();
-    sendJson(reply);
+    sendControl(reply);
   }
 }
 
-void NetThing::cmdNetMetricsQuery(const JsonDocument &doc) {
-  DynamicJsonDocument reply(1024);
+void NetThing::cmdNetLatencyQuery(const JsonDocument &doc) {
+  DynamicJsonDocument reply(1536);
+  reply[cmd_key] = "net_latency_info";
+  reply["millis"] = millis();
+  ps->rx_queue_latency.serialize(reply.createNestedObject("rx_queue_us"));
+  ps->rx_handler_time.serialize(reply.createNestedObject("rx_handler_us"));
+  ps->tx_queue_latency.serialize(reply.createNestedObject("tx_queue_us"));
+  reply.shrinkToFit();
+  sendControl(reply);
+}
+
+void NetThing::cmdNetLatencyReset(const JsonDocument &doc) {
+  ps->resetLatency();
+  StaticJsonDocument<JSON_OBJECT_SIZE(1)> reply;
+  reply[cmd_key] = "net_latency_reset_ok";
+  sendControl(reply);
+}
+
+// base is the snapshot the server has acknowledged, or NULL for a full report
+void NetThing::sendMetrics(const long *values, const long *base, uint8_t base_count, bool push) {
+  DynamicJsonDocument reply(JSON_OBJECT_SIZE(7) + metrics.jsonCapacity() +
+                            JSON_ARRAY_SIZE(PACKETSTREAM_MAX_ENDPOINTS) +
+                            PACKETSTREAM_MAX_ENDPOINTS * JSON_OBJECT_SIZE(8));
   reply[cmd_key] = "net_metrics_info";
-  reply["esp_free_cont_stack"] = ESP.getFreeContStack();
-  reply["esp_free_heap"] = ESP.getFreeHeap();
-  reply["esp_heap_fragmentation"] = ESP.getHeapFragmentation();
-  reply["esp_max_free_block_size"] = ESP.getMaxFreeBlockSize();
   reply["millis"] = millis();
   if (timeStatus() != timeNotSet) {
     reply["time"] = now();
     reply["boot_time"] = boot_time;
     reply["uptime"] = now() - boot_time;
   }
-  reply["net_rx_buf_max"] = ps->rx_buffer_high_watermark;
-  reply["net_tcp_double_connect_errors"] = ps->tcp_double_connect_errors;
-  reply["net_tcp_reconns"] = ps->tcp_connects;
-  reply["net_tcp_fingerprint_errors"] = ps->tcp_fingerprint_errors;
-  reply["net_tcp_async_errors"] = ps->tcp_async_errors;
-  reply["net_tcp_sync_errors"] = ps->tcp_sync_errors;
-  reply["net_tx_buf_max"] = ps->tx_buffer_high_watermark;
-  reply["net_tx_delay_count"] = ps->tx_delay_count;
-  reply["net_tx_queue_error"] = ps->packet_queue_error;
-  reply["net_tx_queue_full"] = ps->packet_queue_full;
-  reply["net_tx_queue_ok"] = ps->packet_queue_ok;
-  reply["net_json_parse_errors"] = json_parse_errors;
-  reply["net_json_parse_ok"] = json_parse_ok;
-  reply["net_json_parse_max_usage"] = json_parse_max_usage;
-  reply["net_wifi_reconns"] = wifi_reconnections;
-  reply["net_wifi_check_errors"] = wifi_check_errors;
-  reply["net_wifi_rssi"] = WiFi.RSSI();
-  reply.shrinkToFit();
-  sendJson(reply);
+  if (push) {
+    reply["seq"] = metrics_push_seq;
+    if (base) {
+      reply["base"] = metrics_acked_seq;
+    }
+  }
+  metrics.serialize(reply, values, base, base_count);
+  if (base == NULL) {
+    ps->serializeEndpoints(reply.createNestedArray("net_endpoints"));
+  }
+  sendControl(reply);
+}
+
+void NetThing::pushMetrics() {
+  metrics_push_seq++;
+  metrics.read(metrics_pending);
+  metrics_pending_count = metrics.count();
+  bool full = !metrics_acked_valid || metrics_push_full_every == 0 ||
+              metrics_push_count % metrics_push_full_every == 0;
+  metrics_push_count++;
+  sendMetrics(metrics_pending, full ? NULL : metrics_acked, metrics_acked_count, true);
+}
+
+void NetThing::cmdNetMetricsQuery(const JsonDocument &doc) {
+  long values[NETTHING_METRICS_MAX];
+  metrics.read(values);
+  if (doc["format"] == "binary") {
+    // int32 values in the order given by net_metrics_schema_query
+    uint8_t binary[NETTHING_METRICS_MAX * 4];
+    unsigned char encoded[((sizeof(binary) + 2) / 3) * 4 + 1];
+    size_t binary_len = metrics.serializeBinary(values, binary, sizeof(binary));
+    encode_base64(binary, binary_len, encoded);
+    StaticJsonDocument<JSON_OBJECT_SIZE(5)> reply;
+    reply[cmd_key] = "net_metrics_info";
+    reply["millis"] = millis();
+    reply["format"] = "binary";
+    reply["count"] = metrics.count();
+    reply["data"] = (const char*)encoded;
+    sendControl(reply);
+    return;
+  }
+  sendMetrics(values, NULL, 0, false);
+}
+
+void NetThing::cmdNetMetricsSchemaQuery(const JsonDocument &doc) {
+  DynamicJsonDocument reply(JSON_OBJECT_SIZE(3) + 2 * JSON_ARRAY_SIZE(metrics.count()));
+  reply[cmd_key] = "net_metrics_schema";
+  metrics.serializeSchema(reply.createNestedArray("names"), reply.createNestedArray("types"));
+  sendControl(reply);
+}
+
+void NetThing::cmdNetMetricsSubscribe(const JsonDocument &doc) {
+  metrics_push_interval = doc["interval"] | 0UL;
+  metrics_push_full_every = doc["full_every"] | 10UL;
+  metrics_push_count = 0;
+  metrics_acked_valid = false;
+  timers.cancel(metrics_push_timer);
+  metrics_push_timer = -1;
+  if (metrics_push_interval) {
+    pushMetrics();
+    metrics_push_timer = timers.add(metrics_push_interval, [this]() {
+      uint32_t start = micros();
+      pushMetrics();
+      profiler.add(PROFILE_METRICS_PUSH, micros() - start);
+    }, metrics_push_interval);
+  }
+}
+
+void NetThing::cmdNetMetricsAck(const JsonDocument &doc) {
+  // deltas are always relative to an acknowledged snapshot, so a lost ack
+  // only makes the following deltas larger
+  if (metrics_push_interval && doc["seq"].as<unsigned long>() == metrics_push_seq) {
+    memcpy(metrics_acked, metrics_pending, sizeof(long) * metrics_pending_count);
+    metrics_acked_count = metrics_pending_count;
+    metrics_acked_seq = metrics_push_seq;
+    metrics_acked_valid = true;
+  }
 }
 
 void NetThing::cmdPing(const JsonDocument &doc) {
@@ -598,7 +1753,65 @@ void NetThing::cmdPing(const JsonDocument &doc) {
   if (doc["timestamp"]) {
     reply["timestamp"] = doc["timestamp"];
   }
-  sendJson(reply);
+  sendControl(reply);
+}
+
+void NetThing::cmdPong(const JsonDocument &doc) {
+  // only replies to our own probes carry a seq we're waiting for,
+  // pongs for server-initiated pings are ignored
+  if (!ping_outstanding || !doc.containsKey("seq")) {
+    return;
+  }
+  if (doc["seq"].as<unsigned long>() != ping_seq) {
+    metrics.inc(metric_ping_unmatched);
+    return;
+  }
+  ping_outstanding = false;
+  uint64_t received = ClockDiscipline::localMs();
+  unsigned long rtt = millis() - doc["timestamp"].as<unsigned long>();
+  ping_rtt.add(rtt);
+  ps->recordRtt(rtt);
+
+  // servers that stamp their receive and transmit times (ms since the
+  // epoch) make this an NTP-style exchange
+  if (doc.containsKey("rx_time") || doc.containsKey("time_ms")) {
+    int64_t server_rx = doc.containsKey("rx_time") ? doc["rx_time"].as<int64_t>() : doc["time_ms"].as<int64_t>();
+    int64_t server_tx = doc.containsKey("tx_time") ? doc["tx_time"].as<int64_t>() : server_rx;
+    clock.addSample(ping_sent_local, server_rx, server_tx, received);
+    clockUpdated();
+  }
+}
+
+void NetThing::clockUpdated() {
+  if (!clock.isSynced()) {
+    return;
+  }
+  setTime(clock.nowMs() / 1000);
+  boot_time = clock.toWallMs(0) / 1000;
+  metrics.set(metric_clock_drift_ppb, clock.driftPpb());
+  metrics.set(metric_clock_error_ms, clock.lastError());
+  metrics.set(metric_clock_delay_ms, clock.lastDelay());
+  metrics.set(metric_clock_steps, clock.steps());
+}
+
+void NetThing::sendPing() {
+  if (ping_outstanding) {
+    // previous probe never came back
+    metrics.inc(metric_ping_lost);
+  }
+  ping_seq++;
+  last_ping_sent = millis();
+  ping_sent_local = ClockDiscipline::localMs();
+  StaticJsonDocument<JSON_OBJECT_SIZE(3)> doc;
+  doc[cmd_key] = "ping";
+  doc["seq"] = ping_seq;
+  doc["timestamp"] = last_ping_sent;
+  if (sendControl(doc)) {
+    metrics.inc(metric_ping_sent);
+    ping_outstanding = true;
+  } else {
+    ping_outstanding = false;
+  }
 }
 
 void NetThing::cmdRestart(const JsonDocument &doc) {
@@ -626,34 +1839,50 @@ void NetThing::cmdRestart(const JsonDocument &doc) {
   }
 }
 
+// The parts of system_info that can't change while running, serialized once
+// as bare members to be sent ahead of the live ones.
+const char *NetThing::systemIdentity() {
+  if (system_identity.length() == 0) {
+    FSInfo fs_info;
+    fs->info(fs_info);
+    // room for the String members, which are copied
+    DynamicJsonDocument identity(JSON_OBJECT_SIZE(20) + 256);
+    identity["esp_chip_id"] = ESP.getChipId();
+    identity["esp_sdk_version"] = ESP.getSdkVersion();
+    identity["esp_core_version"] = ESP.getCoreVersion();
+    identity["esp_boot_version"] = ESP.getBootVersion();
+    identity["esp_boot_mode"] = ESP.getBootMode();
+    identity["esp_cpu_freq_mhz"] = ESP.getCpuFreqMHz();
+    identity["esp_flash_chip_id"] = ESP.getFlashChipId();
+    identity["esp_flash_chip_real_size"] = ESP.getFlashChipRealSize();
+    identity["esp_flash_chip_size"] = ESP.getFlashChipSize();
+    identity["esp_flash_chip_speed"] = ESP.getFlashChipSpeed();
+    identity["esp_flash_chip_mode"] = ESP.getFlashChipMode();
+    identity["esp_flash_chip_size_by_chip_id"] = ESP.getFlashChipSizeByChipId();
+    identity["esp_sketch_size"] = ESP.getSketchSize();
+    identity["esp_sketch_md5"] = ESP.getSketchMD5();
+    identity["esp_free_sketch_space"] = ESP.getFreeSketchSpace();
+    identity["esp_reset_reason"] = ESP.getResetReason();
+    identity["esp_reset_info"] = ESP.getResetInfo();
+    identity["fs_total_bytes"] = fs_info.totalBytes;
+    identity["fs_block_size"] = fs_info.blockSize;
+    identity["fs_page_size"] = fs_info.pageSize;
+    serializeJson(identity, system_identity);
+    // strip the braces
+    system_identity.remove(system_identity.length() - 1);
+    system_identity.remove(0, 1);
+  }
+  return system_identity.c_str();
+}
+
 void NetThing::cmdSystemQuery(const JsonDocument &doc) {
   FSInfo fs_info;
-  SPIFFS.info(fs_info);
-  DynamicJsonDocument reply(1024);
+  fs->info(fs_info);
+  StaticJsonDocument<JSON_OBJECT_SIZE(10)> reply;
   reply[cmd_key] = "system_info";
   reply["esp_free_heap"] = ESP.getFreeHeap();
-  reply["esp_chip_id"] = ESP.getChipId();
-  reply["esp_sdk_version"] = ESP.getSdkVersion();
-  reply["esp_core_version"] = ESP.getCoreVersion();
-  reply["esp_boot_version"] = ESP.getBootVersion();
-  reply["esp_boot_mode"] = ESP.getBootMode();
-  reply["esp_cpu_freq_mhz"] = ESP.getCpuFreqMHz();
-  reply["esp_flash_chip_id"] = ESP.getFlashChipId();
-  reply["esp_flash_chip_real_size"] = ESP.getFlashChipRealSize();
-  reply["esp_flash_chip_size"] = ESP.getFlashChipSize();
-  reply["esp_flash_chip_speed"] = ESP.getFlashChipSpeed();
-  reply["esp_flash_chip_mode"] = ESP.getFlashChipMode();
-  reply["esp_flash_chip_size_by_chip_id"] = ESP.getFlashChipSizeByChipId();
-  reply["esp_sketch_size"] = ESP.getSketchSize();
-  reply["esp_sketch_md5"] = ESP.getSketchMD5();
-  reply["esp_free_sketch_space"] = ESP.getFreeSketchSpace();
-  reply["esp_reset_reason"] = ESP.getResetReason();
-  reply["esp_reset_info"] = ESP.getResetInfo();
   reply["esp_cycle_count"] = ESP.getCycleCount();
-  reply["fs_total_bytes"] = fs_info.totalBytes;
   reply["fs_used_bytes"] = fs_info.usedBytes;
-  reply["fs_block_size"] = fs_info.blockSize;
-  reply["fs_page_size"] = fs_info.pageSize;
   reply["millis"] = millis();
   if (timeStatus() != timeNotSet) {
     reply["time"] = now();
@@ -665,8 +1894,7 @@ void NetThing::cmdSystemQuery(const JsonDocument &doc) {
     reply["restarted"] = true;
     restarted = false;
   }
-  reply.shrinkToFit();
-  sendJson(reply);
+  sendControl(reply, systemIdentity());
 }
 
 void NetThing::cmdTime(const JsonDocument &doc) {
@@ -675,51 +1903,197 @@ void NetThing::cmdTime(const JsonDocument &doc) {
     if (boot_time == 0) {
       boot_time = now() - (millis() / 1000);
     }
+    // only a starting point, ping exchanges refine it
+    if (doc.containsKey("time_ms")) {
+      clock.setCoarse(doc["time_ms"].as<int64_t>());
+    } else {
+      clock.setCoarse((int64_t)doc["time"].as<unsigned long>() * 1000);
+    }
+    clockUpdated();
+  }
+}
+
+void NetThing::cmdTraceQuery(const JsonDocument &doc) {
+  // send from the requested position until the ring is exhausted or the
+  // transmit queue is full, the server continues from the last "next"
+  uint32_t position = doc["position"] | netthing_trace.first();
+  const size_t chunk_records = 8;
+  TraceRecord records[chunk_records];
+  unsigned char encoded[((sizeof(records) + 2) / 3) * 4 + 1];
+
+  while (true) {
+    uint32_t first = netthing_trace.first();
+    if (position < first) {
+      position = first;
+    }
+    size_t count = netthing_trace.read(position, records, chunk_records);
+    encode_base64((unsigned char*)records, count * sizeof(TraceRecord), encoded);
+
+    StaticJsonDocument<JSON_OBJECT_SIZE(7)> reply;
+    reply[cmd_key] = "trace_data";
+    reply["position"] = position;
+    reply["count"] = count;
+    reply["first"] = first;
+    reply["next"] = position + count;
+    reply["eof"] = position + count >= netthing_trace.next();
+    reply["data"] = (const char*)encoded;
+    if (!sendControl(reply) || count < chunk_records) {
+      break;
+    }
+    position += count;
   }
 }
 
 void NetThing::psReceiveHandler(uint8_t* packet, size_t packet_len) {
-  DynamicJsonDocument doc(512);
+  JsonDocument &doc = rx_doc;
+#ifdef NETTHING_ALLOC_COUNTING
+  uint32_t allocs_before = AllocCounter::count();
+  rx_hot_path = false;
+#endif
+  uint32_t parse_start = micros();
   DeserializationError err = deserializeJson(doc, packet, packet_len);
+  profiler.add(PROFILE_JSON_PARSE, micros() - parse_start);
 
   if (err) {
-    json_parse_errors++;
-    Serial.printf("NetThing: receive len=%d usage=-/%d error=%s packet=", packet_len, doc.capacity(), err.c_str());
-    for (unsigned int i=0; i<packet_len; i++) {
-      Serial.printf("%02x", packet[i]);
-    }
-    Serial.println();
+    metrics.inc(metric_json_parse_errors);
+    TRACE(TRACE_WARN, TRACE_NT_JSON_ERROR, packet_len, err.code());
     return;
   }
 
-  json_parse_ok++;
-  if (doc.memoryUsage() > json_parse_max_usage) {
-    json_parse_max_usage = doc.memoryUsage();
-  }
+  metrics.inc(metric_json_parse_ok);
+  metrics.setMax(metric_json_parse_max_usage, doc.memoryUsage());
 
+  TRACE(TRACE_DEBUG, TRACE_NT_RECV_JSON, packet_len, doc.memoryUsage());
   if (debug_json) {
     Serial.printf("NetThing: recv len=%d usage=%d/%d json=", packet_len, doc.memoryUsage(), doc.capacity());
     serializeJson(doc, Serial);
     Serial.println();
   }
 
-  doc.shrinkToFit();
-
   jsonReceiveHandler(doc);
+
+#ifdef NETTHING_ALLOC_COUNTING
+  // keepalive, ping and file_data chunks must not touch the heap
+  uint32_t allocs = AllocCounter::count() - allocs_before;
+  if (rx_hot_path && allocs > 0) {
+    metrics.inc(metric_hot_path_allocs, allocs);
+    TRACE(TRACE_ERROR, TRACE_NT_HOT_PATH_ALLOC, packet_len, allocs);
+#ifdef NETTHING_ALLOC_STRICT
+    Serial.printf("NetThing: %u allocations handling a hot path packet\n", (unsigned)allocs);
+    abort();
+#endif
+  }
+#endif
 }
 
 void NetThing::sendEvent(const char* event, const char* message) {
-  StaticJsonDocument<JSON_OBJECT_SIZE(5)> obj;
-  obj["cmd"] = "event";
-  obj["millis"] = millis();
+  if (event_batch_window == 0) {
+    sendEventNow(event, message);
+    return;
+  }
+  if (!event_batcher->fits(event, message)) {
+    flushEvents();
+  }
+  if (!event_batcher->add(millis(), event, message)) {
+    // too large to batch at all
+    sendEventNow(event, message);
+    return;
+  }
+  if (event_batcher->count() >= EVENTBATCHER_MAX_EVENTS) {
+    flushEvents();
+  } else if (event_batcher->count() == 1) {
+    event_batch_timer = timers.add(event_batch_window, [this]() {
+      event_batch_timer = -1;
+      uint32_t start = micros();
+      flushEvents();
+      profiler.add(PROFILE_EVENT_FLUSH, micros() - start);
+    });
+  }
+}
+
+// queued behind any batched events so that ordering is kept, then sent at once
+void NetThing::sendPriorityEvent(const char* event, const char* message) {
+  if (event_batch_window == 0) {
+    sendEventNow(event, message);
+    return;
+  }
+  if (!event_batcher->add(millis(), event, message)) {
+    flushEvents();
+    if (!event_batcher->add(millis(), event, message)) {
+      sendEventNow(event, message);
+      return;
+    }
+  }
+  flushEvents();
+}
+
+// Sends batched events as one frame with the wall clock of the first event
+// and millis() deltas for the rest.
+void NetThing::flushEvents() {
+  timers.cancel(event_batch_timer);
+  event_batch_timer = -1;
+  if (!event_batcher || event_batcher->empty()) {
+    return;
+  }
+  DynamicJsonDocument doc(EVENTBATCHER_JSON_SIZE);
+  doc[cmd_key] = "events";
+  unsigned long age = millis() - event_batcher->baseMillis();
+  if (clock.isSynced()) {
+    doc["time_ms"] = clock.nowMs() - (int64_t)age;
+  } else if (timeStatus() != timeNotSet) {
+    doc["time"] = now() - (time_t)(age / 1000);
+  }
+  event_batcher->serialize(doc);
+  uint8_t count = event_batcher->count();
+  if (sendFrame(doc, TRAFFIC_EVENT)) {
+    // compare with the same events encoded as individual frames
+    size_t header_len = ps->headerLength();
+    size_t frame_len = measureJson(doc) + header_len;
+    size_t unbatched = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      StaticJsonDocument<JSON_OBJECT_SIZE(6)> single;
+      unsigned long ms;
+      const char *event;
+      const char *message;
+      event_batcher->get(i, &ms, &event, &message);
+      eventDocument(single, ms, event, message);
+      unbatched += measureJson(single) + header_len;
+    }
+    metrics.inc(metric_event_frames);
+    metrics.inc(metric_events_batched, count);
+    if (unbatched > frame_len) {
+      metrics.inc(metric_event_bytes_saved, unbatched - frame_len);
+    }
+    events_per_frame.add(count);
+  } else {
+    metrics.inc(metric_events_dropped, count);
+  }
+  event_batcher->clear();
+}
+
+void NetThing::sendEventNow(const char* event, const char* message) {
+  StaticJsonDocument<JSON_OBJECT_SIZE(6)> obj;
+  eventDocument(obj, millis(), event, message);
+  if (!sendFrame(obj, TRAFFIC_EVENT)) {
+    metrics.inc(metric_events_dropped);
+  }
+}
+
+// a standalone event frame for an event that happened at ms
+void NetThing::eventDocument(JsonDocument &doc, unsigned long ms, const char *event, const char *message) {
+  unsigned long age = millis() - ms;
+  doc["cmd"] = "event";
+  doc["millis"] = ms;
   if (timeStatus() != timeNotSet) {
-    obj["time"] = now();
+    doc["time"] = now() - (time_t)(age / 1000);
   }
-  obj["event"] = event;
+  if (clock.isSynced()) {
+    doc["time_ms"] = clock.nowMs() - (int64_t)age;
+  }
+  doc["event"] = event;
   if (message) {
-    obj["message"] = message;
+    doc["message"] = message;
   }
-  sendJson(obj);
 }
 
 void NetThing::sendEvent(const char* event, size_t size, const char* format, ...) {
@@ -735,13 +2109,40 @@ void NetThing::loopTimeoutHandler() {
   if (enabled && loop_watchdog_started) {
     if (loop_watchdog_timeout > 0) {
       if ((long)(millis() - last_loop) > loop_watchdog_timeout) {
-        Serial.println("NetThing: restarting for loop() watchdog");
+        TRACE(TRACE_ERROR, TRACE_NT_LOOP_WATCHDOG, millis() - last_loop, 0);
         restarter.restartWithReason(NETTHING_RESTART_LOOP_WATCHDOG);
       }
     }
   }
 }
 
+MetricsRegistry &NetThing::getMetrics() {
+  return metrics;
+}
+
+TimerWheel &NetThing::getTimers() {
+  return timers;
+}
+
+bool NetThing::timeSynced() {
+  return clock.isSynced();
+}
+
+// disciplined wall clock in milliseconds since the epoch, never goes
+// backwards, 0 until the server has supplied the time
+int64_t NetThing::nowMs() {
+  return clock.nowMs();
+}
+
+// milliseconds until loop() next has work to do: 0 if it has some now,
+// -1 if nothing at all is scheduled
+long NetThing::nextDeadline() {
+  if (restart_firmware || file_reader->running() || ps->pending() || firmware_writer->pending() || manifest_busy) {
+    return 0;
+  }
+  return timers.nextDeadline();
+}
+
 uint16_t NetThing::getRestartReason() {
   return restarter.getReason();
 }
@@ -2,14 +2,24 @@
 #define NETTHING_HPP
 
 #include <functional>
+#include "AllocCounter.hpp"
 #include "ArduinoJson.h"
+#include "ClockDiscipline.hpp"
 #include "ESP8266WiFi.h"
+#include "EventBatcher.hpp"
+#include "FileReader.hpp"
 #include "FileWriter.hpp"
 #include "FirmwareWriter.hpp"
+#include "Histogram.hpp"
+#include "LoopProfiler.hpp"
+#include "MetricsRegistry.hpp"
 #include "PacketStream.hpp"
 #include "Restarter.hpp"
 #include "Ticker.h"
 #include "TimeLib.h"
+#include "TimerWheel.hpp"
+#include "TrafficShaper.hpp"
+#include "Trace.hpp"
 
 #define NETTHING_RESTART_ENDUSER 0x0100
 #define NETTHING_RESTART_REMOTE 0x0101
@@ -19,6 +29,32 @@
 #define NETTHING_RESTART_RECEIVE_WATCHDOG 0x0105
 #define NETTHING_RESTART_LOOP_WATCHDOG 0x0106
 
+#ifndef NETTHING_FILE_WRITERS
+#define NETTHING_FILE_WRITERS 3 // maximum concurrent file transfers
+#endif
+#define NETTHING_TRANSFER_ID_LEN 32
+
+#define NETTHING_POWER_NONE 0 // loop() returns immediately
+#define NETTHING_POWER_MODEM 1 // loop() idles until the next deadline with modem sleep
+#define NETTHING_POWER_LIGHT 2 // as above with automatic light sleep, DTIM wake-ups keep the session
+#define NETTHING_POWER_MIN_SLEEP 2 // ms, shorter idle periods aren't worth sleeping for
+#ifndef NETTHING_MANIFEST_MAX
+#define NETTHING_MANIFEST_MAX 256 // manifest entries remembered for extra file detection
+#endif
+#define NETTHING_MANIFEST_FRAME_MAX 32 // entries accepted in one file_sync_manifest frame
+#define NETTHING_MANIFEST_REPLY_MAX 8 // file names in one file_sync_result frame
+#define NETTHING_MANIFEST_HASH_STEP 1024 // bytes hashed per loop()
+#define NETTHING_MANIFEST_REPLY_SIZE (JSON_OBJECT_SIZE(7) + 3 * JSON_ARRAY_SIZE(NETTHING_MANIFEST_REPLY_MAX) + NETTHING_MANIFEST_REPLY_MAX * 32)
+
+// a file_sync_manifest entry awaiting comparison, names are limited to the
+// 31 characters FileWriter accepts
+struct NetThingManifestEntry {
+  char filename[32];
+  uint32_t size;
+  char md5[33];
+  int8_t result; // -1 missing, 0 identical, 1 different
+};
+
 typedef std::function<void()> NetThingConnectHandler;
 typedef std::function<void()> NetThingDisconnectHandler;
 typedef std::function<void(bool immediate, bool firmware)> NetThingRestartRequestHandler;
@@ -36,7 +72,17 @@ class NetThing {
   NetThingTransferStatusHandler transfer_status_callback;
   PacketStream *ps;
   FirmwareWriter *firmware_writer;
-  FileWriter *file_writer;
+  FS *fs = &NETTHING_DEFAULT_FS;
+  FileReader *file_reader;
+  char file_read_transfer[NETTHING_TRANSFER_ID_LEN + 1]; // empty if the server gave no transfer id
+  char file_read_filename[FILEREADER_NAME_LEN]; // as the server named it, echoed in every reply
+  char *file_read_b64 = NULL; // encoded chunk, reused for every file_read_data
+  char file_read_md5[33];
+  bool file_read_retry = false; // the last chunk could not be queued, resend it
+  size_t file_read_retry_position;
+  int file_read_retry_len;
+  FileWriter *file_writers[NETTHING_FILE_WRITERS];
+  char file_transfer_ids[NETTHING_FILE_WRITERS][NETTHING_TRANSFER_ID_LEN + 1]; // owner of each session
   WiFiEventHandler wifiEventConnectHandler;
   WiFiEventHandler wifiEventDisconnectHandler;
   Ticker loop_watchdog_ticker;
@@ -50,26 +96,128 @@ class NetThing {
   unsigned long receive_watchdog_timeout = 0; // restart if no packet received for this ms period
   unsigned long loop_watchdog_timeout = 60000; // restart if loop() not called for this ms period
   unsigned long wifi_check_interval = 0; // check wifi every X millis and force a reconnect if required
+  unsigned long ping_interval = 0; // send an RTT probe every X millis, 0 to disable
+  unsigned long file_idle_timeout = 30000; // abort a file transfer session idle for this ms period
+  uint8_t file_writer_count = NETTHING_FILE_WRITERS; // sessions in use, up to NETTHING_FILE_WRITERS
+  uint8_t power_mode = NETTHING_POWER_NONE;
+  unsigned long power_max_sleep = 1000; // longest single sleep in loop()
+  WiFiSleepType_t power_saved_sleep_mode = WIFI_NONE_SLEEP; // restored when power saving is turned off
   bool debug_json = false;
   bool allow_firmware_sync = true;
   bool allow_file_sync = true;
   // state
   bool enabled = false;
   unsigned long last_packet_received = 0;
-  unsigned long last_wifi_check = 0;
   unsigned long last_loop = 0;
+  unsigned long last_ping_sent = 0;
+  uint64_t ping_sent_local = 0; // ClockDiscipline::localMs() of the outstanding ping
+  unsigned long ping_seq = 0;
+  bool ping_outstanding = false;
+  unsigned long metrics_push_interval = 0; // set by net_metrics_subscribe, 0 when not subscribed
+  unsigned long metrics_push_full_every = 10; // send a full snapshot every N pushes
+  unsigned long metrics_push_count = 0;
+  unsigned long metrics_push_seq = 0;
+  unsigned long metrics_acked_seq = 0;
+  bool metrics_acked_valid = false;
+  uint8_t metrics_pending_count = 0;
+  uint8_t metrics_acked_count = 0;
+  long metrics_pending[NETTHING_METRICS_MAX]; // last pushed snapshot, awaiting ack
+  long metrics_acked[NETTHING_METRICS_MAX]; // last snapshot acknowledged by the server
+  uint32_t *manifest_hashes = NULL; // path hashes of the file_sync_manifest in progress
+  uint16_t manifest_count = 0;
+  unsigned long manifest_next_seq = 0;
+  bool manifest_overflow = false;
+  NetThingManifestEntry *manifest_entries = NULL; // the frame being compared
+  uint8_t manifest_entry_count = 0;
+  uint8_t manifest_entry_index = 0; // next entry to compare
+  uint8_t manifest_reply_index = 0; // next entry to report
+  uint16_t manifest_extras_sent = 0;
+  unsigned long manifest_seq = 0;
+  bool manifest_more = false;
+  bool manifest_busy = false; // comparing or reporting a frame from loop()
+  File manifest_file;
+  MD5Builder manifest_md5;
+  String manifest_extra_path;
   bool loop_watchdog_started = false; // set to true on the first call to loop()
   bool restarted = true; // the system has been restarted, will be set to false when it has been logged
   bool restart_firmware = false; // a graceful restart is needed for firmware upgrades and should show an appropriate message
   time_t boot_time = 0;
+  String system_identity; // cached by systemIdentity()
+  ClockDiscipline clock;
+  int wifi_check_timer = -1;
+  int ping_timer = -1;
+  int metrics_push_timer = -1;
+  int receive_watchdog_timer = -1;
+  int file_timeout_timer = -1;
+  int event_batch_timer = -1;
+  EventBatcher *event_batcher = NULL; // allocated when batching is enabled
+  unsigned long event_batch_window = 0;
+  TimerWheel timers;
+  uint8_t traffic_channels[TRAFFIC_CLASSES] = {0};
   // metrics
-  unsigned int json_parse_max_usage = 0;
-  unsigned long json_parse_errors = 0;
-  unsigned long json_parse_ok = 0;
-  unsigned long wifi_reconnections = 0;
-  unsigned long wifi_check_errors = 0;
+  MetricsRegistry metrics;
+  TrafficShaper shaper;
+  int metric_json_parse_errors;
+  int metric_json_parse_ok;
+  int metric_json_parse_max_usage;
+  int metric_wifi_reconnections;
+  int metric_wifi_check_errors;
+  int metric_ping_sent;
+  int metric_ping_lost;
+  int metric_ping_unmatched;
+  int metric_file_payload_bytes;
+  int metric_file_flash_bytes;
+  int metric_file_flash_writes;
+  int metric_file_flash_pages;
+  int metric_file_seeks;
+  int metric_file_read_bytes;
+  int metric_sleep_count;
+  int metric_sleep_ms;
+  int metric_sleep_wakes;
+  int metric_clock_drift_ppb;
+  int metric_clock_error_ms;
+  int metric_clock_delay_ms;
+  int metric_clock_steps;
+  int metric_file_read_chunks;
+#ifdef NETTHING_ALLOC_COUNTING
+  int metric_hot_path_allocs;
+#endif
+  int metric_event_frames;
+  int metric_events_batched;
+  int metric_events_dropped;
+  int metric_event_bytes_saved;
+  Histogram ping_rtt;
+  Histogram wake_latency; // microseconds from a network event to the end of sleep
+  Histogram events_per_frame;
+  LoopProfiler profiler;
+  DynamicJsonDocument rx_doc; // reused for every received packet
+  uint8_t *rx_scratch; // decoded file_data and firmware_data payloads
+  size_t rx_scratch_len;
+  bool rx_hot_path = false; // the packet being handled must not allocate
   // private methods
   String canonifyFilename(String filename);
+  void fileTransferKey(const JsonDocument &obj, char *key, size_t key_len);
+  int findFileWriter(const char *key);
+  int allocFileWriter(const char *key, const char *path);
+  void abortFileWriters();
+  void sendFileReadChunk();
+  void sendFileReadError(const char *error);
+  void checkFileTimeouts();
+  void updateFileTimeout();
+  void checkWifi();
+  void receiveWatchdog();
+  void powerSleep();
+  void clockUpdated();
+  void sendEventNow(const char* event, const char* message);
+  void eventDocument(JsonDocument &doc, unsigned long ms, const char *event, const char *message);
+  bool sendControl(const JsonDocument &doc, const char *prefix=NULL);
+  bool sendFrame(const JsonDocument &doc, uint8_t traffic_class, const char *prefix=NULL, int channel=-1);
+  const char *systemIdentity();
+  void startLoopWatchdog();
+  void manifestReset();
+  int manifestExtras(const String &dir_path, JsonArray extra, int skip, int limit);
+  void manifestStep();
+  bool manifestSendResult();
   void psConnectHandler();
   void psDisconnectHandler();
   void psReceiveHandler(uint8_t* packet, size_t packet_len);
@@ -78,21 +226,36 @@ class NetThing {
   void wifiConnectHandler();
   void wifiDisconnectHandler();
   // network commands
+  void cmdLoopProfileQuery(const JsonDocument &doc);
   void cmdFileData(const JsonDocument &doc);
   void cmdFileDelete(const JsonDocument &doc);
   void cmdFileDirQuery(const JsonDocument &doc);
   void cmdFileQuery(const JsonDocument &doc);
+  void cmdFileRead(const JsonDocument &doc);
+  void cmdFileReadAck(const JsonDocument &doc);
   void cmdFileRename(const JsonDocument &doc);
+  void cmdFileSyncManifest(const JsonDocument &doc);
   void cmdFileWrite(const JsonDocument &doc);
   void cmdFirmwareData(const JsonDocument &doc);
   void cmdFirmwareWrite(const JsonDocument &doc);
+  void cmdNetLatencyQuery(const JsonDocument &doc);
+  void cmdNetLatencyReset(const JsonDocument &doc);
+  void cmdNetMetricsAck(const JsonDocument &doc);
   void cmdNetMetricsQuery(const JsonDocument &doc);
+  void cmdNetMetricsSchemaQuery(const JsonDocument &doc);
+  void cmdNetMetricsSubscribe(const JsonDocument &doc);
   void cmdPing(const JsonDocument &doc);
+  void cmdPong(const JsonDocument &doc);
   void cmdReset(const JsonDocument &doc);
   void cmdRestart(const JsonDocument &doc);
   void cmdSystemQuery(const JsonDocument &doc);
   void cmdTime(const JsonDocument &doc);
+  void cmdTraceQuery(const JsonDocument &doc);
   void sendFileInfo(const char *filename);
+  void sendPing();
+  void sendMetrics(const long *values, const long *base, uint8_t base_count, bool push);
+  void pushMetrics();
+  void transferStatus(const char *filename, int progress, bool active, bool changed);
  public:
   NetThing(int rx_buffer_len=1500, int tx_buffer_len=1500);
   void loop();
@@ -106,6 +269,11 @@ class NetThing {
   void reconnect();
   void allowFileSync(bool allow);
   void allowFirmwareSync(bool allow);
+  MetricsRegistry &getMetrics();
+  TimerWheel &getTimers();
+  bool timeSynced();
+  int64_t nowMs();
+  long nextDeadline();
   uint16_t getRestartReason();
   void restartWithReason(uint16_t reason);
   bool sendJson(const JsonDocument &doc, bool now=false);
@@ -115,19 +283,41 @@ class NetThing {
   void setDebug(bool enabled);
   void setReconnectMaxTime(unsigned long ms);
   void setConnectionStableTime(unsigned long ms);
+  void setReconnectLinkUpSplay(unsigned long ms);
+  void setLowLatency(bool fast_receive, bool fast_send);
   void setFilenamePrefix(const char *prefix);
   void setServer(const char *host, int port,
                  bool secure=false, bool verify=false,
                  const uint8_t *fingerprint1=NULL,
                  const uint8_t *fingerprint2=NULL);
+  bool addServer(const char *host, int port,
+                 bool secure=false, bool verify=false,
+                 const uint8_t *fingerprint1=NULL,
+                 const uint8_t *fingerprint2=NULL);
+  void setServerFailover(unsigned long errors, unsigned long failback_ms);
+  void setDnsCache(unsigned long cache_ms, unsigned long timeout_ms);
   void setReceiveWatchdog(unsigned long timeout);
   void setLoopWatchdog(unsigned long timeout);
+  void setPowerSave(uint8_t mode, unsigned long max_sleep_ms=1000);
+  void setEventBatching(unsigned long window_ms);
+  bool setChannel(uint8_t channel, size_t tx_buffer_len, uint8_t weight=1);
+  void setChannelHeader(bool enable);
+  void setTrafficChannel(uint8_t traffic_class, uint8_t channel);
+  void setBulkChannel(uint8_t channel);
+  void onChannelPacket(uint8_t channel, PacketStreamReceivePacketHandler callback);
+  void setRateLimit(uint8_t traffic_class, unsigned long rate, unsigned long burst, uint8_t policy=TRAFFIC_DROP);
+  void setControlReserve(size_t bytes);
   void setWiFi(const char *ssid, const char *password);
   void setWifiCheckInterval(unsigned long interval);
+  void setPingInterval(unsigned long interval);
+  void setFileSystem(FS &filesystem);
+  void setFileTransfers(uint8_t count, unsigned long idle_timeout=30000);
   void start();
   void stop();
   void sendEvent(const char* event, const char* message=NULL);
   void sendEvent(const char* event, size_t size, const char* format, ...);
+  void sendPriorityEvent(const char* event, const char* message=NULL);
+  void flushEvents();
 };
 
 #endif
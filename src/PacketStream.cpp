@@ -1,18 +1,149 @@
 #include "PacketStream.hpp"
 
 #include "tcp_axtls.h"
+#include <core_version.h>
+
+// In the 2.7.x cores delay() suspends in esp_yield() and any esp_schedule()
+// resumes it, so wake() can end a sleep early. Later cores resume a delay
+// only once it has run its course, so there sleep() polls in short slices.
+#if defined(ARDUINO_ESP8266_RELEASE_2_7_0) || defined(ARDUINO_ESP8266_RELEASE_2_7_1) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_7_2) || defined(ARDUINO_ESP8266_RELEASE_2_7_3) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_7_4)
+#define PACKETSTREAM_DELAY_WAKES
+#endif
 
 using namespace std::placeholders;
 
-PacketStream::PacketStream(int rx_buffer_len, int tx_buffer_len):
+static const unsigned long latency_bounds[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000};
+
+void PacketStreamTimestamps::clear() {
+  head = 0;
+  count = 0;
+}
+
+void PacketStreamTimestamps::mark(uint32_t offset, uint32_t now) {
+  if (count == PACKETSTREAM_TIMESTAMP_SLOTS) {
+    uint8_t last = (head + count - 1) % PACKETSTREAM_TIMESTAMP_SLOTS;
+    end[last] = offset;
+    time[last] = now;
+    return;
+  }
+  uint8_t slot = (head + count) % PACKETSTREAM_TIMESTAMP_SLOTS;
+  end[slot] = offset;
+  time[slot] = now;
+  count++;
+}
+
+bool PacketStreamTimestamps::first(uint32_t offset, uint32_t *when) {
+  // discard slots that ended before this offset, the next slot is the one
+  // in which the offset was reached
+  while (count > 0 && (int32_t)(end[head] - offset) < 0) {
+    head = (head + 1) % PACKETSTREAM_TIMESTAMP_SLOTS;
+    count--;
+  }
+  if (count == 0) {
+    return false;
+  }
+  *when = time[head];
+  return true;
+}
+
+bool PacketStreamTimestamps::pop(uint32_t offset, uint32_t *when) {
+  if (count > 0 && (int32_t)(end[head] - offset) <= 0) {
+    *when = time[head];
+    head = (head + 1) % PACKETSTREAM_TIMESTAMP_SLOTS;
+    count--;
+    return true;
+  }
+  return false;
+}
+
+PacketStream::PacketStream(int rx_buffer_len, int tx_buffer_len, MetricsRegistry &metrics, TimerWheel &timers):
   rx_buffer(rx_buffer_len),
-  tx_buffer(tx_buffer_len)
+  tx_buffer(tx_buffer_len),
+  metrics(metrics),
+  timers(timers),
+  rx_queue_latency(latency_bounds, sizeof(latency_bounds) / sizeof(latency_bounds[0])),
+  rx_handler_time(latency_bounds, sizeof(latency_bounds) / sizeof(latency_bounds[0])),
+  tx_queue_latency(latency_bounds, sizeof(latency_bounds) / sizeof(latency_bounds[0]))
 {
+  // a packet must fit entirely into rx_buffer before it is dispatched
+  rx_packet = new uint8_t[rx_buffer_len + 1];
+
+  for (int i = 0; i < PACKETSTREAM_MAX_CHANNELS; i++) {
+    channels[i].queue = NULL;
+    channels[i].weight = 1;
+  }
+  channels[0].queue = &tx_buffer;
+
+#ifdef ESP8266
+  uint32_t data[2];
+  ESP.rtcUserMemoryRead(NETTHING_DNS_RTCOFFSET, data, 8);
+  if ((data[0] & 0xFFFF0000) == (uint32_t)NETTHING_DNS_RTCMAGIC << 16) {
+    rtc_dns_hash = data[0] & 0xFFFF;
+    rtc_dns_address = data[1];
+  }
+#endif
+
+  metric_rx_buffer_high_watermark = metrics.addGauge("net_rx_buf_max");
+  metric_tcp_double_connect_errors = metrics.addCounter("net_tcp_double_connect_errors");
+  metric_tcp_connects = metrics.addCounter("net_tcp_reconns");
+  metric_tcp_fingerprint_errors = metrics.addCounter("net_tcp_fingerprint_errors");
+  metric_tcp_async_errors = metrics.addCounter("net_tcp_async_errors");
+  metric_tcp_sync_errors = metrics.addCounter("net_tcp_sync_errors");
+  metric_tcp_outages = metrics.addCounter("net_tcp_outages");
+  metric_tcp_outage_last_ms = metrics.addGauge("net_tcp_outage_last_ms");
+  metric_tcp_outage_max_ms = metrics.addGauge("net_tcp_outage_max_ms");
+  metric_tcp_outage_total_ms = metrics.addCounter("net_tcp_outage_total_ms");
+  metric_tcp_link_up_reconnects = metrics.addCounter("net_tcp_link_up_reconnects");
+  metric_endpoint = metrics.addGauge("net_endpoint");
+  metric_endpoint_failovers = metrics.addCounter("net_endpoint_failovers");
+  metric_endpoint_failbacks = metrics.addCounter("net_endpoint_failbacks");
+  metric_dns_hits = metrics.addCounter("net_dns_hits");
+  metric_dns_misses = metrics.addCounter("net_dns_misses");
+  metric_dns_failures = metrics.addCounter("net_dns_failures");
+  metric_dns_fallbacks = metrics.addCounter("net_dns_fallbacks");
+  metric_dns_lookup_ms = metrics.addGauge("net_dns_lookup_ms");
+  metric_dns_lookup_max_ms = metrics.addGauge("net_dns_lookup_max_ms");
+  metric_tx_buffer_high_watermark = metrics.addGauge("net_tx_buf_max");
+  metric_tx_delay_count = metrics.addCounter("net_tx_delay_count");
+  metric_packet_queue_error = metrics.addCounter("net_tx_queue_error");
+  metric_packet_queue_full = metrics.addCounter("net_tx_queue_full");
+  metric_packet_queue_ok = metrics.addCounter("net_tx_queue_ok");
+#ifdef NETTHING_ALLOC_COUNTING
+  metric_rx_packets = metrics.addCounter("net_rx_packets");
+  metric_rx_packet_allocs = metrics.addCounter("net_rx_packet_allocs");
+  metric_rx_packet_alloc_bytes = metrics.addCounter("net_rx_packet_alloc_bytes");
+  metric_rx_packet_allocs_max = metrics.addGauge("net_rx_packet_allocs_max");
+#endif
+}
 
+void PacketStream::flushBuffers() {
+  rx_buffer.flush();
+  for (int i = 0; i < PACKETSTREAM_MAX_CHANNELS; i++) {
+    if (channels[i].queue) {
+      channels[i].queue->flush();
+    }
+  }
+  tx_channel = 0;
+  tx_channel_frames = 0;
+  tx_frame_remaining = 0;
+  rx_stamps.clear();
+  tx_stamps.clear();
+  rx_bytes_in = rx_bytes_out = 0;
+  tx_bytes_in = tx_bytes_out = 0;
+}
+
+void PacketStream::resetLatency() {
+  rx_queue_latency.reset();
+  rx_handler_time.reset();
+  tx_queue_latency.reset();
 }
 
 void PacketStream::setDebug(bool enable) {
   debug = enable;
+  netthing_trace.setLevel(enable ? TRACE_DEBUG : TRACE_INFO);
+  netthing_trace.setEcho(enable);
 }
 
 void PacketStream::setConnectionStableTime(unsigned long ms) {
@@ -23,16 +154,203 @@ void PacketStream::setReconnectMaxTime(unsigned long ms) {
   reconnect_interval_max = ms;
 }
 
+void PacketStream::setLinkUpSplay(unsigned long ms) {
+  reconnect_link_up_splay = ms;
+}
+
+void PacketStream::setFastReceive(bool enable) {
+  fast_receive = enable;
+}
+
+void PacketStream::setFastSend(bool enable) {
+  fast_send = enable;
+}
+
 void PacketStream::setServer(const char *host, int port,
                              bool secure, bool verify,
                              const uint8_t *fingerprint1,
                              const uint8_t *fingerprint2) {
-  server_host = host;
-  server_port = port;
-  server_secure = secure;
-  server_verify = verify;
-  server_fingerprint1 = fingerprint1;
-  server_fingerprint2 = fingerprint2;
+  endpoint_count = 0;
+  endpoint_index = 0;
+  addServer(host, port, secure, verify, fingerprint1, fingerprint2);
+}
+
+bool PacketStream::addServer(const char *host, int port,
+                             bool secure, bool verify,
+                             const uint8_t *fingerprint1,
+                             const uint8_t *fingerprint2) {
+  if (endpoint_count >= PACKETSTREAM_MAX_ENDPOINTS) {
+    return false;
+  }
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_count++];
+  memset(&endpoint, 0, sizeof(endpoint));
+  endpoint.host = host;
+  endpoint.port = port;
+  endpoint.secure = secure;
+  endpoint.verify = verify;
+  endpoint.fingerprint1 = fingerprint1;
+  endpoint.fingerprint2 = fingerprint2;
+  if (rtc_dns_address && hostHash(host) == rtc_dns_hash) {
+    // known good from before the restart, only used if resolving fails
+    endpoint.address = rtc_dns_address;
+    endpoint.address_expires = millis();
+    endpoint.address_valid = true;
+  }
+  return true;
+}
+
+void PacketStream::setDnsCache(unsigned long cache_ms, unsigned long timeout_ms) {
+  dns_cache_time = cache_ms;
+  dns_timeout = timeout_ms;
+}
+
+uint16_t PacketStream::hostHash(const char *host) {
+  // FNV-1a folded to 16 bits
+  uint32_t hash = 2166136261UL;
+  while (*host) {
+    hash ^= (uint8_t)*host++;
+    hash *= 16777619UL;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+void PacketStream::saveAddress() {
+#ifdef ESP8266
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  uint16_t hash = hostHash(endpoint.host);
+  if (!endpoint.address_valid || (hash == rtc_dns_hash && endpoint.address == rtc_dns_address)) {
+    return;
+  }
+  rtc_dns_hash = hash;
+  rtc_dns_address = endpoint.address;
+  uint32_t data[2];
+  data[0] = (uint32_t)NETTHING_DNS_RTCMAGIC << 16 | hash;
+  data[1] = endpoint.address;
+  ESP.rtcUserMemoryWrite(NETTHING_DNS_RTCOFFSET, data, 8);
+#endif
+}
+
+// called from the lwIP context, loop() picks up the result
+void PacketStream::dnsFoundCallback(const char *name, const ip_addr_t *ipaddr, void *arg) {
+  PacketStream *self = (PacketStream *)arg;
+  if (!self->dns_pending || self->dns_done) {
+    return;
+  }
+  if (ipaddr) {
+    self->dns_result = (uint32_t)IPAddress(ipaddr);
+    self->dns_ok = true;
+  } else {
+    self->dns_ok = false;
+  }
+  self->dns_done = true;
+}
+
+void PacketStream::dnsResolved(uint32_t address) {
+  unsigned long lookup_ms = millis() - dns_started_time;
+  metrics.inc(metric_dns_misses);
+  metrics.set(metric_dns_lookup_ms, lookup_ms);
+  metrics.setMax(metric_dns_lookup_max_ms, lookup_ms);
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  endpoint.address = address;
+  endpoint.address_expires = millis() + dns_cache_time;
+  endpoint.address_valid = true;
+  connectAddress(address);
+}
+
+void PacketStream::dnsFailed() {
+  metrics.inc(metric_dns_failures);
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  if (endpoint.address_valid) {
+    TRACE(TRACE_WARN, TRACE_PS_DNS_FALLBACK, endpoint.address, 0);
+    metrics.inc(metric_dns_fallbacks);
+    connectAddress(endpoint.address);
+    return;
+  }
+  TRACE(TRACE_WARN, TRACE_PS_DNS_FAILED, millis() - dns_started_time, 0);
+  attemptFailed();
+  tcp_active = false;
+  scheduleConnect();
+}
+
+void PacketStream::setFailover(unsigned long errors, unsigned long failback_ms) {
+  failover_errors = errors;
+  failback_interval = failback_ms;
+}
+
+void PacketStream::recordRtt(unsigned long ms) {
+  if (endpoint_count == 0) {
+    return;
+  }
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  if (endpoint.rtt_ms == 0) {
+    endpoint.rtt_ms = ms;
+  } else {
+    endpoint.rtt_ms = endpoint.rtt_ms - endpoint.rtt_ms / 8 + ms / 8;
+  }
+}
+
+void PacketStream::serializeEndpoints(JsonArray array) {
+  for (uint8_t i = 0; i < endpoint_count; i++) {
+    JsonObject obj = array.createNestedObject();
+    obj["host"] = endpoints[i].host;
+    obj["port"] = endpoints[i].port;
+    obj["active"] = i == endpoint_index;
+    obj["connects"] = endpoints[i].connects;
+    obj["failures"] = endpoints[i].failures;
+    obj["consecutive_failures"] = endpoints[i].consecutive_failures;
+    obj["handshake_ms"] = endpoints[i].handshake_ms;
+    obj["rtt_ms"] = endpoints[i].rtt_ms;
+  }
+}
+
+// onError and onDisconnect can both follow one failed attempt, count it once
+void PacketStream::attemptFailed() {
+  if (!attempt_failed) {
+    attempt_failed = true;
+    endpointFailed();
+  }
+}
+
+void PacketStream::endpointFailed() {
+  if (endpoint_count == 0) {
+    return;
+  }
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  endpoint.failures++;
+  endpoint.consecutive_failures++;
+  if (endpoint_count > 1 && failover_errors > 0 && endpoint.consecutive_failures >= failover_errors) {
+    endpoint.consecutive_failures = 0;
+    endpoint_index = (endpoint_index + 1) % endpoint_count;
+    metrics.inc(metric_endpoint_failovers);
+    metrics.set(metric_endpoint, endpoint_index);
+    TRACE(TRACE_WARN, TRACE_PS_FAILOVER, endpoint_index, 0);
+    // a different server shouldn't inherit the backoff
+    reconnect_interval = reconnect_interval_min;
+  }
+}
+
+// check the preferred endpoint with a separate connection, so that the
+// session isn't dropped until there's somewhere better to go
+void PacketStream::probeFailback() {
+  probe_active = true;
+  probe_client.onConnect([=](void *arg, AsyncClient *c) {
+    failback_pending = true;
+    c->close(true);
+  },
+  NULL);
+  probe_client.onDisconnect([=](void *arg, AsyncClient *c) {
+    probe_active = false;
+  },
+  NULL);
+  probe_client.onError([=](void *arg, AsyncClient *c, int error) {
+    probe_active = false;
+  },
+  NULL);
+  TRACE(TRACE_INFO, TRACE_PS_FAILBACK_PROBE, 0, 0);
+  if (!probe_client.connect(endpoints[0].host, endpoints[0].port, endpoints[0].secure)) {
+    probe_client.close(true);
+    probe_active = false;
+  }
 }
 
 void PacketStream::onConnect(PacketStreamConnectHandler callback) {
@@ -47,6 +365,34 @@ void PacketStream::onReceivePacket(PacketStreamReceivePacketHandler callback) {
   receivepacket_callback = callback;
 }
 
+// packets on a channel without its own handler go to the default one
+void PacketStream::onReceivePacket(uint8_t channel, PacketStreamReceivePacketHandler callback) {
+  if (channel < PACKETSTREAM_MAX_CHANNELS) {
+    channels[channel].callback = callback;
+  }
+}
+
+// Gives a channel its own transmit queue so that its frames don't wait
+// behind those of other channels. Frames are taken from each channel in
+// turn, weight at a time. Channels without a queue share channel 0's.
+bool PacketStream::setChannel(uint8_t channel, size_t tx_buffer_len, uint8_t weight) {
+  if (channel >= PACKETSTREAM_MAX_CHANNELS || weight == 0) {
+    return false;
+  }
+  if (channel > 0 && !channels[channel].queue) {
+    channels[channel].queue = new cbuf(tx_buffer_len);
+  }
+  channels[channel].weight = weight;
+  return true;
+}
+
+// Adds a channel id byte to every frame header in both directions, so that
+// received packets can be routed to per-channel handlers. The server must
+// expect it, and it must be set before start().
+void PacketStream::setChannelHeader(bool enable) {
+  channel_header = enable;
+}
+
 void PacketStream::start() {
   enabled = true;
   scheduleConnect();
@@ -54,6 +400,12 @@ void PacketStream::start() {
 
 void PacketStream::stop() {
   enabled = false;
+  link_wait = false;
+  if (dns_pending) {
+    dns_pending = false;
+    timers.cancel(dns_timer);
+    tcp_active = false;
+  }
   client.close(true);
 }
 
@@ -62,70 +414,196 @@ void PacketStream::reconnect() {
   client.close(true);
 }
 
+void PacketStream::linkUp() {
+  // the network has just come back, there's no point waiting out a
+  // backoff that was built up while it was unavailable
+  reconnect_interval = reconnect_interval_min;
+  long remaining = timers.remaining(connect_timer);
+  long splay = random(0, reconnect_link_up_splay + 1);
+  if (remaining >= 0) {
+    if (remaining > splay) {
+      TRACE(TRACE_INFO, TRACE_PS_RECONNECT_LINK_UP, splay, 0);
+      timers.reschedule(connect_timer, splay);
+      metrics.inc(metric_tcp_link_up_reconnects);
+    }
+  } else if (link_wait && enabled) {
+    // the connect that fell due while the link was down
+    link_wait = false;
+    TRACE(TRACE_INFO, TRACE_PS_RECONNECT_LINK_UP, splay, 0);
+    connect_timer = timers.add(splay, [this]() { connectDue(); });
+    metrics.inc(metric_tcp_link_up_reconnects);
+  }
+  wake();
+}
+
+bool PacketStream::connected() {
+  return client.connected();
+}
+
+// Block in delay() for up to ms so that the SDK can put the modem or CPU
+// to sleep. Network events cut the delay short, at once on the 2.7.x cores
+// and within PACKETSTREAM_SLEEP_SLICE otherwise. Returns the micros() of
+// the waking event, or 0 if the full period elapsed.
+uint32_t PacketStream::sleep(unsigned long ms) {
+  sleep_wake_time = 0;
+  sleeping = true;
+#ifdef PACKETSTREAM_DELAY_WAKES
+  delay(ms);
+#else
+  unsigned long start = millis();
+  unsigned long elapsed;
+  while (sleeping && (elapsed = millis() - start) < ms) {
+    unsigned long left = ms - elapsed;
+    delay(left < PACKETSTREAM_SLEEP_SLICE ? left : PACKETSTREAM_SLEEP_SLICE);
+  }
+#endif
+  sleeping = false;
+  return sleep_wake_time;
+}
+
+void PacketStream::wake() {
+  // called from lwIP and WiFi event callbacks
+  if (sleeping) {
+    sleeping = false;
+    sleep_wake_time = micros() | 1;
+    esp_schedule();
+  }
+}
+
+// true while loop() has work it could do right now
+bool PacketStream::pending() {
+  if (txAvailable() > 0 || failback_pending || (dns_pending && dns_done)) {
+    return true;
+  }
+  size_t header_len = headerLength();
+  if (rx_buffer.available() >= header_len) {
+    char peekbuf[2];
+    rx_buffer.peek(peekbuf, 2);
+    unsigned int length = ((uint8_t)peekbuf[0] << 8) | (uint8_t)peekbuf[1];
+    return rx_buffer.available() >= length + header_len;
+  }
+  return false;
+}
+
+size_t PacketStream::txRoom(uint8_t channel) {
+  // space for a packet payload, after its header
+  size_t room = txQueue(channel).room();
+  size_t header_len = headerLength();
+  return room > header_len ? room - header_len : 0;
+}
+
+size_t PacketStream::headerLength() {
+  return channel_header ? 3 : 2;
+}
+
+cbuf &PacketStream::txQueue(uint8_t channel) {
+  if (channel < PACKETSTREAM_MAX_CHANNELS && channels[channel].queue) {
+    return *channels[channel].queue;
+  }
+  return tx_buffer;
+}
+
+size_t PacketStream::txAvailable() {
+  size_t available = 0;
+  for (int i = 0; i < PACKETSTREAM_MAX_CHANNELS; i++) {
+    if (channels[i].queue) {
+      available += channels[i].queue->available();
+    }
+  }
+  return available;
+}
+
 void PacketStream::connect() {
   if (!enabled) {
-    Serial.println("PacketStream: not enabled, connect aborted");
+    TRACE(TRACE_WARN, TRACE_PS_NOT_ENABLED, 0, 0);
     return;
   }
 
   if (client.connected() || client.connecting()) {
-    Serial.println("PacketStream: already connected or connecting");
+    TRACE(TRACE_WARN, TRACE_PS_ALREADY_CONNECTED, 0, 0);
     return;
   }
 
   if (tcp_active) {
-    tcp_double_connect_errors++;
+    metrics.inc(metric_tcp_double_connect_errors);
+    return;
+  }
+
+  if (endpoint_count == 0) {
+    TRACE(TRACE_ERROR, TRACE_PS_NO_SERVER, 0, 0);
     return;
   }
 
   tcp_active = true;
+  attempt_failed = false;
 
   client.onError([&](void *arg, AsyncClient *c, int error) {
-    tcp_async_errors++;
-    Serial.print("PacketStream: error ");
-    Serial.print(error, DEC);
-    Serial.print(": ");
-    Serial.println(c->errorToString(error));
+    metrics.inc(metric_tcp_async_errors);
+    TRACE(TRACE_WARN, TRACE_PS_ASYNC_ERROR, error, 0);
+    connectionLost();
+    wake();
     tcp_active = false;
     scheduleConnect();
   },
   NULL);
 
-  //client.onPoll([=](void *arg, AsyncClient *c) {
-  //  //if (tx_buffer.available() > 0) {
-  //  //  processTxBuffer();
-  //  //}
-  //},
-  //NULL);
+  client.onAck([=](void *arg, AsyncClient *c, size_t len, uint32_t time) {
+    // the send window has opened, push out anything still queued
+    if (fast_send && txAvailable() > 0) {
+      processTxBuffer();
+    }
+  },
+  NULL);
+
+  client.onPoll([=](void *arg, AsyncClient *c) {
+    if (fast_send && txAvailable() > 0) {
+      processTxBuffer();
+    }
+  },
+  NULL);
 
   client.onConnect([=](void *arg, AsyncClient *c) {
-    if (server_secure) {
-      if (server_verify) {
+    PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+    if (endpoint.secure) {
+      if (endpoint.verify) {
         SSL *ssl = c->getSSL();
         bool matched = false;
-        if (ssl_match_fingerprint(ssl, server_fingerprint1) == 0) {
-          Serial.println("PacketStream: TLS fingerprint #1 matched");
+        if (ssl_match_fingerprint(ssl, endpoint.fingerprint1) == 0) {
+          TRACE(TRACE_INFO, TRACE_PS_TLS_MATCHED, 1, 0);
           matched = true;
         }
-        if (ssl_match_fingerprint(ssl, server_fingerprint2) == 0) {
-          Serial.println("PacketStream: TLS fingerprint #2 matched");
+        if (ssl_match_fingerprint(ssl, endpoint.fingerprint2) == 0) {
+          TRACE(TRACE_INFO, TRACE_PS_TLS_MATCHED, 2, 0);
           matched = true;
         }
         if (!matched) {
-          Serial.println("PacketStream: TLS fingerprint doesn't match, disconnecting");
-          tcp_fingerprint_errors++;
+          TRACE(TRACE_ERROR, TRACE_PS_TLS_MISMATCH, 0, 0);
+          metrics.inc(metric_tcp_fingerprint_errors);
           c->close(true);
+          // not a connection, onDisconnect() has already scheduled the retry
+          return;
         }
       } else {
-        Serial.println("PacketStream: TLS fingerprint not verified, continuing");
+        TRACE(TRACE_INFO, TRACE_PS_TLS_UNVERIFIED, 0, 0);
       }
     }
-    tcp_connects++;
+    metrics.inc(metric_tcp_connects);
     last_connect_time = millis();
+    endpoint.connects++;
+    endpoint.handshake_ms = last_connect_time - connect_started_time;
+    saveAddress();
+    if (outage_active) {
+      unsigned long outage_ms = last_connect_time - outage_start_time;
+      metrics.set(metric_tcp_outage_last_ms, outage_ms);
+      metrics.setMax(metric_tcp_outage_max_ms, outage_ms);
+      metrics.inc(metric_tcp_outage_total_ms, outage_ms);
+      outage_active = false;
+    }
     connection_stable = false;
-    rx_buffer.flush();
-    tx_buffer.flush();
-    Serial.println("PacketStream: connected");
+    timers.cancel(stable_timer);
+    stable_timer = timers.add(connection_stable_time, [this]() { connectionStable(); });
+    flushBuffers();
+    TRACE(TRACE_INFO, TRACE_PS_CONNECTED, metrics.get(metric_tcp_connects), 0);
     if (connect_callback) {
       connect_callback();
     }
@@ -133,9 +611,15 @@ void PacketStream::connect() {
   NULL);
 
   client.onDisconnect([=](void *arg, AsyncClient *c) {
-    Serial.println("PacketStream: disconnected");
-    rx_buffer.flush();
-    tx_buffer.flush();
+    TRACE(TRACE_INFO, TRACE_PS_DISCONNECTED, 0, 0);
+    connectionLost();
+    wake();
+    if (!outage_active) {
+      outage_active = true;
+      outage_start_time = millis();
+      metrics.inc(metric_tcp_outages);
+    }
+    flushBuffers();
     if (disconnect_callback) {
       disconnect_callback();
     }
@@ -145,25 +629,28 @@ void PacketStream::connect() {
   NULL);
 
   client.onData([=](void *arg, AsyncClient *c, void *data, size_t len) {
-    if (debug) {
-      Serial.print("PacketStream: received ");
-      Serial.print(len, DEC);
-      Serial.println(" bytes");
-    }
+    TRACE(TRACE_DEBUG, TRACE_PS_RECEIVED, len, 0);
     if (len > 0) {
-      for (unsigned int i = 0; i < len; i++) {
-        if (rx_buffer.write(((uint8_t *)data)[i]) != 1) {
-          Serial.println("PacketStream: buffer is full, closing session!");
-          c->close(true);
-          return;
-        }
+      if (rx_buffer.room() < len) {
+        TRACE(TRACE_ERROR, TRACE_PS_RX_FULL, len, rx_buffer.room());
+        c->close(true);
+        return;
       }
+      rx_buffer.write((const char *)data, len);
+      rx_bytes_in += len;
+      rx_stamps.mark(rx_bytes_in, micros());
     }
-    if (rx_buffer.available() > rx_buffer_high_watermark) {
-      rx_buffer_high_watermark = rx_buffer.available();
-    }
-    if (fast_receive) {
-      processRxBuffer();
+    metrics.setMax(metric_rx_buffer_high_watermark, rx_buffer.available());
+    wake();
+    if (fast_receive && !rx_dispatch_scheduled) {
+      // this runs in the lwIP callback context, so dispatch at the next
+      // yield(), delay() or loop() return rather than from here
+      rx_dispatch_scheduled = true;
+      schedule_recurrent_function_us([this]() {
+        rx_dispatch_scheduled = false;
+        processRxBuffer();
+        return false;
+      }, 0);
     }
   },
   NULL);
@@ -172,48 +659,108 @@ void PacketStream::connect() {
   client.setRxTimeout(300);
   client.setNoDelay(true);
 
-  Serial.println("PacketStream: connecting");
-  if (!client.connect(server_host, server_port, server_secure)) {
-    tcp_sync_errors++;
-    Serial.println("PacketStream: connect failed");
-    client.close(true);
-    tcp_active = false;
-    scheduleConnect();
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  if (endpoint.secure) {
+    connectHost();
+    return;
+  }
+  IPAddress literal;
+  if (literal.fromString(endpoint.host)) {
+    connectAddress(literal);
+    return;
+  }
+  if (endpoint.address_valid && (long)(endpoint.address_expires - millis()) > 0) {
+    metrics.inc(metric_dns_hits);
+    connectAddress(endpoint.address);
+    return;
+  }
+
+  ip_addr_t addr;
+  dns_started_time = millis();
+  dns_done = false;
+  dns_pending = true;
+  timers.cancel(dns_timer);
+  dns_timer = timers.add(dns_timeout, [this]() {
+    if (dns_pending && !dns_done) {
+      dns_pending = false;
+      dnsFailed();
+    }
+  });
+  err_t err = dns_gethostbyname(endpoint.host, &addr, &PacketStream::dnsFoundCallback, this);
+  if (err == ERR_OK) {
+    // answered from lwIP's own table
+    dns_pending = false;
+    timers.cancel(dns_timer);
+    dnsResolved((uint32_t)IPAddress(&addr));
+  } else if (err != ERR_INPROGRESS) {
+    dns_pending = false;
+    timers.cancel(dns_timer);
+    dnsFailed();
   }
 }
 
-bool PacketStream::send(const uint8_t* packet, size_t packet_len) {
-  char header[3];
+void PacketStream::connectAddress(uint32_t address) {
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  TRACE(TRACE_INFO, TRACE_PS_CONNECTING, endpoint_index, address);
+  connect_started_time = millis();
+  if (!client.connect(IPAddress(address), endpoint.port, endpoint.secure)) {
+    connectFailed();
+  }
+}
 
-  if (debug) {
-    Serial.print("PacketStream: send ");
-    for (unsigned int i=0; i<packet_len; i++) {
-      printf("%02x", packet[i]);
-    }
-    Serial.println();
+// TLS needs the hostname, which AsyncClient only has when it resolves it
+// itself, so secure endpoints bypass the DNS cache and its fallback
+void PacketStream::connectHost() {
+  PacketStreamEndpoint &endpoint = endpoints[endpoint_index];
+  TRACE(TRACE_INFO, TRACE_PS_CONNECTING, endpoint_index, 0);
+  connect_started_time = millis();
+  if (!client.connect(endpoint.host, endpoint.port, endpoint.secure)) {
+    connectFailed();
   }
+}
 
-  if (tx_buffer.room() < 2 + packet_len) {
-    Serial.println("PacketStream: send failed, no room in tx queue");
-    packet_queue_full++;
+void PacketStream::connectFailed() {
+  metrics.inc(metric_tcp_sync_errors);
+  attemptFailed();
+  TRACE(TRACE_WARN, TRACE_PS_CONNECT_FAILED, 0, 0);
+  client.close(true);
+  tcp_active = false;
+  scheduleConnect();
+}
+
+bool PacketStream::beginPacket(size_t packet_len, uint8_t channel) {
+  cbuf &queue = txQueue(channel);
+  TRACE(TRACE_DEBUG, TRACE_PS_SEND, packet_len, queue.available());
+
+  size_t header_len = headerLength();
+  if (packet_len > 0xFFFF || queue.room() < header_len + packet_len) {
+    TRACE(TRACE_WARN, TRACE_PS_TX_FULL, packet_len, queue.room());
+    metrics.inc(metric_packet_queue_full);
     return false;
   }
 
-  unsigned int sent = 0;
+  queue.write((char)((packet_len & 0xFF00) >> 8));
+  queue.write((char)(packet_len & 0xFF));
+  if (channel_header) {
+    queue.write((char)channel);
+  }
+  return true;
+}
 
-  header[0] = (packet_len & 0xFF00) >> 8;
-  header[1] = packet_len & 0xFF;
-  sent += tx_buffer.write(header[0]);
-  sent += tx_buffer.write(header[1]);
-  for (unsigned int i = 0; i < packet_len; i++) {
-    sent += tx_buffer.write(packet[i]);
+bool PacketStream::endPacket(size_t packet_len, size_t sent, uint8_t channel) {
+  size_t header_len = headerLength();
+  sent += header_len;
+  if (&txQueue(channel) == &tx_buffer) {
+    // queueing latency is only tracked through tx_buffer
+    tx_bytes_in += sent;
+    tx_stamps.mark(tx_bytes_in, micros());
   }
 
-  if (sent == packet_len + 2) {
-    packet_queue_ok++;
+  if (sent == packet_len + header_len) {
+    metrics.inc(metric_packet_queue_ok);
   } else {
-    packet_queue_error++;
-    Serial.println("PacketStream: send failed, error during queue, queue may be corrupt");
+    metrics.inc(metric_packet_queue_error);
+    TRACE(TRACE_ERROR, TRACE_PS_TX_CORRUPT, packet_len, sent);
     return false;
   }
 
@@ -224,27 +771,114 @@ bool PacketStream::send(const uint8_t* packet, size_t packet_len) {
   return true;
 }
 
+bool PacketStream::send(const uint8_t* packet, size_t packet_len, uint8_t channel) {
+  if (!beginPacket(packet_len, channel)) {
+    return false;
+  }
+  size_t sent = txQueue(channel).write((const char*)packet, packet_len);
+  return endPacket(packet_len, sent, channel);
+}
+
+// prefix is optional pre-serialized members without braces, e.g. "a":1,"b":2
+// which are sent ahead of those in doc as a single object. doc must not be
+// empty when a prefix is used.
+bool PacketStream::sendJson(const JsonDocument &doc, size_t *packet_len, const char *prefix, uint8_t channel) {
+  // room is reserved up front, then the serializer writes straight into tx_buffer
+  size_t prefix_len = prefix ? strlen(prefix) : 0;
+  size_t len = measureJson(doc);
+  if (prefix_len) {
+    len += prefix_len + 1;
+  }
+  if (packet_len) {
+    *packet_len = len;
+  }
+  if (!beginPacket(len, channel)) {
+    return false;
+  }
+  cbuf &queue = txQueue(channel);
+  size_t sent = 0;
+  if (prefix_len) {
+    sent += queue.write('{');
+    sent += queue.write(prefix, prefix_len);
+    sent += queue.write(',');
+    PacketStreamTxWriter writer(queue, 1);
+    sent += serializeJson(doc, writer) - 1;
+  } else {
+    PacketStreamTxWriter writer(queue);
+    sent = serializeJson(doc, writer);
+  }
+  return endPacket(len, sent, channel);
+}
+
 size_t PacketStream::processTxBuffer() {
-  size_t available = tx_buffer.available();
-  if (available > tx_buffer_high_watermark) {
-    tx_buffer_high_watermark = available;
+  if (in_tx_handler) {
+    return 0;
+  }
+  in_tx_handler = true;
+  size_t sent = flushTxBuffer();
+  in_tx_handler = false;
+  return sent;
+}
+
+// Picks the next frame to send by weighted round-robin over the channel
+// queues: a channel keeps its turn for weight frames or until it is empty.
+bool PacketStream::nextTxFrame() {
+  for (int tries = 0; tries <= PACKETSTREAM_MAX_CHANNELS; tries++) {
+    PacketStreamChannel &channel = channels[tx_channel];
+    if (channel.queue && tx_channel_frames < channel.weight && channel.queue->available() >= 2) {
+      char peekbuf[2];
+      channel.queue->peek(peekbuf, 2);
+      tx_frame_remaining = (((uint8_t)peekbuf[0] << 8) | (uint8_t)peekbuf[1]) + headerLength();
+      tx_channel_frames++;
+      return true;
+    }
+    tx_channel = (tx_channel + 1) % PACKETSTREAM_MAX_CHANNELS;
+    tx_channel_frames = 0;
   }
+  return false;
+}
+
+size_t PacketStream::flushTxBuffer() {
+  size_t available = txAvailable();
+  metrics.setMax(metric_tx_buffer_high_watermark, tx_buffer.available());
   if (available > 0) {
     if (client.canSend()) {
       size_t sendable = client.space();
-      if (sendable < available) {
-        available = sendable;
+      // AsyncClient copies the data, so a small stack buffer avoids
+      // a heap allocation per write
+      char out[256];
+      size_t sent = 0;
+      size_t sent_tx_buffer = 0;
+      while (sendable > 0) {
+        if (tx_frame_remaining == 0 && !nextTxFrame()) {
+          break;
+        }
+        cbuf &queue = *channels[tx_channel].queue;
+        size_t chunk = tx_frame_remaining < sizeof(out) ? tx_frame_remaining : sizeof(out);
+        if (chunk > sendable) {
+          chunk = sendable;
+        }
+        queue.read(out, chunk);
+        sent += client.add(out, chunk, ASYNC_WRITE_FLAG_COPY);
+        if (&queue == &tx_buffer) {
+          sent_tx_buffer += chunk;
+        }
+        tx_frame_remaining -= chunk;
+        sendable -= chunk;
+      }
+      if (!client.send()) {
+        sent = 0;
+      }
+      tx_bytes_out += sent_tx_buffer;
+      uint32_t now = micros();
+      uint32_t queued;
+      while (tx_stamps.pop(tx_bytes_out, &queued)) {
+        tx_queue_latency.add(now - queued);
       }
-      char *out = new char[available];
-      tx_buffer.read(out, available);
-      size_t sent = client.write(out, available);
-      delete[] out;
       return sent;
     } else {
-      if (debug) {
-        Serial.println("PacketStream: can't send yet");
-      }
-      tx_delay_count++;
+      TRACE(TRACE_DEBUG, TRACE_PS_TX_DELAYED, available, 0);
+      metrics.inc(metric_tx_delay_count);
       return 0;
     }
   }
@@ -253,36 +887,51 @@ size_t PacketStream::processTxBuffer() {
 
 size_t PacketStream::processRxBuffer() {
   if (in_rx_handler) {
-    Serial.println("PacketStream: double entry into processRxBuffer()");
+    TRACE(TRACE_WARN, TRACE_PS_RX_REENTRY, 0, 0);
     return 0;
   }
   in_rx_handler = true;
 
   unsigned int processed_bytes = 0;
 
-  while (rx_buffer.available() >= 2) {
+  size_t header_len = headerLength();
+  while (rx_buffer.available() >= header_len) {
     // while (receive_buffer->getSize() >= 2) {
-    // at least two bytes in the buffer
-    char peekbuf[2];
-    rx_buffer.peek(peekbuf, 2);
-    unsigned int length = (peekbuf[0] << 8) | peekbuf[1];
-    if (rx_buffer.available() >= length + 2) {
-      uint8_t *packet = new uint8_t[length+1];
-      rx_buffer.remove(2);
+    // a complete header in the buffer
+    char peekbuf[3];
+    rx_buffer.peek(peekbuf, header_len);
+    unsigned int length = ((uint8_t)peekbuf[0] << 8) | (uint8_t)peekbuf[1];
+    uint8_t channel = channel_header ? (uint8_t)peekbuf[2] : 0;
+    if (rx_buffer.available() >= length + header_len) {
+#ifdef NETTHING_ALLOC_COUNTING
+      uint32_t allocs_before = AllocCounter::count();
+      uint32_t alloc_bytes_before = AllocCounter::bytes();
+#endif
+      uint8_t *packet = rx_packet;
+      rx_buffer.remove(header_len);
       rx_buffer.read((char*)packet, length);
+      rx_bytes_out += length + header_len;
+      uint32_t dispatched = micros();
+      uint32_t arrived;
+      if (rx_stamps.first(rx_bytes_out, &arrived)) {
+        rx_queue_latency.add(dispatched - arrived);
+      }
       processed_bytes++;
       packet[length] = 0;
-      if (debug) {
-        Serial.print("PacketStream: recv ");
-        for (unsigned int i=0; i<length; i++) {
-          Serial.printf("%02x", packet[i]);
-        }
-        Serial.println();
-      }
-      if (receivepacket_callback) {
+      TRACE(TRACE_DEBUG, TRACE_PS_RECV, length, rx_buffer.available());
+      if (channel < PACKETSTREAM_MAX_CHANNELS && channels[channel].callback) {
+        channels[channel].callback(packet, length);
+      } else if (receivepacket_callback) {
         receivepacket_callback(packet, length);
       }
-      delete[] packet;
+      rx_handler_time.add(micros() - dispatched);
+#ifdef NETTHING_ALLOC_COUNTING
+      uint32_t allocs = AllocCounter::count() - allocs_before;
+      metrics.inc(metric_rx_packets);
+      metrics.inc(metric_rx_packet_allocs, allocs);
+      metrics.inc(metric_rx_packet_alloc_bytes, AllocCounter::bytes() - alloc_bytes_before);
+      metrics.setMax(metric_rx_packet_allocs_max, allocs);
+#endif
     } else {
       // packet isn't complete
       break;
@@ -294,36 +943,76 @@ size_t PacketStream::processRxBuffer() {
 }
 
 void PacketStream::scheduleConnect() {
-  if (!connect_scheduled) {
+  if (!timers.active(connect_timer)) {
     randomSeed(ESP.random());
-    unsigned long splayed_reconnect_interval = random(0, reconnect_interval);
+    // decorrelated jitter: next = random(min, previous * factor), capped
+    unsigned long splayed_reconnect_interval = random(reconnect_interval_min, reconnect_interval * reconnect_interval_backoff_factor + 1);
+    if (splayed_reconnect_interval > reconnect_interval_max) {
+      splayed_reconnect_interval = reconnect_interval_max;
+    }
+    reconnect_interval = splayed_reconnect_interval;
 
-    Serial.print("PacketStream: reconnecting in ");
-    Serial.print(splayed_reconnect_interval, DEC);
-    Serial.println("ms");
-    connect_scheduled_time = millis() + splayed_reconnect_interval;
-    connect_scheduled = true;
+    TRACE(TRACE_INFO, TRACE_PS_RECONNECT_SCHEDULED, splayed_reconnect_interval, 0);
+    connect_timer = timers.add(splayed_reconnect_interval, [this]() { connectDue(); });
+  }
+}
 
-    reconnect_interval = reconnect_interval * reconnect_interval_backoff_factor;
-    if (reconnect_interval > reconnect_interval_max) {
-      reconnect_interval = reconnect_interval_max;
-    }
+void PacketStream::connectDue() {
+  if (WiFi.status() == WL_CONNECTED) {
+    link_wait = false;
+    connect();
+  } else {
+    // no timer while the link is down, linkUp() schedules the connect
+    link_wait = true;
   }
 }
 
+void PacketStream::connectionStable() {
+  if (!client.connected()) {
+    return;
+  }
+  reconnect_interval = reconnect_interval_min;
+  connection_stable = true;
+  endpoints[endpoint_index].consecutive_failures = 0;
+  if (endpoint_index != 0 && failback_interval > 0) {
+    timers.cancel(failback_timer);
+    failback_timer = timers.add(failback_interval, [this]() {
+      if (!probe_active) {
+        probeFailback();
+      }
+    }, failback_interval);
+  }
+}
+
+void PacketStream::connectionLost() {
+  if (!connection_stable) {
+    attemptFailed();
+  }
+  connection_stable = false;
+  timers.cancel(stable_timer);
+  timers.cancel(failback_timer);
+}
+
 void PacketStream::loop() {
-  if (connect_scheduled) {
-    if ((long)(millis() - connect_scheduled_time) > 0) {
-      if (WiFi.status() == WL_CONNECTED) {
-        connect_scheduled = false;
-        connect();
+  if (dns_pending) {
+    if (dns_done) {
+      dns_pending = false;
+      timers.cancel(dns_timer);
+      if (dns_ok) {
+        dnsResolved(dns_result);
+      } else {
+        dnsFailed();
       }
     }
   }
-  if (!connection_stable && client.connected()) {
-    if (millis() - last_connect_time > connection_stable_time) {
-      reconnect_interval = reconnect_interval_min;
-      connection_stable = true;
+  if (failback_pending) {
+    failback_pending = false;
+    if (endpoint_index != 0) {
+      TRACE(TRACE_INFO, TRACE_PS_FAILBACK, endpoint_index, 0);
+      endpoint_index = 0;
+      metrics.inc(metric_endpoint_failbacks);
+      metrics.set(metric_endpoint, endpoint_index);
+      reconnect();
     }
   }
   processRxBuffer();
@@ -3,79 +3,284 @@
 
 #include "Arduino.h"
 #include "cbuf.h"
+#include "Schedule.h"
+#include <coredecls.h>
 #include "ESP8266WiFi.h"
 #include <ESPAsyncTCP.h>
 #include <functional>
+#include "lwip/dns.h"
+#include "AllocCounter.hpp"
+#include "ArduinoJson.h"
+#include "Histogram.hpp"
+#include "MetricsRegistry.hpp"
+#include "TimerWheel.hpp"
+#include "Trace.hpp"
+
+#ifndef PACKETSTREAM_TIMESTAMP_SLOTS
+#define PACKETSTREAM_TIMESTAMP_SLOTS 8
+#endif
+
+#ifndef PACKETSTREAM_SLEEP_SLICE
+#define PACKETSTREAM_SLEEP_SLICE 10 // ms, how often sleep() checks for a wake where delay() can't be cut short
+#endif
+
+#ifndef PACKETSTREAM_MAX_ENDPOINTS
+#define PACKETSTREAM_MAX_ENDPOINTS 4
+#endif
+
+#ifndef PACKETSTREAM_MAX_CHANNELS
+#define PACKETSTREAM_MAX_CHANNELS 4 // channel 0 uses tx_buffer, others need setChannel()
+#endif
+
+#ifdef ESP8266
+// two RTC user memory blocks holding the last known good server address
+#ifndef NETTHING_DNS_RTCOFFSET
+#define NETTHING_DNS_RTCOFFSET 125
+#endif
+#endif
+#ifndef NETTHING_DNS_RTCMAGIC
+#define NETTHING_DNS_RTCMAGIC 0xD45C
+#endif
 
 typedef std::function<void()> PacketStreamConnectHandler;
 typedef std::function<void()> PacketStreamDisconnectHandler;
 typedef std::function<void(uint8_t *data, int len)> PacketStreamReceivePacketHandler;
 
+// Records when byte offsets of a stream passed a given point, so that
+// per-packet queueing delays can be measured without per-packet storage.
+// When full, the newest slot is extended which under-reports the delay
+// for packets sharing it.
+struct PacketStreamTimestamps {
+  uint32_t end[PACKETSTREAM_TIMESTAMP_SLOTS];
+  uint32_t time[PACKETSTREAM_TIMESTAMP_SLOTS];
+  uint8_t head = 0;
+  uint8_t count = 0;
+  void clear();
+  void mark(uint32_t offset, uint32_t now);
+  bool first(uint32_t offset, uint32_t *when);
+  bool pop(uint32_t offset, uint32_t *when);
+};
+
+struct PacketStreamEndpoint {
+  const char *host;
+  int port;
+  bool secure;
+  bool verify;
+  const uint8_t *fingerprint1;
+  const uint8_t *fingerprint2;
+  // statistics
+  unsigned long connects;
+  unsigned long failures;
+  unsigned long consecutive_failures;
+  unsigned long handshake_ms; // most recent connect() to onConnect time
+  unsigned long rtt_ms; // EWMA of RTT reported by recordRtt()
+  // resolver cache, an expired address is still used if a lookup fails
+  uint32_t address;
+  unsigned long address_expires;
+  bool address_valid;
+};
+
+// A logical channel: its own transmit queue, a share of the link given by
+// weight (frames per round-robin turn) and an optional receive handler.
+struct PacketStreamChannel {
+  cbuf *queue;
+  uint8_t weight;
+  PacketStreamReceivePacketHandler callback;
+};
+
+// ArduinoJson writer that appends straight into the transmit ring buffer,
+// optionally discarding the first few bytes (the '{' of an object that is
+// being merged behind a prefix)
+class PacketStreamTxWriter {
+ private:
+  cbuf &buffer;
+  size_t skip;
+ public:
+  PacketStreamTxWriter(cbuf &buffer, size_t skip=0) : buffer(buffer), skip(skip) {}
+  size_t write(uint8_t c) {
+    if (skip) {
+      skip--;
+      return 1;
+    }
+    return buffer.write((char)c);
+  }
+  size_t write(const uint8_t *s, size_t n) {
+    size_t skipped = skip < n ? skip : n;
+    skip -= skipped;
+    return skipped + buffer.write((const char*)s + skipped, n - skipped);
+  }
+};
+
 class PacketStream {
  private:
   AsyncClient client;
+  AsyncClient probe_client;
   cbuf rx_buffer;
   cbuf tx_buffer;
+  uint8_t *rx_packet; // reused for every received packet, sized to fit rx_buffer
   PacketStreamConnectHandler connect_callback;
   PacketStreamDisconnectHandler disconnect_callback;
   PacketStreamReceivePacketHandler receivepacket_callback;
+  PacketStreamChannel channels[PACKETSTREAM_MAX_CHANNELS];
   // configuration
   bool debug = false;
-  const char *server_host;
-  int server_port;
-  bool server_secure;
-  bool server_verify;
-  const uint8_t *server_fingerprint1;
-  const uint8_t *server_fingerprint2;
+  PacketStreamEndpoint endpoints[PACKETSTREAM_MAX_ENDPOINTS]; // in order of preference
+  uint8_t endpoint_count = 0;
+  unsigned long failover_errors = 3; // move to the next endpoint after this many consecutive failures
+  unsigned long failback_interval = 600000; // probe the preferred endpoint this often, 0 to disable
+  unsigned long dns_cache_time = 300000; // reuse a resolved address for this long
+  unsigned long dns_timeout = 10000; // give up on a lookup and use the last known good address
   unsigned long reconnect_interval_min = 500;
   unsigned long reconnect_interval_max = 180000;
-  unsigned long reconnect_interval_backoff_factor = 2;
+  unsigned long reconnect_interval_backoff_factor = 3; // decorrelated jitter upper bound multiplier
   unsigned long reconnect_interval = 500; // current reconnect interval
+  unsigned long reconnect_link_up_splay = 1000; // max delay before reconnecting after the link comes up
   unsigned long connection_stable_time = 30000; // connection considered stable after this time
-  bool fast_receive = false;
-  bool fast_send = false;
+  bool fast_receive = false; // dispatch received packets from the scheduler instead of waiting for loop()
+  bool fast_send = false; // flush on send() and from onAck/onPoll instead of waiting for loop()
+  bool channel_header = false; // frames carry a channel id byte after the length
   // state
   bool enabled = false;
-  bool connect_scheduled = false;
-  unsigned long connect_scheduled_time = 0;
+  int connect_timer = -1;
+  bool link_wait = false; // a connect fell due while the link was down, linkUp() makes it
+  int stable_timer = -1;
+  int failback_timer = -1;
+  int dns_timer = -1;
   unsigned long last_connect_time = 0;
   bool connection_stable = false;
   bool in_rx_handler = false;
+  bool in_tx_handler = false;
+  bool rx_dispatch_scheduled = false;
+  uint8_t tx_channel = 0; // channel whose round-robin turn it is
+  uint8_t tx_channel_frames = 0; // frames sent in the current turn
+  size_t tx_frame_remaining = 0; // bytes of a partly sent frame, channels only switch between frames
+  volatile bool sleeping = false;
+  volatile uint32_t sleep_wake_time = 0; // micros() of the event that ended sleep(), 0 if none
   bool tcp_active = false;
+  uint8_t endpoint_index = 0; // current endpoint
+  unsigned long connect_started_time = 0;
+  bool attempt_failed = false; // the current connection attempt has been counted as a failure
+  bool probe_active = false;
+  bool failback_pending = false;
+  bool dns_pending = false; // a lookup is in progress
+  volatile bool dns_done = false; // set by the lwIP callback
+  volatile bool dns_ok = false;
+  volatile uint32_t dns_result = 0;
+  unsigned long dns_started_time = 0;
+  uint16_t rtc_dns_hash = 0;
+  uint32_t rtc_dns_address = 0;
+  uint32_t rx_bytes_in = 0;
+  uint32_t rx_bytes_out = 0;
+  uint32_t tx_bytes_in = 0;
+  uint32_t tx_bytes_out = 0;
+  PacketStreamTimestamps rx_stamps;
+  PacketStreamTimestamps tx_stamps;
+  bool outage_active = false;
+  unsigned long outage_start_time = 0;
+  // metrics
+  MetricsRegistry &metrics;
+  TimerWheel &timers;
+  int metric_tcp_connects;
+  int metric_tcp_double_connect_errors;
+  int metric_tcp_async_errors;
+  int metric_tcp_sync_errors;
+  int metric_tcp_fingerprint_errors;
+  int metric_tcp_outages;
+  int metric_tcp_outage_last_ms;
+  int metric_tcp_outage_max_ms;
+  int metric_tcp_outage_total_ms;
+  int metric_tcp_link_up_reconnects;
+  int metric_endpoint;
+  int metric_endpoint_failovers;
+  int metric_endpoint_failbacks;
+  int metric_dns_hits;
+  int metric_dns_misses;
+  int metric_dns_failures;
+  int metric_dns_fallbacks;
+  int metric_dns_lookup_ms;
+  int metric_dns_lookup_max_ms;
+  int metric_rx_buffer_high_watermark;
+  int metric_tx_buffer_high_watermark;
+  int metric_tx_delay_count;
+  int metric_packet_queue_error;
+  int metric_packet_queue_full;
+  int metric_packet_queue_ok;
+#ifdef NETTHING_ALLOC_COUNTING
+  int metric_rx_packets;
+  int metric_rx_packet_allocs;
+  int metric_rx_packet_alloc_bytes;
+  int metric_rx_packet_allocs_max;
+#endif
   // private methods
   void connect();
   size_t processTxBuffer();
+  size_t flushTxBuffer();
+  cbuf &txQueue(uint8_t channel);
+  size_t txAvailable();
+  bool nextTxFrame();
+  bool beginPacket(size_t packet_len, uint8_t channel);
+  bool endPacket(size_t packet_len, size_t sent, uint8_t channel);
   size_t processRxBuffer();
   void scheduleConnect();
+  void connectDue();
+  void connectionStable();
+  void connectionLost();
+  void wake();
+  void flushBuffers();
+  void endpointFailed();
+  void attemptFailed();
+  void probeFailback();
+  void connectAddress(uint32_t address);
+  void connectHost();
+  void connectFailed();
+  void dnsResolved(uint32_t address);
+  void dnsFailed();
+  void saveAddress();
+  static uint16_t hostHash(const char *host);
+  static void dnsFoundCallback(const char *name, const ip_addr_t *ipaddr, void *arg);
  public:
-  PacketStream(int rx_buffer_len, int tx_buffer_len);
+  PacketStream(int rx_buffer_len, int tx_buffer_len, MetricsRegistry &metrics, TimerWheel &timers);
   // metrics
-  unsigned int tcp_connects = 0;
-  unsigned int tcp_double_connect_errors = 0;
-  unsigned int tcp_async_errors = 0;
-  unsigned int tcp_sync_errors = 0;
-  unsigned int tcp_fingerprint_errors = 0;
-  unsigned int rx_buffer_high_watermark = 0;
-  unsigned int tx_buffer_high_watermark = 0;
-  unsigned int tx_delay_count = 0;
-  unsigned long packet_queue_error = 0;
-  unsigned long packet_queue_full = 0;
-  unsigned long packet_queue_ok = 0;
+  Histogram rx_queue_latency; // onData() arrival to dispatch, in microseconds
+  Histogram rx_handler_time; // dispatch to handler return, in microseconds
+  Histogram tx_queue_latency; // send() to handoff to the socket, in microseconds
   // public methods
   void setDebug(bool enable);
   void setReconnectMaxTime(unsigned long ms);
   void setConnectionStableTime(unsigned long ms);
+  void setFastReceive(bool enable);
+  void setFastSend(bool enable);
+  void setLinkUpSplay(unsigned long ms);
+  bool setChannel(uint8_t channel, size_t tx_buffer_len, uint8_t weight=1);
+  void setChannelHeader(bool enable);
   void setServer(const char *host, int port,
                  bool secure=false, bool verify=false,
                  const uint8_t *fingerprint1=NULL,
                  const uint8_t *fingerprint2=NULL);
+  bool addServer(const char *host, int port,
+                 bool secure=false, bool verify=false,
+                 const uint8_t *fingerprint1=NULL,
+                 const uint8_t *fingerprint2=NULL);
+  void setFailover(unsigned long errors, unsigned long failback_ms);
+  void setDnsCache(unsigned long cache_ms, unsigned long timeout_ms);
+  void recordRtt(unsigned long ms);
+  void serializeEndpoints(JsonArray array);
   void onConnect(PacketStreamConnectHandler callback);
   void onDisconnect(PacketStreamDisconnectHandler callback);
   void onReceivePacket(PacketStreamReceivePacketHandler callback);
+  void onReceivePacket(uint8_t channel, PacketStreamReceivePacketHandler callback);
   void start();
   void stop();
   void reconnect();
-  bool send(const uint8_t* data, size_t len);
+  void resetLatency();
+  void linkUp();
+  bool connected();
+  size_t txRoom(uint8_t channel=0);
+  size_t headerLength();
+  bool pending();
+  uint32_t sleep(unsigned long ms);
+  bool send(const uint8_t* data, size_t len, uint8_t channel=0);
+  bool sendJson(const JsonDocument &doc, size_t *packet_len=NULL, const char *prefix=NULL, uint8_t channel=0);
   void loop();
 };
 
@@ -0,0 +1,314 @@
+#include "RamFS.hpp"
+
+#ifdef NETTHING_RAMFS
+
+#include <FSImpl.h>
+#include <memory>
+
+using namespace fs;
+
+namespace {
+
+struct RamFSNode {
+  char name[RAMFS_NAME_LEN];
+  uint8_t *data = NULL;
+  size_t size = 0;
+  size_t capacity = 0;
+  ~RamFSNode() {
+    free(data);
+  }
+};
+
+typedef std::shared_ptr<RamFSNode> RamFSNodePtr;
+
+class RamFSImpl;
+
+class RamFileImpl : public FileImpl {
+ private:
+  RamFSImpl *fs;
+  RamFSNodePtr node; // kept alive by an open handle after remove()
+  size_t pos = 0;
+  bool readable;
+  bool writable;
+  bool append;
+  bool open = true;
+  bool grow(size_t len);
+
+ public:
+  RamFileImpl(RamFSImpl *fs, RamFSNodePtr node, AccessMode access_mode, bool append) :
+    fs(fs), node(node), readable(access_mode & AM_READ), writable(access_mode & AM_WRITE), append(append) {}
+  size_t write(const uint8_t *buf, size_t size) override;
+  size_t read(uint8_t *buf, size_t size) override;
+  void flush() override {}
+  bool seek(uint32_t pos, SeekMode mode) override;
+  size_t position() const override { return pos; }
+  size_t size() const override { return node->size; }
+  bool truncate(uint32_t size) override;
+  void close() override { open = false; }
+  const char *name() const override { return node->name; }
+  const char *fullName() const override { return node->name; }
+  bool isFile() const override { return open; }
+  bool isDirectory() const override { return false; }
+};
+
+class RamDirImpl : public DirImpl {
+ private:
+  RamFSImpl *fs;
+  char prefix[RAMFS_NAME_LEN + 1];
+  int index = -1; // RAMFS_MAX_FILES once the listing is done
+  RamFSNode *current();
+
+ public:
+  RamDirImpl(RamFSImpl *fs, const char *path);
+  FileImplPtr openFile(OpenMode open_mode, AccessMode access_mode) override;
+  const char *fileName() override;
+  size_t fileSize() override;
+  bool isFile() const override { return index >= 0 && index < RAMFS_MAX_FILES; }
+  bool isDirectory() const override { return false; }
+  bool next() override;
+  bool rewind() override;
+};
+
+class RamFSImpl : public FSImpl {
+ public:
+  RamFSNodePtr nodes[RAMFS_MAX_FILES];
+
+  int find(const char *path) {
+    for (int i = 0; i < RAMFS_MAX_FILES; i++) {
+      if (nodes[i] && strcmp(nodes[i]->name, path) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  size_t usedBytes() {
+    size_t used = 0;
+    for (int i = 0; i < RAMFS_MAX_FILES; i++) {
+      if (nodes[i]) {
+        used += nodes[i]->size;
+      }
+    }
+    return used;
+  }
+
+  bool setConfig(const FSConfig &cfg) override { return true; }
+  bool begin() override { return true; }
+  void end() override {}
+
+  bool format() override {
+    for (int i = 0; i < RAMFS_MAX_FILES; i++) {
+      nodes[i].reset();
+    }
+    return true;
+  }
+
+  bool info(FSInfo &info) override {
+    info.totalBytes = RAMFS_MAX_BYTES;
+    info.usedBytes = usedBytes();
+    info.blockSize = 1;
+    info.pageSize = 1;
+    info.maxOpenFiles = RAMFS_MAX_FILES;
+    info.maxPathLength = RAMFS_NAME_LEN;
+    return true;
+  }
+
+  bool info64(FSInfo64 &info) override {
+    FSInfo info32;
+    this->info(info32);
+    info.totalBytes = info32.totalBytes;
+    info.usedBytes = info32.usedBytes;
+    info.blockSize = info32.blockSize;
+    info.pageSize = info32.pageSize;
+    info.maxOpenFiles = info32.maxOpenFiles;
+    info.maxPathLength = info32.maxPathLength;
+    return true;
+  }
+
+  FileImplPtr open(const char *path, OpenMode open_mode, AccessMode access_mode) override {
+    int i = find(path);
+    if (i < 0) {
+      if (!(open_mode & OM_CREATE) || strlen(path) >= RAMFS_NAME_LEN) {
+        return FileImplPtr();
+      }
+      for (i = 0; i < RAMFS_MAX_FILES && nodes[i]; i++);
+      if (i == RAMFS_MAX_FILES) {
+        return FileImplPtr();
+      }
+      nodes[i] = std::make_shared<RamFSNode>();
+      strncpy(nodes[i]->name, path, sizeof(nodes[i]->name));
+    }
+    if ((open_mode & OM_TRUNCATE) && (access_mode & AM_WRITE)) {
+      // give the memory back, a rewrite may well be smaller
+      free(nodes[i]->data);
+      nodes[i]->data = NULL;
+      nodes[i]->size = 0;
+      nodes[i]->capacity = 0;
+    }
+    return std::make_shared<RamFileImpl>(this, nodes[i], access_mode, open_mode & OM_APPEND);
+  }
+
+  bool exists(const char *path) override {
+    return find(path) >= 0;
+  }
+
+  DirImplPtr openDir(const char *path) override {
+    return std::make_shared<RamDirImpl>(this, path);
+  }
+
+  bool rename(const char *path_from, const char *path_to) override {
+    int i = find(path_from);
+    if (i < 0 || find(path_to) >= 0 || strlen(path_to) >= RAMFS_NAME_LEN) {
+      return false;
+    }
+    strncpy(nodes[i]->name, path_to, sizeof(nodes[i]->name));
+    return true;
+  }
+
+  bool remove(const char *path) override {
+    int i = find(path);
+    if (i < 0) {
+      return false;
+    }
+    nodes[i].reset();
+    return true;
+  }
+
+  bool mkdir(const char *path) override { return true; }
+  bool rmdir(const char *path) override { return true; }
+};
+
+// extends the node to len bytes, zero filled, within RAMFS_MAX_BYTES
+bool RamFileImpl::grow(size_t len) {
+  if (len <= node->size) {
+    return true;
+  }
+  if (fs->usedBytes() + len - node->size > RAMFS_MAX_BYTES) {
+    return false;
+  }
+  if (len > node->capacity) {
+    size_t capacity = (len + 63) & ~63;
+    uint8_t *data = (uint8_t *)realloc(node->data, capacity);
+    if (!data) {
+      return false;
+    }
+    node->data = data;
+    node->capacity = capacity;
+  }
+  memset(node->data + node->size, 0, len - node->size);
+  node->size = len;
+  return true;
+}
+
+size_t RamFileImpl::write(const uint8_t *buf, size_t size) {
+  if (!open || !writable) {
+    return 0;
+  }
+  if (append) {
+    pos = node->size;
+  }
+  if (!grow(pos + size)) {
+    return 0;
+  }
+  memcpy(node->data + pos, buf, size);
+  pos += size;
+  return size;
+}
+
+size_t RamFileImpl::read(uint8_t *buf, size_t size) {
+  if (!open || !readable || pos >= node->size) {
+    return 0;
+  }
+  if (size > node->size - pos) {
+    size = node->size - pos;
+  }
+  memcpy(buf, node->data + pos, size);
+  pos += size;
+  return size;
+}
+
+bool RamFileImpl::seek(uint32_t offset, SeekMode mode) {
+  long target = offset;
+  if (mode == SeekCur) {
+    target += pos;
+  } else if (mode == SeekEnd) {
+    target = node->size + offset;
+  }
+  if (!open || target < 0 || (size_t)target > node->size) {
+    return false;
+  }
+  pos = target;
+  return true;
+}
+
+bool RamFileImpl::truncate(uint32_t size) {
+  if (!open || !writable) {
+    return false;
+  }
+  if (size > node->size) {
+    return grow(size);
+  }
+  node->size = size;
+  if (pos > size) {
+    pos = size;
+  }
+  return true;
+}
+
+// "/dir" and "/dir/" both list files under "/dir/", "" and "/" list all
+RamDirImpl::RamDirImpl(RamFSImpl *fs, const char *path) : fs(fs) {
+  strncpy(prefix, path ? path : "", RAMFS_NAME_LEN - 1);
+  prefix[RAMFS_NAME_LEN - 1] = '\0';
+  size_t len = strlen(prefix);
+  if (len > 0 && prefix[len - 1] != '/') {
+    prefix[len] = '/';
+    prefix[len + 1] = '\0';
+  }
+}
+
+// NULL before next(), after the last file or if it was removed since
+RamFSNode *RamDirImpl::current() {
+  if (index < 0 || index >= RAMFS_MAX_FILES) {
+    return NULL;
+  }
+  return fs->nodes[index].get();
+}
+
+FileImplPtr RamDirImpl::openFile(OpenMode open_mode, AccessMode access_mode) {
+  RamFSNode *node = current();
+  if (!node) {
+    return FileImplPtr();
+  }
+  return fs->open(node->name, open_mode, access_mode);
+}
+
+const char *RamDirImpl::fileName() {
+  RamFSNode *node = current();
+  return node ? node->name : "";
+}
+
+size_t RamDirImpl::fileSize() {
+  RamFSNode *node = current();
+  return node ? node->size : 0;
+}
+
+bool RamDirImpl::next() {
+  size_t prefix_len = strlen(prefix);
+  while (index < RAMFS_MAX_FILES && ++index < RAMFS_MAX_FILES) {
+    if (fs->nodes[index] && strncmp(fs->nodes[index]->name, prefix, prefix_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RamDirImpl::rewind() {
+  index = -1;
+  return true;
+}
+
+} // namespace
+
+FS RamFS = FS(FSImplPtr(new RamFSImpl()));
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef RAMFS_HPP
+#define RAMFS_HPP
+
+#include <Arduino.h>
+#include <FS.h>
+
+#ifndef RAMFS_MAX_FILES
+#define RAMFS_MAX_FILES 16
+#endif
+
+#ifndef RAMFS_MAX_BYTES
+#define RAMFS_MAX_BYTES 16384 // file contents, taken from the heap as files grow
+#endif
+
+#define RAMFS_NAME_LEN 32
+
+// Flat file system held in heap memory, built with -DNETTHING_RAMFS. It is
+// meant for exercising the file commands without flash wear:
+//   thing.setFileSystem(RamFS);
+// Names are full paths as with SPIFFS and directories are implicit, so
+// openDir() lists every file under the given prefix. Renaming onto an
+// existing file fails, also as with SPIFFS. Contents are lost on restart.
+
+extern fs::FS RamFS;
+
+#endif
@@ -0,0 +1,226 @@
+#include "TimerWheel.hpp"
+
+TimerWheel::TimerWheel(unsigned long tick_ms) : tick_ms(tick_ms ? tick_ms : 1) {
+  for (int i = 0; i < NETTHING_TIMERS_MAX; i++) {
+    timers[i].list = LIST_FREE;
+    timers[i].generation = 0;
+  }
+  for (unsigned int i = 0; i < sizeof(heads); i++) {
+    heads[i] = -1;
+  }
+  for (int i = 0; i < TIMERWHEEL_LEVELS; i++) {
+    occupied[i] = 0;
+  }
+  tick_start = millis();
+}
+
+int TimerWheel::index(int id) {
+  if (id < 0) {
+    return -1;
+  }
+  int i = id & 0xFF;
+  if (i >= NETTHING_TIMERS_MAX || timers[i].list == LIST_FREE || timers[i].generation != (id >> 8)) {
+    return -1;
+  }
+  return i;
+}
+
+uint32_t TimerWheel::ticksFor(unsigned long ms) {
+  // never fire early: count the part of the current tick already gone
+  uint32_t ticks = (ms + (millis() - tick_start) + tick_ms - 1) / tick_ms;
+  return ticks ? ticks : 1;
+}
+
+void TimerWheel::link(int8_t i) {
+  Timer &t = timers[i];
+  uint32_t expires = t.expires;
+  uint8_t list;
+  if ((expires >> 6) == (current_tick >> 6)) {
+    list = expires & 63;
+  } else if ((expires >> 12) == (current_tick >> 12)) {
+    list = TIMERWHEEL_SLOTS + ((expires >> 6) & 63);
+  } else if ((expires >> 18) == (current_tick >> 18)) {
+    list = 2 * TIMERWHEEL_SLOTS + ((expires >> 12) & 63);
+  } else {
+    list = LIST_OVERFLOW;
+  }
+  t.list = list;
+  t.prev = -1;
+  t.next = heads[list];
+  if (t.next >= 0) {
+    timers[t.next].prev = i;
+  }
+  heads[list] = i;
+  if (list != LIST_OVERFLOW) {
+    occupied[list / TIMERWHEEL_SLOTS] |= (uint64_t)1 << (list % TIMERWHEEL_SLOTS);
+  }
+}
+
+void TimerWheel::unlink(int8_t i) {
+  Timer &t = timers[i];
+  if (t.prev >= 0) {
+    timers[t.prev].next = t.next;
+  } else {
+    heads[t.list] = t.next;
+  }
+  if (t.next >= 0) {
+    timers[t.next].prev = t.prev;
+  }
+  if (heads[t.list] < 0 && t.list != LIST_OVERFLOW) {
+    occupied[t.list / TIMERWHEEL_SLOTS] &= ~((uint64_t)1 << (t.list % TIMERWHEEL_SLOTS));
+  }
+}
+
+void TimerWheel::cascade(uint8_t list) {
+  // move every timer on a coarse list down to where it now belongs
+  int8_t i = heads[list];
+  heads[list] = -1;
+  if (list != LIST_OVERFLOW) {
+    occupied[list / TIMERWHEEL_SLOTS] &= ~((uint64_t)1 << (list % TIMERWHEEL_SLOTS));
+  }
+  while (i >= 0) {
+    int8_t next = timers[i].next;
+    link(i);
+    i = next;
+  }
+}
+
+int TimerWheel::add(unsigned long delay_ms, TimerCallback callback, unsigned long period_ms) {
+  for (int8_t i = 0; i < NETTHING_TIMERS_MAX; i++) {
+    if (timers[i].list == LIST_FREE) {
+      Timer &t = timers[i];
+      t.generation = (t.generation + 1) & 0x7F;
+      t.callback = callback;
+      t.period = period_ms ? (period_ms + tick_ms - 1) / tick_ms : 0;
+      t.expires = current_tick + ticksFor(delay_ms);
+      link(i);
+      active_count++;
+      return (t.generation << 8) | i;
+    }
+  }
+  return -1;
+}
+
+bool TimerWheel::cancel(int id) {
+  int i = index(id);
+  if (i < 0) {
+    return false;
+  }
+  unlink(i);
+  timers[i].list = LIST_FREE;
+  timers[i].callback = nullptr;
+  active_count--;
+  return true;
+}
+
+bool TimerWheel::reschedule(int id, unsigned long delay_ms) {
+  int i = index(id);
+  if (i < 0) {
+    return false;
+  }
+  unlink(i);
+  timers[i].expires = current_tick + ticksFor(delay_ms);
+  link(i);
+  return true;
+}
+
+bool TimerWheel::active(int id) {
+  return index(id) >= 0;
+}
+
+// milliseconds until the timer is due, -1 if it isn't scheduled
+long TimerWheel::remaining(int id) {
+  int i = index(id);
+  if (i < 0) {
+    return -1;
+  }
+  long ms = (long)(timers[i].expires - current_tick) * tick_ms - (long)(millis() - tick_start);
+  return ms > 0 ? ms : 0;
+}
+
+uint32_t TimerWheel::earliest(uint8_t list) {
+  uint32_t best = 0;
+  bool found = false;
+  for (int8_t i = heads[list]; i >= 0; i = timers[i].next) {
+    if (!found || (int32_t)(timers[i].expires - best) < 0) {
+      best = timers[i].expires;
+      found = true;
+    }
+  }
+  return best;
+}
+
+// milliseconds until the next timer is due, -1 if none are scheduled
+long TimerWheel::nextDeadline() {
+  if (active_count == 0) {
+    return -1;
+  }
+  uint32_t expires;
+  // slots strictly after the current position on each level are in time
+  // order, so the first occupied one holds the earliest deadline
+  uint8_t shift = (current_tick & 63) + 1;
+  uint64_t pending = shift < 64 ? occupied[0] >> shift : 0;
+  if (pending) {
+    expires = current_tick + 1 + __builtin_ctzll(pending);
+  } else {
+    shift = ((current_tick >> 6) & 63) + 1;
+    pending = shift < 64 ? occupied[1] >> shift : 0;
+    if (pending) {
+      expires = earliest(TIMERWHEEL_SLOTS + shift + __builtin_ctzll(pending));
+    } else {
+      shift = ((current_tick >> 12) & 63) + 1;
+      pending = shift < 64 ? occupied[2] >> shift : 0;
+      if (pending) {
+        expires = earliest(2 * TIMERWHEEL_SLOTS + shift + __builtin_ctzll(pending));
+      } else {
+        expires = earliest(LIST_OVERFLOW);
+      }
+    }
+  }
+  long ms = (long)(expires - current_tick) * tick_ms - (long)(millis() - tick_start);
+  return ms > 0 ? ms : 0;
+}
+
+uint8_t TimerWheel::count() {
+  return active_count;
+}
+
+void TimerWheel::run() {
+  while (millis() - tick_start >= tick_ms) {
+    tick_start += tick_ms;
+    if (active_count == 0) {
+      // nothing to fire, catch up without walking every tick
+      uint32_t ticks = (millis() - tick_start) / tick_ms;
+      current_tick += ticks + 1;
+      tick_start += ticks * tick_ms;
+      continue;
+    }
+    current_tick++;
+    if ((current_tick & 63) == 0) {
+      if (((current_tick >> 6) & 63) == 0) {
+        if (((current_tick >> 12) & 63) == 0) {
+          cascade(LIST_OVERFLOW);
+        }
+        cascade(2 * TIMERWHEEL_SLOTS + ((current_tick >> 12) & 63));
+      }
+      cascade(TIMERWHEEL_SLOTS + ((current_tick >> 6) & 63));
+    }
+    uint8_t list = current_tick & 63;
+    int8_t i;
+    while ((i = heads[list]) >= 0) {
+      Timer &t = timers[i];
+      unlink(i);
+      // the callback may cancel or reschedule its own timer
+      TimerCallback callback = t.callback;
+      if (t.period) {
+        t.expires = current_tick + t.period;
+        link(i);
+      } else {
+        t.list = LIST_FREE;
+        t.callback = nullptr;
+        active_count--;
+      }
+      callback();
+    }
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <Arduino.h>
+#include <functional>
+
+#ifndef NETTHING_TIMERS_MAX
+#define NETTHING_TIMERS_MAX 32
+#endif
+#if NETTHING_TIMERS_MAX > 127
+#error "NETTHING_TIMERS_MAX must fit in an int8_t index"
+#endif
+#ifndef NETTHING_TIMER_TICK_MS
+#define NETTHING_TIMER_TICK_MS 10
+#endif
+
+#define TIMERWHEEL_SLOTS 64
+#define TIMERWHEEL_LEVELS 3
+
+typedef std::function<void()> TimerCallback;
+
+// Hierarchical timer wheel with a fixed pool of timers. Three levels of 64
+// slots cover 64, 4096 and 262144 ticks; later deadlines wait on an overflow
+// list. Adding and cancelling are O(1), and run() only touches the slot
+// for each elapsed tick plus the occasional cascade. Ids carry a generation
+// so a stale id never cancels a reused timer; -1 (pool full) is accepted
+// and ignored by every method.
+class TimerWheel {
+ private:
+  struct Timer {
+    uint32_t expires; // tick
+    uint32_t period; // ticks, 0 for one-shot
+    TimerCallback callback;
+    int8_t prev;
+    int8_t next;
+    uint8_t list; // level * TIMERWHEEL_SLOTS + slot, or one of the values below
+    uint8_t generation;
+  };
+  static const uint8_t LIST_OVERFLOW = TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS;
+  static const uint8_t LIST_FREE = 0xFF;
+  Timer timers[NETTHING_TIMERS_MAX];
+  int8_t heads[TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS + 1];
+  uint64_t occupied[TIMERWHEEL_LEVELS];
+  uint32_t current_tick = 0;
+  unsigned long tick_start; // millis() at which current_tick began
+  unsigned long tick_ms;
+  uint8_t active_count = 0;
+  int index(int id);
+  uint32_t ticksFor(unsigned long ms);
+  void link(int8_t i);
+  void unlink(int8_t i);
+  void cascade(uint8_t list);
+  uint32_t earliest(uint8_t list);
+ public:
+  TimerWheel(unsigned long tick_ms=NETTHING_TIMER_TICK_MS);
+  int add(unsigned long delay_ms, TimerCallback callback, unsigned long period_ms=0);
+  bool cancel(int id);
+  bool reschedule(int id, unsigned long delay_ms);
+  bool active(int id);
+  long remaining(int id);
+  long nextDeadline();
+  uint8_t count();
+  void run();
+};
+
+#endif
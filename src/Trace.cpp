@@ -0,0 +1,148 @@
+#include "Trace.hpp"
+
+Trace netthing_trace;
+
+Trace::Trace() {
+#ifdef ESP8266
+  restoreRtc();
+#endif
+}
+
+void Trace::log(uint8_t level, uint16_t code, uint32_t a, uint32_t b) {
+  if (level > runtime_level) {
+    return;
+  }
+  TraceRecord &record = records[total % NETTHING_TRACE_RECORDS];
+  record.millis = millis();
+  record.code = code;
+  record.level = level;
+  record.flags = 0;
+  record.a = a;
+  record.b = b;
+  total++;
+#ifdef ESP8266
+  if (level <= NETTHING_TRACE_RTC_LEVEL) {
+    saveRtc(record);
+  }
+#endif
+  if (echo) {
+    Serial.printf("Trace: %lu %u %s %lu %lu\n",
+                  (unsigned long)record.millis, level, codeName(code),
+                  (unsigned long)a, (unsigned long)b);
+  }
+}
+
+void Trace::setLevel(uint8_t level) {
+  runtime_level = level;
+}
+
+void Trace::setEcho(bool enable) {
+  echo = enable;
+}
+
+uint32_t Trace::first() {
+  if (total > NETTHING_TRACE_RECORDS) {
+    return total - NETTHING_TRACE_RECORDS;
+  }
+  return 0;
+}
+
+uint32_t Trace::next() {
+  return total;
+}
+
+size_t Trace::read(uint32_t seq, TraceRecord *out, size_t max_records) {
+  if (seq < first()) {
+    seq = first();
+  }
+  size_t n = 0;
+  while (seq < total && n < max_records) {
+    out[n++] = records[seq % NETTHING_TRACE_RECORDS];
+    seq++;
+  }
+  return n;
+}
+
+#ifdef ESP8266
+// layout: one header block (magic << 16 | next slot), then the records
+void Trace::restoreRtc() {
+  uint32_t header;
+  ESP.rtcUserMemoryRead(NETTHING_TRACE_RTCOFFSET, &header, 4);
+  if ((header & 0xFFFF0000) != (uint32_t)NETTHING_TRACE_RTCMAGIC << 16) {
+    rtc_index = 0;
+    return;
+  }
+  uint32_t saved = header & 0xFFFF;
+  uint32_t count = saved < NETTHING_TRACE_RTC_RECORDS ? saved : NETTHING_TRACE_RTC_RECORDS;
+  for (uint32_t i = saved - count; i < saved; i++) {
+    TraceRecord record;
+    uint32_t slot = i % NETTHING_TRACE_RTC_RECORDS;
+    ESP.rtcUserMemoryRead(NETTHING_TRACE_RTCOFFSET + 1 + slot * (sizeof(TraceRecord) / 4),
+                          (uint32_t *)&record, sizeof(TraceRecord));
+    record.flags |= TRACE_FLAG_PREVIOUS_BOOT;
+    records[total % NETTHING_TRACE_RECORDS] = record;
+    total++;
+  }
+  // start a fresh tail for this boot
+  rtc_index = 0;
+  header = (uint32_t)NETTHING_TRACE_RTCMAGIC << 16;
+  ESP.rtcUserMemoryWrite(NETTHING_TRACE_RTCOFFSET, &header, 4);
+}
+
+void Trace::saveRtc(const TraceRecord &record) {
+  uint32_t slot = rtc_index % NETTHING_TRACE_RTC_RECORDS;
+  ESP.rtcUserMemoryWrite(NETTHING_TRACE_RTCOFFSET + 1 + slot * (sizeof(TraceRecord) / 4),
+                         (uint32_t *)&record, sizeof(TraceRecord));
+  rtc_index++;
+  if (rtc_index >= 0xFFFF) {
+    // keep the count within the header while preserving the slot order
+    rtc_index = NETTHING_TRACE_RTC_RECORDS + rtc_index % NETTHING_TRACE_RTC_RECORDS;
+  }
+  uint32_t header = (uint32_t)NETTHING_TRACE_RTCMAGIC << 16 | rtc_index;
+  ESP.rtcUserMemoryWrite(NETTHING_TRACE_RTCOFFSET, &header, 4);
+}
+#endif
+
+const char *Trace::codeName(uint16_t code) {
+  switch (code) {
+    case TRACE_PS_NOT_ENABLED: return "ps_not_enabled";
+    case TRACE_PS_ALREADY_CONNECTED: return "ps_already_connected";
+    case TRACE_PS_ASYNC_ERROR: return "ps_async_error";
+    case TRACE_PS_TLS_MATCHED: return "ps_tls_matched";
+    case TRACE_PS_TLS_MISMATCH: return "ps_tls_mismatch";
+    case TRACE_PS_TLS_UNVERIFIED: return "ps_tls_unverified";
+    case TRACE_PS_CONNECTED: return "ps_connected";
+    case TRACE_PS_DISCONNECTED: return "ps_disconnected";
+    case TRACE_PS_RECEIVED: return "ps_received";
+    case TRACE_PS_RX_FULL: return "ps_rx_full";
+    case TRACE_PS_CONNECTING: return "ps_connecting";
+    case TRACE_PS_CONNECT_FAILED: return "ps_connect_failed";
+    case TRACE_PS_SEND: return "ps_send";
+    case TRACE_PS_TX_FULL: return "ps_tx_full";
+    case TRACE_PS_TX_CORRUPT: return "ps_tx_corrupt";
+    case TRACE_PS_TX_DELAYED: return "ps_tx_delayed";
+    case TRACE_PS_RX_REENTRY: return "ps_rx_reentry";
+    case TRACE_PS_RECV: return "ps_recv";
+    case TRACE_PS_RECONNECT_SCHEDULED: return "ps_reconnect_scheduled";
+    case TRACE_PS_RECONNECT_LINK_UP: return "ps_reconnect_link_up";
+    case TRACE_PS_NO_SERVER: return "ps_no_server";
+    case TRACE_PS_FAILOVER: return "ps_failover";
+    case TRACE_PS_FAILBACK_PROBE: return "ps_failback_probe";
+    case TRACE_PS_FAILBACK: return "ps_failback";
+    case TRACE_PS_DNS_FAILED: return "ps_dns_failed";
+    case TRACE_PS_DNS_FALLBACK: return "ps_dns_fallback";
+    case TRACE_NT_FILE_TIMEOUT: return "nt_file_timeout";
+    case TRACE_NT_WIFI_FORCE_RECONNECT: return "nt_wifi_force_reconnect";
+    case TRACE_NT_RECEIVE_WATCHDOG: return "nt_receive_watchdog";
+    case TRACE_NT_SEND_JSON: return "nt_send_json";
+    case TRACE_NT_WIFI_CONNECTED: return "nt_wifi_connected";
+    case TRACE_NT_WIFI_DISCONNECTED: return "nt_wifi_disconnected";
+    case TRACE_NT_JSON_ERROR: return "nt_json_error";
+    case TRACE_NT_RECV_JSON: return "nt_recv_json";
+    case TRACE_NT_LOOP_WATCHDOG: return "nt_loop_watchdog";
+    case TRACE_NT_FILE_READ_TIMEOUT: return "nt_file_read_timeout";
+    case TRACE_NT_FILE_READ_ERROR: return "nt_file_read_error";
+    case TRACE_NT_HOT_PATH_ALLOC: return "nt_hot_path_alloc";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <Arduino.h>
+
+#define TRACE_ERROR 1
+#define TRACE_WARN 2
+#define TRACE_INFO 3
+#define TRACE_DEBUG 4
+
+// records above this level are compiled out
+#ifndef NETTHING_TRACE_LEVEL
+#define NETTHING_TRACE_LEVEL TRACE_INFO
+#endif
+
+#ifndef NETTHING_TRACE_RECORDS
+#define NETTHING_TRACE_RECORDS 64
+#endif
+
+// records at or below this level are also kept in RTC memory and
+// survive a restart, set to 0 to disable
+#ifndef NETTHING_TRACE_RTC_LEVEL
+#define NETTHING_TRACE_RTC_LEVEL TRACE_WARN
+#endif
+
+#ifdef ESP8266
+// RTC user memory blocks used for the tail, clear of the OTA area and
+// of NETTHING_RESTARTER_RTCOFFSET
+#ifndef NETTHING_TRACE_RTCOFFSET
+#define NETTHING_TRACE_RTCOFFSET 80
+#endif
+#ifndef NETTHING_TRACE_RTC_RECORDS
+#define NETTHING_TRACE_RTC_RECORDS 11
+#endif
+#endif
+#ifndef NETTHING_TRACE_RTCMAGIC
+#define NETTHING_TRACE_RTCMAGIC 0x7A3C
+#endif
+
+#define TRACE_FLAG_PREVIOUS_BOOT 0x01
+
+#define TRACE(level, code, a, b) do { \
+  if ((level) <= NETTHING_TRACE_LEVEL) netthing_trace.log((level), (code), (a), (b)); \
+} while (0)
+
+enum TraceCode : uint16_t {
+  // PacketStream
+  TRACE_PS_NOT_ENABLED = 0x0100,
+  TRACE_PS_ALREADY_CONNECTED,
+  TRACE_PS_ASYNC_ERROR, // a=error
+  TRACE_PS_TLS_MATCHED, // a=fingerprint number
+  TRACE_PS_TLS_MISMATCH,
+  TRACE_PS_TLS_UNVERIFIED,
+  TRACE_PS_CONNECTED, // a=connection count
+  TRACE_PS_DISCONNECTED,
+  TRACE_PS_RECEIVED, // a=bytes
+  TRACE_PS_RX_FULL, // a=bytes, b=room
+  TRACE_PS_CONNECTING, // a=endpoint, b=address
+  TRACE_PS_CONNECT_FAILED,
+  TRACE_PS_SEND, // a=length, b=bytes already queued
+  TRACE_PS_TX_FULL, // a=length, b=room
+  TRACE_PS_TX_CORRUPT, // a=length, b=queued
+  TRACE_PS_TX_DELAYED, // a=available
+  TRACE_PS_RX_REENTRY,
+  TRACE_PS_RECV, // a=length, b=bytes still buffered
+  TRACE_PS_RECONNECT_SCHEDULED, // a=ms
+  TRACE_PS_RECONNECT_LINK_UP, // a=ms
+  TRACE_PS_NO_SERVER,
+  TRACE_PS_FAILOVER, // a=new endpoint
+  TRACE_PS_FAILBACK_PROBE,
+  TRACE_PS_FAILBACK, // a=previous endpoint
+  TRACE_PS_DNS_FAILED, // a=ms
+  TRACE_PS_DNS_FALLBACK, // a=address
+  // NetThing
+  TRACE_NT_FILE_TIMEOUT = 0x0200, // a=idle ms, b=session
+  TRACE_NT_WIFI_FORCE_RECONNECT,
+  TRACE_NT_RECEIVE_WATCHDOG,
+  TRACE_NT_SEND_JSON, // a=length, b=memory usage
+  TRACE_NT_WIFI_CONNECTED,
+  TRACE_NT_WIFI_DISCONNECTED,
+  TRACE_NT_JSON_ERROR, // a=length, b=DeserializationError code
+  TRACE_NT_RECV_JSON, // a=length, b=memory usage
+  TRACE_NT_LOOP_WATCHDOG,
+  TRACE_NT_FILE_READ_TIMEOUT, // a=idle ms
+  TRACE_NT_FILE_READ_ERROR, // a=position, b=length
+  TRACE_NT_HOT_PATH_ALLOC, // a=length, b=allocations
+};
+
+// 16 bytes, sent little-endian by trace_query
+struct TraceRecord {
+  uint32_t millis;
+  uint16_t code;
+  uint8_t level;
+  uint8_t flags;
+  uint32_t a;
+  uint32_t b;
+};
+
+class Trace {
+ private:
+  TraceRecord records[NETTHING_TRACE_RECORDS];
+  uint32_t total = 0; // sequence number of the next record
+  uint8_t runtime_level = TRACE_INFO;
+  bool echo = false;
+#ifdef ESP8266
+  uint32_t rtc_index = 0;
+  void restoreRtc();
+  void saveRtc(const TraceRecord &record);
+#endif
+ public:
+  Trace();
+  void log(uint8_t level, uint16_t code, uint32_t a=0, uint32_t b=0);
+  void setLevel(uint8_t level);
+  void setEcho(bool enable);
+  uint32_t first();
+  uint32_t next();
+  size_t read(uint32_t seq, TraceRecord *out, size_t max_records);
+  static const char *codeName(uint16_t code);
+};
+
+extern Trace netthing_trace;
+
+#endif
@@ -0,0 +1,207 @@
+#include "TrafficShaper.hpp"
+
+TrafficShaper::TrafficShaper(MetricsRegistry &metrics):
+  metrics(metrics)
+{
+  metric_dropped[TRAFFIC_CONTROL] = metrics.addCounter("net_tx_control_dropped");
+  metric_deferred[TRAFFIC_CONTROL] = metrics.addCounter("net_tx_control_deferred");
+  metric_coalesced[TRAFFIC_CONTROL] = metrics.addCounter("net_tx_control_coalesced");
+  metric_dropped[TRAFFIC_JSON] = metrics.addCounter("net_tx_json_dropped");
+  metric_deferred[TRAFFIC_JSON] = metrics.addCounter("net_tx_json_deferred");
+  metric_coalesced[TRAFFIC_JSON] = metrics.addCounter("net_tx_json_coalesced");
+  metric_dropped[TRAFFIC_EVENT] = metrics.addCounter("net_tx_event_dropped");
+  metric_deferred[TRAFFIC_EVENT] = metrics.addCounter("net_tx_event_deferred");
+  metric_coalesced[TRAFFIC_EVENT] = metrics.addCounter("net_tx_event_coalesced");
+  metric_dropped[TRAFFIC_BULK] = metrics.addCounter("net_tx_bulk_dropped");
+  metric_deferred[TRAFFIC_BULK] = metrics.addCounter("net_tx_bulk_deferred");
+  metric_coalesced[TRAFFIC_BULK] = metrics.addCounter("net_tx_bulk_coalesced");
+}
+
+// rate and burst in bytes, zero rate removes the limit
+void TrafficShaper::setLimit(uint8_t traffic_class, unsigned long rate, unsigned long burst, uint8_t policy) {
+  if (traffic_class >= TRAFFIC_CLASSES) {
+    return;
+  }
+  Bucket &bucket = buckets[traffic_class];
+  bucket.rate = rate;
+  bucket.burst = burst < TRAFFIC_MAX_BURST ? burst : TRAFFIC_MAX_BURST;
+  bucket.tokens_milli = bucket.burst * 1000;
+  bucket.last_refill = millis();
+  bucket.policy = policy;
+}
+
+void TrafficShaper::setReserve(size_t bytes) {
+  reserve = bytes;
+}
+
+bool TrafficShaper::limited(uint8_t traffic_class) {
+  if (traffic_class == TRAFFIC_CONTROL) {
+    return buckets[traffic_class].rate > 0;
+  }
+  return buckets[traffic_class].rate > 0 || reserve > 0;
+}
+
+void TrafficShaper::refill(Bucket &bucket) {
+  unsigned long now = millis();
+  unsigned long elapsed = now - bucket.last_refill;
+  bucket.last_refill = now;
+  long full = bucket.burst * 1000;
+  if (bucket.tokens_milli >= full) {
+    return;
+  }
+  // rate is bytes per second, so rate * ms is thousandths of a byte
+  unsigned long needed = full - bucket.tokens_milli;
+  if (elapsed >= needed / bucket.rate + 1) {
+    bucket.tokens_milli = full;
+  } else {
+    bucket.tokens_milli += elapsed * bucket.rate;
+    if (bucket.tokens_milli > full) {
+      bucket.tokens_milli = full;
+    }
+  }
+}
+
+bool TrafficShaper::hasTokens(uint8_t traffic_class, size_t len) {
+  Bucket &bucket = buckets[traffic_class];
+  if (bucket.rate == 0) {
+    return true;
+  }
+  refill(bucket);
+  // a frame larger than the burst goes out once the bucket is full
+  size_t needed = len < bucket.burst ? len : bucket.burst;
+  return bucket.tokens_milli >= (long)needed * 1000;
+}
+
+void TrafficShaper::spend(uint8_t traffic_class, size_t len) {
+  Bucket &bucket = buckets[traffic_class];
+  if (bucket.rate > 0) {
+    bucket.tokens_milli -= len * 1000;
+  }
+}
+
+// tx_room is net of the frame header, as returned by PacketStream::txRoom()
+bool TrafficShaper::roomFor(uint8_t traffic_class, size_t len, size_t header_len, size_t tx_room) {
+  if (traffic_class == TRAFFIC_CONTROL) {
+    return true;
+  }
+  return tx_room + header_len >= len + reserve;
+}
+
+// len is the packet length including its header of header_len bytes,
+// tx_room is from PacketStream::txRoom(). Tokens are spent on admission,
+// since the caller sends straight away. Frames queued behind deferred ones
+// of the same class are refused to keep ordering, the caller applies the
+// policy.
+bool TrafficShaper::admit(uint8_t traffic_class, size_t len, size_t header_len, size_t tx_room) {
+  if (defer_counts[traffic_class] > 0) {
+    return false;
+  }
+  if (!roomFor(traffic_class, len, header_len, tx_room)) {
+    return false;
+  }
+  if (!hasTokens(traffic_class, len)) {
+    return false;
+  }
+  spend(traffic_class, len);
+  return true;
+}
+
+// Applies the policy of a refused frame, false if it had to be dropped.
+// prefix and channel are as for PacketStream::sendJson(), prefix is
+// included in len.
+bool TrafficShaper::defer(uint8_t traffic_class, const JsonDocument &doc, size_t len, size_t header_len, const char *prefix, uint8_t channel) {
+  uint8_t policy = buckets[traffic_class].policy;
+  if (policy == TRAFFIC_DROP) {
+    metrics.inc(metric_dropped[traffic_class]);
+    return false;
+  }
+  // coalescing replaces the class's queued frame, which is kept if the new
+  // frame won't fit even in its place
+  size_t replaced = 0;
+  size_t replaced_len = 0;
+  if (policy == TRAFFIC_COALESCE && defer_counts[traffic_class] > 0) {
+    size_t offset = 0;
+    while (offset < defer_used) {
+      size_t entry_len = 4 + (defer_pool[offset + 1] | (defer_pool[offset + 2] << 8));
+      if (defer_pool[offset] == traffic_class) {
+        replaced = offset;
+        replaced_len = entry_len;
+        break;
+      }
+      offset += entry_len;
+    }
+  }
+  size_t json_len = len - header_len;
+  // the serializer also writes a terminator, overwritten by the next entry
+  if (defer_used - replaced_len + 4 + json_len + 1 > TRAFFIC_DEFER_BYTES) {
+    metrics.inc(metric_dropped[traffic_class]);
+    return false;
+  }
+  if (replaced_len) {
+    removeDeferred(replaced);
+    metrics.inc(metric_coalesced[traffic_class]);
+  }
+  uint8_t *entry = defer_pool + defer_used;
+  entry[0] = traffic_class;
+  entry[1] = json_len & 0xff;
+  entry[2] = json_len >> 8;
+  entry[3] = channel;
+  char *json = (char *)entry + 4;
+  size_t prefix_len = prefix ? strlen(prefix) : 0;
+  if (prefix_len) {
+    // the object's own '{' lands where the separating comma belongs
+    json[0] = '{';
+    memcpy(json + 1, prefix, prefix_len);
+    serializeJson(doc, json + 1 + prefix_len, json_len - prefix_len);
+    json[1 + prefix_len] = ',';
+  } else {
+    serializeJson(doc, json, json_len + 1);
+  }
+  defer_used += 4 + json_len;
+  defer_counts[traffic_class]++;
+  metrics.inc(metric_deferred[traffic_class]);
+  return true;
+}
+
+void TrafficShaper::removeDeferred(size_t offset) {
+  size_t entry_len = 4 + (defer_pool[offset + 1] | (defer_pool[offset + 2] << 8));
+  defer_counts[defer_pool[offset]]--;
+  memmove(defer_pool + offset, defer_pool + offset + entry_len, defer_used - offset - entry_len);
+  defer_used -= entry_len;
+}
+
+bool TrafficShaper::pending() {
+  return defer_used > 0;
+}
+
+// Deferred frames belong to the connection they were queued on.
+void TrafficShaper::clear() {
+  defer_used = 0;
+  memset(defer_counts, 0, sizeof(defer_counts));
+}
+
+// Sends deferred frames whose class has tokens, oldest first. Once a class
+// is blocked its later frames wait too, other classes carry on. Tokens are
+// only spent on frames that were queued.
+void TrafficShaper::drain(PacketStream &ps) {
+  size_t header_len = ps.headerLength();
+  uint8_t blocked = 0;
+  size_t offset = 0;
+  while (offset < defer_used) {
+    uint8_t traffic_class = defer_pool[offset];
+    size_t json_len = defer_pool[offset + 1] | (defer_pool[offset + 2] << 8);
+    uint8_t channel = defer_pool[offset + 3];
+    size_t len = json_len + header_len;
+    if (!(blocked & (1 << traffic_class))
+        && roomFor(traffic_class, len, header_len, ps.txRoom(channel))
+        && hasTokens(traffic_class, len)) {
+      if (ps.send(defer_pool + offset + 4, json_len, channel)) {
+        spend(traffic_class, len);
+        removeDeferred(offset);
+        continue;
+      }
+    }
+    blocked |= 1 << traffic_class;
+    offset += 4 + json_len;
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef TRAFFICSHAPER_HPP
+#define TRAFFICSHAPER_HPP
+
+#include <Arduino.h>
+#include "ArduinoJson.h"
+#include "MetricsRegistry.hpp"
+#include "PacketStream.hpp"
+
+#define TRAFFIC_CONTROL 0 // replies and requests generated by the library
+#define TRAFFIC_JSON 1 // application sendJson()
+#define TRAFFIC_EVENT 2 // application sendEvent(), single or batched
+#define TRAFFIC_BULK 3 // file_read_data chunks
+#define TRAFFIC_CLASSES 4
+
+#define TRAFFIC_DROP 0 // over the limit, refuse the frame
+#define TRAFFIC_COALESCE 1 // hold only the newest frame, send it when tokens allow
+#define TRAFFIC_DEFER 2 // queue frames in order, send them when tokens allow
+
+#ifndef TRAFFIC_DEFER_BYTES
+#define TRAFFIC_DEFER_BYTES 1024 // shared by all deferred frames
+#endif
+#define TRAFFIC_MAX_BURST 1000000UL
+
+// Token bucket per traffic class, measured in bytes of packet including the
+// frame header. A class without a rate is unlimited. Classes other than
+// control are also refused when sending would leave less than the control reserve
+// free in the transmit buffer, so that protocol replies always fit.
+class TrafficShaper {
+ private:
+  struct Bucket {
+    unsigned long rate = 0; // bytes per second
+    unsigned long burst = 0;
+    long tokens_milli = 0; // may go negative after an oversized frame
+    unsigned long last_refill = 0;
+    uint8_t policy = TRAFFIC_DROP;
+  };
+  MetricsRegistry &metrics;
+  Bucket buckets[TRAFFIC_CLASSES];
+  uint8_t defer_pool[TRAFFIC_DEFER_BYTES]; // [class][json len lo][json len hi][channel][json]...
+  size_t defer_used = 0;
+  uint8_t defer_counts[TRAFFIC_CLASSES] = {0};
+  size_t reserve = 0;
+  int metric_dropped[TRAFFIC_CLASSES];
+  int metric_deferred[TRAFFIC_CLASSES];
+  int metric_coalesced[TRAFFIC_CLASSES];
+  void refill(Bucket &bucket);
+  bool hasTokens(uint8_t traffic_class, size_t len);
+  void spend(uint8_t traffic_class, size_t len);
+  bool roomFor(uint8_t traffic_class, size_t len, size_t header_len, size_t tx_room);
+  void removeDeferred(size_t offset);
+
+ public:
+  TrafficShaper(MetricsRegistry &metrics);
+  void setLimit(uint8_t traffic_class, unsigned long rate, unsigned long burst, uint8_t policy);
+  void setReserve(size_t bytes);
+  bool limited(uint8_t traffic_class);
+  bool admit(uint8_t traffic_class, size_t len, size_t header_len, size_t tx_room);
+  bool defer(uint8_t traffic_class, const JsonDocument &doc, size_t len, size_t header_len, const char *prefix=NULL, uint8_t channel=0);
+  bool pending();
+  void clear();
+  void drain(PacketStream &ps);
+};
+
+#endif
@@ -0,0 +1,122 @@
+// Command latency, from the packet reaching onData() to the application's
+// receive callback, with fast_receive off (dispatch from loop()) and on
+// (dispatch from the scheduler at the next yield or delay). The app loop
+// is busy for APP_WORK_MS per pass, in delay(APP_SLICE_MS) slices, and
+// commands arrive every COMMAND_INTERVAL_MS, unaligned with the loop.
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ArduinoJson.h>
+
+#define private public
+#include "NetThing.hpp"
+#undef private
+
+#include "host.h"
+
+#define COMMANDS 2000
+#define COMMAND_INTERVAL_MS 37
+#define APP_WORK_MS 50
+#define APP_SLICE_MS 5
+
+static std::vector<uint64_t> arrivals; // micros() each command is due
+static size_t next_arrival;
+static uint64_t clock_us;
+static PacketStream *stream;
+static AsyncClient *server;
+
+static void receiveCommand(size_t seq) {
+  char json[64];
+  int len = snprintf(json, sizeof(json), "{\"cmd\":\"bench\",\"seq\":%u}", (unsigned)seq);
+  std::string frame;
+  frame += (char)(len >> 8);
+  frame += (char)(len & 0xff);
+  if (stream->headerLength() > 2) {
+    frame += '\0'; // control channel
+  }
+  frame.append(json, len);
+  server->hostReceive(frame.data(), frame.size());
+}
+
+// moves the clock on by us, delivering commands as they fall due
+static void advance(uint64_t us) {
+  uint64_t end = clock_us + us;
+  while (next_arrival < arrivals.size() && arrivals[next_arrival] <= end) {
+    clock_us = arrivals[next_arrival];
+    hostSetTimeUs(clock_us);
+    receiveCommand(next_arrival++);
+  }
+  clock_us = end;
+  hostSetTimeUs(clock_us);
+}
+
+static void run(bool fast_receive) {
+  NetThing thing;
+  thing.setServer("127.0.0.1", 13260);
+  thing.setLowLatency(fast_receive, false);
+  stream = thing.ps;
+  server = &thing.ps->client;
+
+  std::vector<uint64_t> latencies;
+  thing.onReceiveJson([&](const JsonDocument &doc) {
+    size_t seq = doc["seq"];
+    latencies.push_back(clock_us - arrivals[seq]);
+  });
+
+  clock_us = 1000000;
+  hostSetTimeUs(clock_us);
+  hostOnDelay([](unsigned long ms) { advance(ms * 1000ULL); });
+  thing.start();
+  for (int i = 0; i < 100 && !server->connecting(); i++) {
+    thing.loop();
+    advance(100000);
+  }
+  if (!server->connecting()) {
+    printf("no connection attempt\n");
+    exit(1);
+  }
+  server->hostConnected();
+  thing.loop();
+
+  arrivals.clear();
+  next_arrival = 0;
+  for (size_t i = 0; i < COMMANDS; i++) {
+    arrivals.push_back(clock_us + 1000 + i * COMMAND_INTERVAL_MS * 1000ULL);
+  }
+  uint64_t deadline = arrivals.back() + 1000000;
+  while (latencies.size() < COMMANDS && clock_us < deadline) {
+    thing.loop();
+    for (int t = 0; t < APP_WORK_MS; t += APP_SLICE_MS) {
+      delay(APP_SLICE_MS);
+    }
+    server->host_sent = "";
+  }
+  hostOnDelay(NULL);
+  if (latencies.size() < COMMANDS) {
+    printf("only %u of %d commands dispatched\n", (unsigned)latencies.size(), COMMANDS);
+    exit(1);
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  uint64_t total = 0;
+  for (uint64_t us : latencies) {
+    total += us;
+  }
+  printf("%-14s %8.2f %8.2f %8.2f %8.2f\n", fast_receive ? "fast_receive" : "loop polling",
+         total / 1000.0 / latencies.size(),
+         latencies[latencies.size() / 2] / 1000.0,
+         latencies[latencies.size() * 99 / 100] / 1000.0,
+         latencies.back() / 1000.0);
+}
+
+int main() {
+  printf("%d commands every %d ms, app loop busy %d ms in %d ms delay() slices\n",
+         COMMANDS, COMMAND_INTERVAL_MS, APP_WORK_MS, APP_SLICE_MS);
+  printf("%-14s %8s %8s %8s %8s\n", "latency (ms)", "mean", "p50", "p99", "max");
+  run(false);
+  run(true);
+  return 0;
+}
@@ -0,0 +1,148 @@
+// OTA throughput model. A sender streams firmware_data chunks over a link
+// with fixed bandwidth and round trip time to a device whose Updater takes
+// the stub's simulated time to erase and program each sector. Compared:
+//   write-through  add() writes to the Updater in the packet handler and the
+//                  sender waits for each firmware_continue (the old path)
+//   staged         FirmwareWriter with step() from loop(), still stop-and-wait
+//   windowed       FirmwareWriter, the sender fills the advertised window
+// All time is on the fake clock, the host's own speed doesn't matter.
+
+#include <deque>
+#include <Updater.h>
+
+#include "FirmwareWriter.hpp"
+#include "host.h"
+
+#define IMAGE_SIZE (256 * 1024)
+#define CHUNK 1024
+#define LINK_BYTES_PER_SEC 125000 // 1 Mbit/s
+#define SECTOR_US 45000 // erase plus program of a 4KB sector
+
+enum Mode { WRITE_THROUGH, STAGED, WINDOWED };
+
+struct Reply {
+  uint64_t at; // reaches the sender
+  size_t position;
+  size_t window;
+};
+
+static uint8_t image[IMAGE_SIZE];
+
+static uint64_t now() {
+  return micros64();
+}
+
+// base64 and the JSON around it
+static size_t wireBytes(size_t len) {
+  return (len + 2) / 3 * 4 + 80;
+}
+
+static double run(Mode mode, unsigned long rtt_ms) {
+  uint64_t one_way = rtt_ms * 500ULL;
+  MD5Builder md5;
+  md5.begin();
+  for (size_t i = 0; i < sizeof(image); i += CHUNK) {
+    md5.add(image + i, CHUNK); // MD5Builder takes at most 64KB at a time
+  }
+  md5.calculate();
+  String image_md5 = md5.toString();
+
+  FirmwareWriter writer;
+  if (mode == WRITE_THROUGH) {
+    Update.begin(IMAGE_SIZE);
+    Update.setMD5(image_md5.c_str());
+  } else {
+    writer.begin(image_md5.c_str(), IMAGE_SIZE);
+  }
+
+  std::deque<uint64_t> arrivals; // of chunks at the device, in order
+  std::deque<Reply> replies;
+  size_t sent = 0;
+  size_t received = 0;
+  size_t window_end = CHUNK; // what the sender may have sent so far
+  uint64_t link_free = 0;
+  uint64_t start = now();
+  bool done = false;
+
+  while (!done) {
+    // sender: take in replies and send what the window allows
+    while (!replies.empty() && replies.front().at <= now()) {
+      Reply &reply = replies.front();
+      window_end = reply.position + (mode == WINDOWED ? reply.window : CHUNK);
+      replies.pop_front();
+    }
+    while (sent < IMAGE_SIZE && sent + CHUNK <= window_end) {
+      uint64_t t = link_free > now() ? link_free : now();
+      link_free = t + wireBytes(CHUNK) * 1000000ULL / LINK_BYTES_PER_SEC;
+      arrivals.push_back(link_free + one_way);
+      sent += CHUNK;
+    }
+
+    // device: one loop() pass handles what has arrived, then one step()
+    bool worked = false;
+    while (!arrivals.empty() && arrivals.front() <= now()) {
+      arrivals.pop_front();
+      size_t window = 0;
+      if (mode == WRITE_THROUGH) {
+        Update.write(image + received, CHUNK);
+      } else {
+        writer.add(image + received, CHUNK, received);
+        window = writer.window();
+      }
+      received += CHUNK;
+      if (received == IMAGE_SIZE) {
+        done = mode == WRITE_THROUGH ? Update.end() : writer.commit();
+        if (!done) {
+          printf("update failed\n");
+          exit(1);
+        }
+        break;
+      }
+      replies.push_back({now() + one_way, received, window});
+      worked = true;
+    }
+    if (!done && mode != WRITE_THROUGH && writer.pending()) {
+      writer.step();
+      worked = true;
+    }
+
+    if (!done && !worked) {
+      // idle until the next packet or reply
+      uint64_t next = UINT64_MAX;
+      if (!arrivals.empty()) {
+        next = arrivals.front();
+      }
+      if (!replies.empty() && replies.front().at < next) {
+        next = replies.front().at;
+      }
+      if (next == UINT64_MAX) {
+        printf("stalled at %u bytes\n", (unsigned)received);
+        exit(1);
+      }
+      hostSetTimeUs(next);
+    }
+  }
+  return IMAGE_SIZE / 1024.0 / ((now() - start) / 1e6);
+}
+
+int main() {
+  for (size_t i = 0; i < sizeof(image); i++) {
+    image[i] = i * 31 + (i >> 8);
+  }
+  image[0] = 0xE9; // FirmwareWriter checks the magic byte
+  image[3] = 0x40; // and the flash size
+  hostSetFlashTiming(SECTOR_US - 1500 * 4, 1500);
+  hostSetTimeUs(1000000);
+
+  printf("%d KB image in %d byte chunks, %d KB/s link, %d ms per sector\n",
+         IMAGE_SIZE / 1024, CHUNK, LINK_BYTES_PER_SEC / 1000, SECTOR_US / 1000);
+  printf("%-8s %14s %14s %14s\n", "RTT", "write-through", "staged", "windowed");
+  const unsigned long rtts[] = {5, 20, 50, 100};
+  for (unsigned long rtt : rtts) {
+    printf("%5lu ms", rtt);
+    printf(" %9.1f KB/s", run(WRITE_THROUGH, rtt));
+    printf(" %9.1f KB/s", run(STAGED, rtt));
+    printf(" %9.1f KB/s\n", run(WINDOWED, rtt));
+  }
+  return 0;
+}
@@ -0,0 +1,94 @@
+// RamFS throughput on the host: rewriting a file in chunks as FileWriter
+// does, renaming with the file system full of names, and listing it.
+// Host CPU time only says how RamFS costs compare, not what a device takes.
+
+#include <chrono>
+#include <FS.h>
+
+#include "RamFS.hpp"
+
+#define WRITE_FILE_SIZE 4096
+#define WRITE_CHUNK 256
+#define WRITE_ROUNDS 20000
+#define RENAME_ROUNDS 200000
+#define LIST_ROUNDS 100000
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void benchWrite() {
+  uint8_t chunk[WRITE_CHUNK];
+  for (size_t i = 0; i < sizeof(chunk); i++) {
+    chunk[i] = i;
+  }
+  RamFS.format();
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < WRITE_ROUNDS; round++) {
+    File f = RamFS.open("/data.bin", "w");
+    for (size_t written = 0; written < WRITE_FILE_SIZE; written += sizeof(chunk)) {
+      f.write(chunk, sizeof(chunk));
+    }
+    f.close();
+  }
+  double s = seconds(start);
+  printf("%-8s %10.0f files/s %8.1f MB/s\n", "write", WRITE_ROUNDS / s,
+         (double)WRITE_ROUNDS * WRITE_FILE_SIZE / s / 1e6);
+}
+
+// fills every slot so that each lookup scans the whole table
+static void fill() {
+  RamFS.format();
+  char name[RAMFS_NAME_LEN];
+  for (int i = 0; i < RAMFS_MAX_FILES; i++) {
+    snprintf(name, sizeof(name), "/dir/file%02d.txt", i);
+    File f = RamFS.open(name, "w");
+    f.print(name);
+    f.close();
+  }
+}
+
+static void benchRename() {
+  fill();
+  char from[RAMFS_NAME_LEN];
+  char to[RAMFS_NAME_LEN];
+  snprintf(from, sizeof(from), "/dir/file%02d.txt", RAMFS_MAX_FILES - 1);
+  strcpy(to, "/dir/renamed.txt");
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < RENAME_ROUNDS; round++) {
+    if (!RamFS.rename(from, to)) {
+      printf("rename failed\n");
+      exit(1);
+    }
+    char tmp[RAMFS_NAME_LEN];
+    strcpy(tmp, from);
+    strcpy(from, to);
+    strcpy(to, tmp);
+  }
+  double s = seconds(start);
+  printf("%-8s %10.0f renames/s\n", "rename", RENAME_ROUNDS / s);
+}
+
+static void benchList() {
+  fill();
+  size_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < LIST_ROUNDS; round++) {
+    Dir dir = RamFS.openDir("/dir");
+    while (dir.next()) {
+      total += dir.fileSize();
+    }
+  }
+  double s = seconds(start);
+  printf("%-8s %10.0f listings/s %6.0f entries/s (%u bytes)\n", "list", LIST_ROUNDS / s,
+         (double)LIST_ROUNDS * RAMFS_MAX_FILES / s, (unsigned)(total / LIST_ROUNDS));
+}
+
+int main() {
+  printf("RamFS, %d files of at most %d bytes in all\n", RAMFS_MAX_FILES, RAMFS_MAX_BYTES);
+  benchWrite();
+  benchRename();
+  benchList();
+  RamFS.format();
+  return 0;
+}
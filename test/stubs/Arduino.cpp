@@ -0,0 +1,402 @@
+#include "Arduino.h"
+#include "Schedule.h"
+#include "coredecls.h"
+#include "host.h"
+
+#include <vector>
+
+// String
+
+void String::assign(const char *s, unsigned int n) {
+  if (!reserve(n)) {
+    return;
+  }
+  memmove(buffer, s, n);
+  buffer[n] = '\0';
+  len = n;
+}
+
+String::String(const char *s) {
+  if (s) {
+    assign(s, strlen(s));
+  }
+}
+
+String::String(const char *s, unsigned int n) {
+  assign(s, n);
+}
+
+String::String(char c) {
+  assign(&c, 1);
+}
+
+String::String(int value, unsigned char base) : String((long)value, base) {}
+
+String::String(unsigned int value, unsigned char base) : String((unsigned long)value, base) {}
+
+String::String(long value, unsigned char base) {
+  char buf[34];
+  if (base == 10) {
+    snprintf(buf, sizeof(buf), "%ld", value);
+  } else {
+    snprintf(buf, sizeof(buf), "%lx", (unsigned long)value);
+  }
+  assign(buf, strlen(buf));
+}
+
+String::String(unsigned long value, unsigned char base) {
+  char buf[34];
+  snprintf(buf, sizeof(buf), base == 10 ? "%lu" : "%lx", value);
+  assign(buf, strlen(buf));
+}
+
+String::String(const String &other) {
+  assign(other.c_str(), other.len);
+}
+
+String::String(String &&other) : buffer(other.buffer), len(other.len) {
+  other.buffer = NULL;
+  other.len = 0;
+}
+
+String::~String() {
+  free(buffer);
+}
+
+String &String::operator=(const String &other) {
+  if (this != &other) {
+    assign(other.c_str(), other.len);
+  }
+  return *this;
+}
+
+String &String::operator=(String &&other) {
+  if (this != &other) {
+    free(buffer);
+    buffer = other.buffer;
+    len = other.len;
+    other.buffer = NULL;
+    other.len = 0;
+  }
+  return *this;
+}
+
+String &String::operator=(const char *s) {
+  assign(s ? s : "", s ? strlen(s) : 0);
+  return *this;
+}
+
+// like the core, an empty String holds no buffer until something is stored
+bool String::reserve(unsigned int size) {
+  char *p = (char *)realloc(buffer, size + 1);
+  if (!p) {
+    return false;
+  }
+  if (!buffer) {
+    p[0] = '\0';
+  }
+  buffer = p;
+  return true;
+}
+
+bool String::concat(const char *s, unsigned int n) {
+  if (n == 0) {
+    return true;
+  }
+  if (!reserve(len + n)) {
+    return false;
+  }
+  memmove(buffer + len, s, n);
+  len += n;
+  buffer[len] = '\0';
+  return true;
+}
+
+bool String::concat(const char *s) {
+  return s ? concat(s, strlen(s)) : false;
+}
+
+bool String::concat(const String &s) {
+  return concat(s.c_str(), s.len);
+}
+
+bool String::concat(char c) {
+  return concat(&c, 1);
+}
+
+bool String::startsWith(const String &prefix) const {
+  return prefix.len <= len && strncmp(c_str(), prefix.c_str(), prefix.len) == 0;
+}
+
+bool String::endsWith(const String &suffix) const {
+  return suffix.len <= len && strcmp(c_str() + len - suffix.len, suffix.c_str()) == 0;
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+  if (to > len) {
+    to = len;
+  }
+  if (from >= to) {
+    return String();
+  }
+  return String(c_str() + from, to - from);
+}
+
+int String::indexOf(char c) const {
+  const char *p = strchr(c_str(), c);
+  return p ? p - c_str() : -1;
+}
+
+int String::lastIndexOf(char c) const {
+  const char *p = strrchr(c_str(), c);
+  return p ? p - c_str() : -1;
+}
+
+void String::remove(unsigned int index) {
+  remove(index, ~0u);
+}
+
+void String::remove(unsigned int index, unsigned int count) {
+  if (index >= len) {
+    return;
+  }
+  if (count > len - index) {
+    count = len - index;
+  }
+  memmove(buffer + index, buffer + index + count, len - index - count + 1);
+  len -= count;
+}
+
+String operator+(const String &a, const String &b) {
+  String s(a);
+  s.concat(b);
+  return s;
+}
+
+String operator+(const String &a, const char *b) {
+  String s(a);
+  s.concat(b);
+  return s;
+}
+
+String operator+(const char *a, const String &b) {
+  String s(a);
+  s.concat(b);
+  return s;
+}
+
+// Print and Stream
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::print(long value, int base) {
+  return print(String(value, base));
+}
+
+size_t Print::print(unsigned long value, int base) {
+  return print(String(value, base));
+}
+
+size_t Print::printf(const char *format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0) {
+    return 0;
+  }
+  return write((const uint8_t *)buf, (size_t)len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+size_t Stream::readBytes(char *buffer, size_t length) {
+  size_t n = 0;
+  while (n < length && available() > 0) {
+    buffer[n++] = read();
+  }
+  return n;
+}
+
+HardwareSerial Serial;
+
+static bool serialEnabled() {
+  static int enabled = -1;
+  if (enabled < 0) {
+    enabled = getenv("HOST_SERIAL") != NULL;
+  }
+  return enabled;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (serialEnabled()) {
+    fputc(c, stdout);
+  }
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  if (serialEnabled()) {
+    fwrite(buffer, 1, size, stdout);
+  }
+  return size;
+}
+
+// time and the scheduler
+
+static uint64_t host_time_us = 0;
+static bool host_scheduled = false;
+
+struct HostScheduled {
+  std::function<bool()> fn;
+  uint32_t repeat_us;
+  uint64_t due;
+};
+
+static std::vector<HostScheduled> &scheduledFunctions() {
+  static std::vector<HostScheduled> functions;
+  return functions;
+}
+
+bool schedule_function(const std::function<void()> &fn) {
+  return schedule_recurrent_function_us([fn]() { fn(); return false; }, 0);
+}
+
+bool schedule_recurrent_function_us(const std::function<bool()> &fn, uint32_t repeat_us) {
+  scheduledFunctions().push_back({fn, repeat_us, host_time_us + repeat_us});
+  return true;
+}
+
+void hostRunScheduled() {
+  // functions added while running wait for the next call, as in the core
+  std::vector<HostScheduled> &functions = scheduledFunctions();
+  size_t n = functions.size();
+  for (size_t i = 0; i < n && i < functions.size();) {
+    if (functions[i].due > host_time_us) {
+      i++;
+      continue;
+    }
+    if (functions[i].fn()) {
+      functions[i].due = host_time_us + functions[i].repeat_us;
+      i++;
+    } else {
+      functions.erase(functions.begin() + i);
+      n--;
+    }
+  }
+}
+
+size_t hostScheduledCount() {
+  return scheduledFunctions().size();
+}
+
+void hostAdvanceUs(uint64_t us) {
+  host_time_us += us;
+}
+
+void hostAdvanceMs(unsigned long ms) {
+  host_time_us += (uint64_t)ms * 1000;
+}
+
+void hostSetTimeUs(uint64_t us) {
+  host_time_us = us;
+}
+
+// unsigned long is 64 bits on the host, so these don't wrap: truncating
+// them to 32 bits would break the library's unsigned long arithmetic
+// rather than exercise the device's rollover
+unsigned long millis() {
+  return host_time_us / 1000;
+}
+
+unsigned long micros() {
+  return host_time_us;
+}
+
+uint64_t micros64() {
+  return host_time_us;
+}
+
+// the full period passes unless a test hooks it, e.g. to deliver data
+// part way through and account for the wait being cut short
+static std::function<void(unsigned long)> delay_hook;
+
+void hostOnDelay(std::function<void(unsigned long)> hook) {
+  delay_hook = hook;
+}
+
+void delay(unsigned long ms) {
+  host_scheduled = false;
+  if (delay_hook) {
+    delay_hook(ms);
+  } else {
+    hostAdvanceMs(ms);
+  }
+  hostRunScheduled();
+}
+
+void yield() {
+  hostRunScheduled();
+}
+
+extern "C" void esp_schedule() {
+  host_scheduled = true;
+}
+
+extern "C" void esp_yield() {
+  hostRunScheduled();
+}
+
+bool hostScheduleRequested() {
+  bool requested = host_scheduled;
+  host_scheduled = false;
+  return requested;
+}
+
+long random(long max) {
+  return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max) {
+  return max > min ? min + random(max - min) : min;
+}
+
+void randomSeed(unsigned long seed) {
+  srand(seed);
+}
+
+// ESP
+
+EspClass ESP;
+
+static uint32_t rtc_memory[128];
+static int host_restarts = 0;
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+  if (offset * 4 + size > sizeof(rtc_memory)) {
+    return false;
+  }
+  memcpy(data, (uint8_t *)rtc_memory + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+  if (offset * 4 + size > sizeof(rtc_memory)) {
+    return false;
+  }
+  memcpy((uint8_t *)rtc_memory + offset * 4, data, size);
+  return true;
+}
+
+void EspClass::restart() {
+  host_restarts++;
+}
+
+int hostRestarts() {
+  return host_restarts;
+}
@@ -0,0 +1,178 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+// Just enough of the ESP8266 Arduino core to build the library on a host.
+// Time only moves when a test advances it, see host.h.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <functional>
+
+#define ESP8266 1
+#define FLASH_SECTOR_SIZE 0x1000
+#define DEC 10
+#define HEX 16
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define PROGMEM
+#define PSTR(x) (x)
+#define F(x) (x)
+
+typedef bool boolean;
+
+class String {
+ private:
+  char *buffer = NULL;
+  unsigned int len = 0;
+  void assign(const char *s, unsigned int n);
+ public:
+  String(const char *s = "");
+  String(const char *s, unsigned int n);
+  String(char c);
+  String(int value, unsigned char base = DEC);
+  String(unsigned int value, unsigned char base = DEC);
+  String(long value, unsigned char base = DEC);
+  String(unsigned long value, unsigned char base = DEC);
+  String(const String &other);
+  String(String &&other);
+  ~String();
+  String &operator=(const String &other);
+  String &operator=(String &&other);
+  String &operator=(const char *s);
+  bool reserve(unsigned int size);
+  bool concat(const char *s);
+  bool concat(const char *s, unsigned int n);
+  bool concat(const String &s);
+  bool concat(char c);
+  String &operator+=(const String &s) { concat(s); return *this; }
+  String &operator+=(const char *s) { concat(s); return *this; }
+  String &operator+=(char c) { concat(c); return *this; }
+  const char *c_str() const { return buffer ? buffer : ""; }
+  unsigned int length() const { return len; }
+  char operator[](unsigned int index) const { return index < len ? buffer[index] : 0; }
+  bool operator==(const String &other) const { return strcmp(c_str(), other.c_str()) == 0; }
+  bool operator==(const char *s) const { return strcmp(c_str(), s) == 0; }
+  bool operator!=(const String &other) const { return !(*this == other); }
+  bool operator!=(const char *s) const { return !(*this == s); }
+  bool startsWith(const String &prefix) const;
+  bool endsWith(const String &suffix) const;
+  String substring(unsigned int from, unsigned int to = ~0u) const;
+  int indexOf(char c) const;
+  int lastIndexOf(char c) const;
+  void remove(unsigned int index);
+  void remove(unsigned int index, unsigned int count);
+  long toInt() const { return atol(c_str()); }
+};
+
+String operator+(const String &a, const String &b);
+String operator+(const String &a, const char *b);
+String operator+(const char *a, const String &b);
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(const String &s) { return write(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int value, int base = DEC) { return print((long)value, base); }
+  size_t print(unsigned int value, int base = DEC) { return print((unsigned long)value, base); }
+  size_t print(long value, int base = DEC);
+  size_t print(unsigned long value, int base = DEC);
+  size_t println() { return write("\n"); }
+  template<typename T> size_t println(T value) { return print(value) + println(); }
+  template<typename T> size_t println(T value, int base) { return print(value, base) + println(); }
+  size_t printf(const char *format, ...);
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() { return -1; }
+  virtual size_t readBytes(char *buffer, size_t length);
+  size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+};
+
+// writes to stdout only when HOST_SERIAL is set in the environment
+class HardwareSerial : public Stream {
+ public:
+  int available() override { return 0; }
+  int read() override { return -1; }
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+};
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+uint64_t micros64();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+template<class T> T min(T a, T b) { return a < b ? a : b; }
+template<class T> T max(T a, T b) { return a > b ? a : b; }
+
+class MD5Builder {
+ private:
+  uint32_t state[4];
+  uint64_t count;
+  uint8_t block[64];
+  uint8_t digest[16];
+  void transform(const uint8_t *data);
+ public:
+  void begin();
+  void add(const uint8_t *data, uint16_t len);
+  void add(const char *data) { add((const uint8_t *)data, strlen(data)); }
+  void add(const String &data) { add(data.c_str()); }
+  bool addStream(Stream &stream, size_t max_len);
+  void calculate();
+  void getBytes(uint8_t *output);
+  void getChars(char *output);
+  String toString();
+};
+
+class EspClass {
+ public:
+  uint32_t getChipId() { return 0x123456; }
+  uint32_t getFreeHeap() { return 40000; }
+  uint32_t getFreeContStack() { return 3000; }
+  uint8_t getHeapFragmentation() { return 0; }
+  uint32_t getMaxFreeBlockSize() { return 30000; }
+  const char *getSdkVersion() { return "host"; }
+  String getCoreVersion() { return "host"; }
+  uint8_t getBootVersion() { return 0; }
+  uint8_t getBootMode() { return 0; }
+  uint8_t getCpuFreqMHz() { return 80; }
+  uint32_t getFlashChipId() { return 0; }
+  uint32_t getFlashChipRealSize() { return 4194304; }
+  uint32_t getFlashChipSize() { return 4194304; }
+  uint32_t getFlashChipSpeed() { return 40000000; }
+  int getFlashChipMode() { return 0; }
+  uint32_t getFlashChipSizeByChipId() { return 4194304; }
+  uint32_t magicFlashChipSize(uint8_t) { return 4194304; }
+  uint32_t getSketchSize() { return 300000; }
+  String getSketchMD5() { return "00000000000000000000000000000000"; }
+  uint32_t getFreeSketchSpace() { return 1000000; }
+  String getResetReason() { return "host"; }
+  String getResetInfo() { return "host"; }
+  uint32_t getCycleCount() { return (uint32_t)micros64() * 80; }
+  uint32_t random() { return (uint32_t)::random(0x7fffffff); }
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+  void restart();
+};
+extern EspClass ESP;
+
+#endif
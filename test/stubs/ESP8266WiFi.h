@@ -0,0 +1,66 @@
+#ifndef ESP8266WIFI_H
+#define ESP8266WIFI_H
+
+#include "Arduino.h"
+#include <memory>
+
+#define WL_IDLE_STATUS 0
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+
+struct ip_addr;
+
+class IPAddress {
+ private:
+  uint32_t address = 0;
+ public:
+  IPAddress() {}
+  IPAddress(uint32_t address) : address(address) {}
+  IPAddress(const ip_addr *addr);
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  operator uint32_t() const { return address; }
+  bool isSet() const { return address != 0; }
+  uint8_t operator[](int index) const { return address >> (8 * index); }
+  bool operator==(const IPAddress &other) const { return address == other.address; }
+  bool fromString(const char *s);
+  String toString() const;
+};
+
+struct WiFiEventStationModeGotIP {};
+struct WiFiEventStationModeDisconnected {};
+
+class WiFiEventHandlerOpaque {
+ public:
+  virtual ~WiFiEventHandlerOpaque() {}
+};
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+
+enum WiFiSleepType_t { WIFI_NONE_SLEEP = 0, WIFI_LIGHT_SLEEP = 1, WIFI_MODEM_SLEEP = 2 };
+
+class WiFiClass {
+ private:
+  WiFiSleepType_t sleep_mode = WIFI_NONE_SLEEP;
+ public:
+  int status();
+  bool isConnected() { return status() == WL_CONNECTED; }
+  bool reconnect() { return true; }
+  void setAutoConnect(bool enable) {}
+  void setAutoReconnect(bool enable) {}
+  bool enableAP(bool enable) { return true; }
+  bool enableSTA(bool enable) { return true; }
+  int begin(const char *ssid, const char *password) { return status(); }
+  int8_t RSSI() { return -60; }
+  String BSSIDstr() { return "00:00:00:00:00:00"; }
+  uint8_t channel() { return 1; }
+  String SSID() { return "host"; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+  WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)> handler);
+  WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected &)> handler);
+  int hostByName(const char *name, IPAddress &result);
+  int hostByName(const char *name, IPAddress &result, uint32_t timeout_ms) { return hostByName(name, result); }
+  bool setSleepMode(WiFiSleepType_t type, uint8_t listen_interval = 0) { sleep_mode = type; return true; }
+  WiFiSleepType_t getSleepMode() { return sleep_mode; }
+};
+extern WiFiClass WiFi;
+
+#endif
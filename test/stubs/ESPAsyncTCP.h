@@ -0,0 +1,75 @@
+#ifndef ASYNCTCP_H_
+#define ASYNCTCP_H_
+
+// AsyncClient with the network replaced by host_* calls: a test plays the
+// lwIP side by delivering connects, data and disconnects, and reads back
+// whatever the library sent.
+
+#include "Arduino.h"
+#include "ESP8266WiFi.h"
+
+struct SSL;
+class AsyncClient;
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void *, AsyncClient *, int8_t error)> AcErrorHandler;
+typedef std::function<void(void *, AsyncClient *, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t time)> AcTimeoutHandler;
+
+class AsyncClient {
+ private:
+  AcConnectHandler connect_cb;
+  AcConnectHandler disconnect_cb;
+  AcConnectHandler poll_cb;
+  AcAckHandler ack_cb;
+  AcErrorHandler error_cb;
+  AcDataHandler data_cb;
+  AcTimeoutHandler timeout_cb;
+  bool is_connecting = false;
+  bool is_connected = false;
+
+ public:
+  String host_sent; // everything passed to add()
+  size_t host_space = 5744; // two TCP_MSS, as lwIP offers the device
+  unsigned int host_connects = 0; // connect() calls
+
+  void hostConnected();
+  void hostReceive(const void *data, size_t len);
+  void hostDisconnected();
+  void hostError(int8_t error);
+
+  bool connect(IPAddress ip, uint16_t port, bool secure = false);
+  bool connect(const char *host, uint16_t port, bool secure = false);
+  void close(bool now = false);
+  bool connected() { return is_connected; }
+  bool connecting() { return is_connecting; }
+  bool freeable() { return !is_connected && !is_connecting; }
+  bool canSend() { return is_connected && host_space > 0; }
+  size_t space() { return is_connected ? host_space : 0; }
+  size_t add(const char *data, size_t size, uint8_t apiflags = 0);
+  bool send() { return is_connected; }
+  size_t write(const char *data) { return write(data, strlen(data)); }
+  size_t write(const char *data, size_t size, uint8_t apiflags = 0) { return add(data, size, apiflags); }
+  SSL *getSSL() { return NULL; }
+  const char *errorToString(int8_t error) { return "host error"; }
+  void setAckTimeout(uint32_t timeout) {}
+  void setRxTimeout(uint32_t timeout) {}
+  void setNoDelay(bool nodelay) {}
+  IPAddress remoteIP() { return IPAddress(127, 0, 0, 1); }
+  uint16_t remotePort() { return 0; }
+  void ackLater() {}
+  size_t ack(size_t len) { return len; }
+
+  void onConnect(AcConnectHandler cb, void *arg = 0) { connect_cb = cb; }
+  void onDisconnect(AcConnectHandler cb, void *arg = 0) { disconnect_cb = cb; }
+  void onAck(AcAckHandler cb, void *arg = 0) { ack_cb = cb; }
+  void onError(AcErrorHandler cb, void *arg = 0) { error_cb = cb; }
+  void onData(AcDataHandler cb, void *arg = 0) { data_cb = cb; }
+  void onTimeout(AcTimeoutHandler cb, void *arg = 0) { timeout_cb = cb; }
+  void onPoll(AcConnectHandler cb, void *arg = 0) { poll_cb = cb; }
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "FS.h"
+#include "FSImpl.h"
+
+using namespace fs;
+
+// "r", "w", "a" with an optional "+", as the core's FS.cpp accepts them
+static bool sflags(const char *mode, OpenMode &om, AccessMode &am) {
+  int o = OM_DEFAULT;
+  int a = 0;
+  switch (mode[0]) {
+    case 'r':
+      a = AM_READ;
+      break;
+    case 'w':
+      a = AM_WRITE;
+      o = OM_CREATE | OM_TRUNCATE;
+      break;
+    case 'a':
+      a = AM_WRITE;
+      o = OM_CREATE | OM_APPEND;
+      break;
+    default:
+      return false;
+  }
+  if (mode[1] == '+') {
+    a = AM_RW;
+  }
+  om = (OpenMode)o;
+  am = (AccessMode)a;
+  return true;
+}
+
+size_t File::write(uint8_t c) {
+  return _p ? _p->write(&c, 1) : 0;
+}
+
+size_t File::write(const uint8_t *buf, size_t size) {
+  return _p ? _p->write(buf, size) : 0;
+}
+
+int File::available() {
+  return _p ? _p->size() - _p->position() : 0;
+}
+
+int File::read() {
+  uint8_t c;
+  return _p && _p->read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek() {
+  if (!_p) {
+    return -1;
+  }
+  size_t pos = _p->position();
+  int c = read();
+  _p->seek(pos, SeekSet);
+  return c;
+}
+
+size_t File::read(uint8_t *buf, size_t size) {
+  return _p ? _p->read(buf, size) : 0;
+}
+
+void File::flush() {
+  if (_p) {
+    _p->flush();
+  }
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+  return _p ? _p->seek(pos, mode) : false;
+}
+
+size_t File::position() const {
+  return _p ? _p->position() : 0;
+}
+
+size_t File::size() const {
+  return _p ? _p->size() : 0;
+}
+
+bool File::truncate(uint32_t size) {
+  return _p ? _p->truncate(size) : false;
+}
+
+void File::close() {
+  if (_p) {
+    _p->close();
+    _p = nullptr;
+  }
+}
+
+const char *File::name() const {
+  return _p ? _p->name() : NULL;
+}
+
+const char *File::fullName() const {
+  return _p ? _p->fullName() : NULL;
+}
+
+bool File::isFile() const {
+  return _p ? _p->isFile() : false;
+}
+
+bool File::isDirectory() const {
+  return _p ? _p->isDirectory() : false;
+}
+
+File Dir::openFile(const char *mode) {
+  OpenMode om;
+  AccessMode am;
+  if (!_impl || !sflags(mode, om, am)) {
+    return File();
+  }
+  return File(_impl->openFile(om, am));
+}
+
+String Dir::fileName() {
+  return _impl ? String(_impl->fileName()) : String();
+}
+
+size_t Dir::fileSize() {
+  return _impl ? _impl->fileSize() : 0;
+}
+
+bool Dir::isFile() const {
+  return _impl ? _impl->isFile() : false;
+}
+
+bool Dir::isDirectory() const {
+  return _impl ? _impl->isDirectory() : false;
+}
+
+bool Dir::next() {
+  return _impl ? _impl->next() : false;
+}
+
+bool Dir::rewind() {
+  return _impl ? _impl->rewind() : false;
+}
+
+bool FS::setConfig(const FSConfig &cfg) {
+  return _impl ? _impl->setConfig(cfg) : false;
+}
+
+bool FS::begin() {
+  return _impl ? _impl->begin() : false;
+}
+
+void FS::end() {
+  if (_impl) {
+    _impl->end();
+  }
+}
+
+bool FS::format() {
+  return _impl ? _impl->format() : false;
+}
+
+bool FS::info(FSInfo &info) {
+  return _impl ? _impl->info(info) : false;
+}
+
+bool FS::info64(FSInfo64 &info) {
+  return _impl ? _impl->info64(info) : false;
+}
+
+File FS::open(const char *path, const char *mode) {
+  OpenMode om;
+  AccessMode am;
+  if (!_impl || !sflags(mode, om, am)) {
+    return File();
+  }
+  return File(_impl->open(path, om, am));
+}
+
+bool FS::exists(const char *path) {
+  return _impl ? _impl->exists(path) : false;
+}
+
+Dir FS::openDir(const char *path) {
+  return _impl ? Dir(_impl->openDir(path)) : Dir();
+}
+
+bool FS::remove(const char *path) {
+  return _impl ? _impl->remove(path) : false;
+}
+
+bool FS::rename(const char *pathFrom, const char *pathTo) {
+  return _impl ? _impl->rename(pathFrom, pathTo) : false;
+}
+
+bool FS::mkdir(const char *path) {
+  return _impl ? _impl->mkdir(path) : false;
+}
+
+bool FS::rmdir(const char *path) {
+  return _impl ? _impl->rmdir(path) : false;
+}
+
+FS SPIFFS = FS(FSImplPtr());
+FS LittleFS = FS(FSImplPtr());
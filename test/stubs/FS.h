@@ -0,0 +1,123 @@
+#ifndef FS_H
+#define FS_H
+
+// The core's fs::FS, File and Dir, forwarding to an FSImpl as on the device
+
+#include "Arduino.h"
+#include <memory>
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+namespace fs {
+
+class FileImpl;
+class DirImpl;
+class FSImpl;
+typedef std::shared_ptr<FileImpl> FileImplPtr;
+typedef std::shared_ptr<DirImpl> DirImplPtr;
+typedef std::shared_ptr<FSImpl> FSImplPtr;
+
+struct FSInfo {
+  size_t totalBytes;
+  size_t usedBytes;
+  size_t blockSize;
+  size_t pageSize;
+  size_t maxOpenFiles;
+  size_t maxPathLength;
+};
+
+struct FSInfo64 {
+  uint64_t totalBytes;
+  uint64_t usedBytes;
+  size_t blockSize;
+  size_t pageSize;
+  size_t maxOpenFiles;
+  size_t maxPathLength;
+};
+
+class FSConfig {
+ public:
+  FSConfig(uint32_t type = 0, bool autoFormat = true) : _type(type), _autoFormat(autoFormat) {}
+  uint32_t _type;
+  bool _autoFormat;
+};
+
+class File : public Stream {
+ private:
+  FileImplPtr _p;
+ public:
+  File(FileImplPtr p = FileImplPtr()) : _p(p) {}
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t read(uint8_t *buf, size_t size);
+  size_t readBytes(char *buffer, size_t length) override { return read((uint8_t *)buffer, length); }
+  void flush();
+  bool seek(uint32_t pos, SeekMode mode);
+  bool seek(uint32_t pos) { return seek(pos, SeekSet); }
+  size_t position() const;
+  size_t size() const;
+  bool truncate(uint32_t size);
+  void close();
+  operator bool() const { return !!_p; }
+  const char *name() const;
+  const char *fullName() const;
+  bool isFile() const;
+  bool isDirectory() const;
+};
+
+class Dir {
+ private:
+  DirImplPtr _impl;
+ public:
+  Dir(DirImplPtr impl = DirImplPtr()) : _impl(impl) {}
+  File openFile(const char *mode);
+  String fileName();
+  size_t fileSize();
+  bool isFile() const;
+  bool isDirectory() const;
+  bool next();
+  bool rewind();
+};
+
+class FS {
+ private:
+  FSImplPtr _impl;
+ public:
+  FS(FSImplPtr impl) : _impl(impl) {}
+  bool setConfig(const FSConfig &cfg);
+  bool begin();
+  void end();
+  bool format();
+  bool info(FSInfo &info);
+  bool info64(FSInfo64 &info);
+  File open(const char *path, const char *mode);
+  File open(const String &path, const char *mode) { return open(path.c_str(), mode); }
+  bool exists(const char *path);
+  bool exists(const String &path) { return exists(path.c_str()); }
+  Dir openDir(const char *path);
+  Dir openDir(const String &path) { return openDir(path.c_str()); }
+  bool remove(const char *path);
+  bool remove(const String &path) { return remove(path.c_str()); }
+  bool rename(const char *pathFrom, const char *pathTo);
+  bool rename(const String &pathFrom, const String &pathTo) { return rename(pathFrom.c_str(), pathTo.c_str()); }
+  bool mkdir(const char *path);
+  bool rmdir(const char *path);
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::Dir;
+using fs::FSInfo;
+using fs::FSInfo64;
+using fs::FSConfig;
+
+// no backing store on the host, tests use RamFS
+extern FS SPIFFS;
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef LITTLEFS_H
+#define LITTLEFS_H
+
+#include "FS.h"
+
+extern FS LittleFS;
+
+#endif
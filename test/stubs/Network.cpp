@@ -0,0 +1,117 @@
+#include "ESP8266WiFi.h"
+#include "ESPAsyncTCP.h"
+#include "host.h"
+#include "lwip/dns.h"
+#include "tcp_axtls.h"
+
+// IPAddress, WiFi, DNS and AsyncClient
+
+IPAddress::IPAddress(const ip_addr *addr) : address(addr ? ((const ip_addr_t *)addr)->addr : 0) {}
+
+bool IPAddress::fromString(const char *s) {
+  unsigned int a, b, c, d;
+  char extra;
+  if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+    return false;
+  }
+  *this = IPAddress(a, b, c, d);
+  return true;
+}
+
+String IPAddress::toString() const {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(buf);
+}
+
+WiFiClass WiFi;
+
+static bool wifi_connected = true;
+
+void hostSetWiFiConnected(bool connected) {
+  wifi_connected = connected;
+}
+
+int WiFiClass::status() {
+  return wifi_connected ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+WiFiEventHandler WiFiClass::onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)> handler) {
+  return std::make_shared<WiFiEventHandlerOpaque>();
+}
+
+WiFiEventHandler WiFiClass::onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected &)> handler) {
+  return std::make_shared<WiFiEventHandlerOpaque>();
+}
+
+int WiFiClass::hostByName(const char *name, IPAddress &result) {
+  result = IPAddress(127, 0, 0, 1);
+  return 1;
+}
+
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg) {
+  addr->addr = IPAddress(127, 0, 0, 1);
+  return ERR_OK;
+}
+
+int ssl_match_fingerprint(SSL *ssl, const uint8_t *fingerprint) {
+  return 0;
+}
+
+void AsyncClient::hostConnected() {
+  is_connecting = false;
+  is_connected = true;
+  if (connect_cb) {
+    connect_cb(NULL, this);
+  }
+}
+
+void AsyncClient::hostReceive(const void *data, size_t len) {
+  if (is_connected && data_cb) {
+    data_cb(NULL, this, (void *)data, len);
+  }
+}
+
+void AsyncClient::hostDisconnected() {
+  bool was_active = is_connected || is_connecting;
+  is_connecting = false;
+  is_connected = false;
+  if (was_active && disconnect_cb) {
+    disconnect_cb(NULL, this);
+  }
+}
+
+void AsyncClient::hostError(int8_t error) {
+  is_connecting = false;
+  is_connected = false;
+  if (error_cb) {
+    error_cb(NULL, this, error);
+  }
+}
+
+bool AsyncClient::connect(IPAddress ip, uint16_t port, bool secure) {
+  host_connects++;
+  is_connecting = true;
+  return true;
+}
+
+bool AsyncClient::connect(const char *host, uint16_t port, bool secure) {
+  host_connects++;
+  is_connecting = true;
+  return true;
+}
+
+void AsyncClient::close(bool now) {
+  hostDisconnected();
+}
+
+size_t AsyncClient::add(const char *data, size_t size, uint8_t apiflags) {
+  if (!is_connected) {
+    return 0;
+  }
+  if (size > host_space) {
+    size = host_space;
+  }
+  host_sent.concat(data, size);
+  return size;
+}
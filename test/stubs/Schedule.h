@@ -0,0 +1,10 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include "Arduino.h"
+
+// run from yield() and delay(), as the core runs them between loop() calls
+bool schedule_function(const std::function<void()> &fn);
+bool schedule_recurrent_function_us(const std::function<bool()> &fn, uint32_t repeat_us);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef TICKER_H
+#define TICKER_H
+
+#include "Arduino.h"
+
+// never fires on the host, tests call the handlers they need
+class Ticker {
+ private:
+  bool attached = false;
+ public:
+  void attach(float seconds, std::function<void()> callback) { attached = true; }
+  void attach_ms(uint32_t ms, std::function<void()> callback) { attached = true; }
+  void once_ms(uint32_t ms, std::function<void()> callback) { attached = true; }
+  void detach() { attached = false; }
+  bool active() { return attached; }
+};
+
+#endif
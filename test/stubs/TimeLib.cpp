@@ -0,0 +1,22 @@
+#include "TimeLib.h"
+#include "Arduino.h"
+
+static time_t time_base = 0;
+static unsigned long time_base_ms = 0;
+static timeStatus_t time_status = timeNotSet;
+
+void setTime(time_t t) {
+  time_base = t;
+  time_base_ms = millis();
+  time_status = timeSet;
+}
+
+time_t now() {
+  return time_base + (millis() - time_base_ms) / 1000;
+}
+
+timeStatus_t timeStatus() {
+  return time_status;
+}
+
+void setSyncInterval(time_t interval) {}
@@ -0,0 +1,13 @@
+#ifndef TIMELIB_H
+#define TIMELIB_H
+
+#include <time.h>
+
+enum timeStatus_t { timeNotSet, timeNeedsSync, timeSet };
+
+void setTime(time_t t);
+time_t now();
+timeStatus_t timeStatus();
+void setSyncInterval(time_t interval);
+
+#endif
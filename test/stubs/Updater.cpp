@@ -0,0 +1,96 @@
+#include "Updater.h"
+#include "host.h"
+
+UpdaterClass Update;
+
+// core 2.7.4 on a typical 4MB part: ~30ms to erase a sector, ~1.5ms a KB to program
+static unsigned long flash_erase_us = 30000;
+static unsigned long flash_write_us_per_kb = 1500;
+
+void hostSetFlashTiming(unsigned long erase_us, unsigned long write_us_per_kb) {
+  flash_erase_us = erase_us;
+  flash_write_us_per_kb = write_us_per_kb;
+}
+
+bool UpdaterClass::begin(size_t update_size, int command) {
+  if (update_size == 0 || update_size > ESP.getFreeSketchSpace()) {
+    error = UPDATE_ERROR_SIZE;
+    return false;
+  }
+  free(buffer);
+  buffer = (uint8_t *)malloc(FLASH_SECTOR_SIZE);
+  buffer_len = 0;
+  size = update_size;
+  written = 0;
+  error = UPDATE_ERROR_OK;
+  expected_md5[0] = '\0';
+  host_sectors = 0;
+  md5.begin();
+  return true;
+}
+
+bool UpdaterClass::setMD5(const char *expected) {
+  if (strlen(expected) != 32) {
+    return false;
+  }
+  strcpy(expected_md5, expected);
+  return true;
+}
+
+void UpdaterClass::writeSector() {
+  hostAdvanceUs(flash_erase_us + (uint64_t)flash_write_us_per_kb * buffer_len / 1024);
+  md5.add(buffer, buffer_len);
+  written += buffer_len;
+  buffer_len = 0;
+  host_sectors++;
+}
+
+// as in the core, a write that completes a sector (or the image) blocks
+// for that sector's erase and program before returning
+size_t UpdaterClass::write(uint8_t *data, size_t len) {
+  if (!isRunning() || hasError()) {
+    return 0;
+  }
+  if (len > remaining()) {
+    error = UPDATE_ERROR_SIZE;
+    return 0;
+  }
+  size_t left = len;
+  while (left > 0) {
+    size_t n = FLASH_SECTOR_SIZE - buffer_len;
+    if (n > left) {
+      n = left;
+    }
+    memcpy(buffer + buffer_len, data, n);
+    buffer_len += n;
+    data += n;
+    left -= n;
+    if (buffer_len == FLASH_SECTOR_SIZE || progress() == size) {
+      writeSector();
+    }
+  }
+  return len;
+}
+
+bool UpdaterClass::end(bool evenIfRemaining) {
+  if (!isRunning()) {
+    return false;
+  }
+  if (buffer_len > 0) {
+    writeSector();
+  }
+  free(buffer);
+  buffer = NULL;
+  bool complete = written == size;
+  size = 0;
+  if (!complete && !evenIfRemaining) {
+    error = UPDATE_ERROR_SIZE;
+    return false;
+  }
+  md5.calculate();
+  if (expected_md5[0] && strcmp(md5.toString().c_str(), expected_md5) != 0) {
+    error = UPDATE_ERROR_MD5;
+    return false;
+  }
+  return !hasError();
+}
@@ -0,0 +1,43 @@
+#ifndef ESP8266UPDATER_H
+#define ESP8266UPDATER_H
+
+// The core's UpdaterClass buffering and timing without the flash: data is
+// collected a sector at a time and each full sector costs an erase and a
+// program on the fake clock, see hostSetFlashTiming() in host.h.
+
+#include "Arduino.h"
+
+#define U_FLASH 0
+#define UPDATE_ERROR_OK 0
+#define UPDATE_ERROR_WRITE 1
+#define UPDATE_ERROR_SIZE 4
+#define UPDATE_ERROR_MD5 9
+
+class UpdaterClass {
+ private:
+  uint8_t *buffer = NULL;
+  size_t buffer_len = 0;
+  size_t size = 0;
+  size_t written = 0; // flushed to flash
+  uint8_t error = UPDATE_ERROR_OK;
+  char expected_md5[33];
+  MD5Builder md5;
+  void writeSector();
+ public:
+  unsigned int host_sectors = 0;
+  bool begin(size_t size, int command = U_FLASH);
+  size_t write(uint8_t *data, size_t len);
+  bool end(bool evenIfRemaining = false);
+  void runAsync(bool async) {}
+  bool setMD5(const char *expected);
+  void printError(Print &out) { out.printf("Updater error %u\n", error); }
+  uint8_t getError() { return error; }
+  bool hasError() { return error != UPDATE_ERROR_OK; }
+  size_t remaining() { return size - progress(); }
+  size_t progress() { return written + buffer_len; }
+  bool isRunning() { return size > 0; }
+};
+
+extern UpdaterClass Update;
+
+#endif
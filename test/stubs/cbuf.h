@@ -0,0 +1,34 @@
+#ifndef CBUF_H
+#define CBUF_H
+
+#include <stddef.h>
+
+// same ring buffer as the core's: one byte is kept free to tell full from empty
+class cbuf {
+ private:
+  size_t _size;
+  char *_buf;
+  const char *_bufend;
+  char *_begin;
+  char *_end;
+  char *wrap_if_bufend(char *ptr) const { return (ptr == _bufend) ? _buf : ptr; }
+ public:
+  cbuf(size_t size);
+  ~cbuf();
+  size_t resize(size_t newSize);
+  size_t available() const;
+  size_t size() { return _size; }
+  size_t room() const;
+  bool empty() const { return _begin == _end; }
+  bool full() const { return wrap_if_bufend(_end + 1) == _begin; }
+  int peek();
+  size_t peek(char *dst, size_t size);
+  int read();
+  size_t read(char *dst, size_t size);
+  size_t write(char c);
+  size_t write(const char *src, size_t size);
+  void flush() { _begin = _buf; _end = _buf; }
+  size_t remove(size_t size);
+};
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef CORE_VERSION_H
+#define CORE_VERSION_H
+
+// A host build is no core release, so code keyed on
+// ARDUINO_ESP8266_RELEASE_* takes its version-independent path.
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef COREDECLS_H
+#define COREDECLS_H
+
+extern "C" {
+void esp_schedule();
+void esp_yield();
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef HOST_H
+#define HOST_H
+
+// Controls for the host stubs. Time stands still until a test moves it.
+
+#include "Arduino.h"
+
+void hostAdvanceUs(uint64_t us);
+void hostAdvanceMs(unsigned long ms);
+void hostSetTimeUs(uint64_t us);
+
+// runs functions queued with schedule_function() and
+// schedule_recurrent_function_us(), as yield(), delay() and loop() do
+void hostRunScheduled();
+size_t hostScheduledCount();
+
+// replaces the clock advance in delay(ms), e.g. to deliver data part way
+// through; scheduled functions still run once the hook returns
+void hostOnDelay(std::function<void(unsigned long)> hook);
+
+// true once after esp_schedule() has been called
+bool hostScheduleRequested();
+
+int hostRestarts();
+
+// WiFi.status() result, WL_CONNECTED by default
+void hostSetWiFiConnected(bool connected);
+
+// the Updater's simulated flash, see Updater.h
+void hostSetFlashTiming(unsigned long erase_us, unsigned long write_us_per_kb);
+
+#endif
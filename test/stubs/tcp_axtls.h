@@ -0,0 +1,10 @@
+#ifndef TCP_AXTLS_H
+#define TCP_AXTLS_H
+
+#include <stdint.h>
+
+struct SSL;
+// 0 when the peer certificate matches, see host.h for the host behaviour
+int ssl_match_fingerprint(SSL *ssl, const uint8_t *fingerprint);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+
+// Minimal test runner for the host tests: TEST(name) { CHECK(...); } and
+// main() returns runTests().
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+struct TestCase {
+  const char *name;
+  void (*fn)();
+};
+
+inline std::vector<TestCase> &testCases() {
+  static std::vector<TestCase> cases;
+  return cases;
+}
+
+inline int &testFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+struct TestRegistrar {
+  TestRegistrar(const char *name, void (*fn)()) { testCases().push_back({name, fn}); }
+};
+
+#define TEST(name) \
+  static void name(); \
+  static TestRegistrar name##_registrar(#name, name); \
+  static void name()
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      testFailures()++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) \
+  do { \
+    long long a_ = (long long)(actual); \
+    long long e_ = (long long)(expected); \
+    if (a_ != e_) { \
+      printf("  %s:%d: %s == %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+      testFailures()++; \
+    } \
+  } while (0)
+
+inline void checkStr(const char *actual, const char *expected, const char *file, int line, const char *text) {
+  if (!actual || strcmp(actual, expected) != 0) {
+    printf("  %s:%d: %s == \"%s\", expected \"%s\"\n", file, line, text, actual ? actual : "(null)", expected);
+    testFailures()++;
+  }
+}
+
+// a function call so that a temporary holding actual outlives the compare
+#define CHECK_STR(actual, expected) checkStr((actual), (expected), __FILE__, __LINE__, #actual)
+
+inline int runTests() {
+  int failed = 0;
+  for (const TestCase &t : testCases()) {
+    int before = testFailures();
+    t.fn();
+    bool ok = testFailures() == before;
+    printf("%s %s\n", ok ? "PASS" : "FAIL", t.name);
+    if (!ok) {
+      failed++;
+    }
+  }
+  printf("%d/%d passed\n", (int)testCases().size() - failed, (int)testCases().size());
+  return failed ? 1 : 0;
+}
+
+#endif
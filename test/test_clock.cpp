@@ -0,0 +1,138 @@
+#include "ClockDiscipline.hpp"
+#include "host.h"
+#include "test.hpp"
+
+#define SERVER_EPOCH 1700000000000LL
+
+// an exchange that has just completed: the probe left delay ms ago and the
+// server's clock reads local + offset, with the delay split evenly
+static void exchange(ClockDiscipline &clock, int64_t offset, uint32_t delay) {
+  uint64_t t4 = ClockDiscipline::localMs();
+  uint64_t t1 = t4 - delay;
+  int64_t server = (int64_t)(t1 + delay / 2) + offset;
+  clock.addSample(t1, server, server, t4);
+}
+
+// a clock synced to SERVER_EPOCH at local 100s by a 10ms exchange, so that
+// any later 0ms exchange is the one trusted
+static void sync(ClockDiscipline &clock) {
+  hostSetTimeUs(100000000);
+  exchange(clock, SERVER_EPOCH - 100000, 10);
+}
+
+TEST(unsynced_until_first_sample) {
+  hostSetTimeUs(5000000);
+  ClockDiscipline clock;
+  CHECK(!clock.isSynced());
+  CHECK_EQ(clock.nowMs(), 0);
+  CHECK_EQ(clock.toWallMs(1000), 0);
+}
+
+TEST(first_sample_sets_the_clock) {
+  ClockDiscipline clock;
+  sync(clock);
+  CHECK(clock.isSynced());
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH);
+  CHECK_EQ(clock.toWallMs(0), SERVER_EPOCH - 100000);
+  CHECK_EQ(clock.lastDelay(), 10);
+  // the first sample is taken as is, it is neither a step nor an error
+  CHECK_EQ(clock.steps(), 0);
+  CHECK_EQ(clock.lastError(), 0);
+  CHECK_EQ(clock.driftPpb(), 0);
+  hostAdvanceMs(2500);
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 2500);
+}
+
+TEST(error_at_threshold_is_slewed) {
+  ClockDiscipline clock;
+  sync(clock);
+  hostAdvanceMs(1000);
+  exchange(clock, SERVER_EPOCH - 100000 + CLOCK_STEP_MS, 0);
+  CHECK_EQ(clock.steps(), 0);
+  CHECK_EQ(clock.lastError(), CLOCK_STEP_MS);
+  // no jump, the error is worked off at CLOCK_MAX_SLEW_PPB
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 1000);
+  hostAdvanceMs(100000);
+  int64_t halfway = clock.nowMs() - (SERVER_EPOCH + 101000);
+  CHECK(halfway > 0 && halfway < CLOCK_STEP_MS);
+  uint64_t slew_ms = (uint64_t)CLOCK_STEP_MS * 1000000000LL / CLOCK_MAX_SLEW_PPB;
+  hostAdvanceMs(slew_ms);
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 101000 + slew_ms + CLOCK_STEP_MS);
+}
+
+TEST(error_past_threshold_is_stepped) {
+  ClockDiscipline clock;
+  sync(clock);
+  hostAdvanceMs(1000);
+  exchange(clock, SERVER_EPOCH - 100000 + CLOCK_STEP_MS + 1, 0);
+  CHECK_EQ(clock.steps(), 1);
+  CHECK_EQ(clock.lastError(), CLOCK_STEP_MS + 1);
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 1000 + CLOCK_STEP_MS + 1);
+}
+
+TEST(backward_step_holds_still) {
+  ClockDiscipline clock;
+  sync(clock);
+  hostAdvanceMs(1000);
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 1000);
+  exchange(clock, SERVER_EPOCH - 100000 - 5000, 0);
+  CHECK_EQ(clock.steps(), 1);
+  CHECK_EQ(clock.lastError(), -5000);
+  // nowMs() never goes backwards, it waits for the new time to catch up
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 1000);
+  hostAdvanceMs(3000);
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 1000);
+  hostAdvanceMs(3000);
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 2000);
+  // the unclamped model has already stepped back
+  CHECK_EQ(clock.toWallMs(ClockDiscipline::localMs()), SERVER_EPOCH + 2000);
+}
+
+// offsets 100s apart that grow by gain_ms, i.e. the local crystal runs
+// slow for a positive gain and fast for a negative one
+static int32_t measureDrift(int64_t gain_ms) {
+  ClockDiscipline clock;
+  sync(clock);
+  hostAdvanceMs(100000);
+  exchange(clock, SERVER_EPOCH - 100000 + gain_ms, 0);
+  return clock.driftPpb();
+}
+
+TEST(drift_sign) {
+  // 20ms in 100s is 200ppm, a quarter of which is taken per measurement
+  // (the sync exchange is centred 5ms early, hence not exactly 50000)
+  int32_t slow = measureDrift(20);
+  int32_t fast = measureDrift(-20);
+  CHECK(slow > 49900 && slow <= 50000);
+  CHECK_EQ(fast, -slow);
+  CHECK_EQ(measureDrift(0), 0);
+}
+
+TEST(drift_is_clamped) {
+  // 5s in 100s is no crystal, it is limited to CLOCK_MAX_DRIFT_PPB
+  CHECK_EQ(measureDrift(5000), CLOCK_MAX_DRIFT_PPB / 4);
+  CHECK_EQ(measureDrift(-5000), -CLOCK_MAX_DRIFT_PPB / 4);
+}
+
+TEST(drift_needs_spaced_samples) {
+  ClockDiscipline clock;
+  sync(clock);
+  hostAdvanceMs(CLOCK_DRIFT_MIN_MS - 1000);
+  exchange(clock, SERVER_EPOCH - 100000 + 20, 0);
+  CHECK_EQ(clock.driftPpb(), 0);
+}
+
+TEST(lowest_delay_sample_is_trusted) {
+  ClockDiscipline clock;
+  sync(clock);
+  hostAdvanceMs(1000);
+  // a slow exchange claiming a 500ms offset loses to the 10ms one
+  exchange(clock, SERVER_EPOCH - 100000 + 500, 400);
+  CHECK_EQ(clock.lastDelay(), 400);
+  CHECK_EQ(clock.lastError(), 0);
+  CHECK_EQ(clock.nowMs(), SERVER_EPOCH + 1000);
+}
+
+int main() {
+  return runTests();
+}
@@ -0,0 +1,207 @@
+// every command string reaches its handler and is timed in its own loop
+// profile slot, and nothing else is
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ArduinoJson.h>
+
+#define private public
+#include "NetThing.hpp"
+#undef private
+
+#include "RamFS.hpp"
+#include "host.h"
+#include "test.hpp"
+
+static char packet[1024];
+
+// next frame queued for the server, control frames go out on channel 0
+static std::string sentFrame(NetThing &thing) {
+  cbuf &queue = thing.ps->tx_buffer;
+  if (queue.available() < 2) {
+    return "";
+  }
+  char header[2];
+  queue.read(header, 2);
+  size_t len = ((uint8_t)header[0] << 8) | (uint8_t)header[1];
+  std::string frame(len, '\0');
+  queue.read(&frame[0], len);
+  return frame;
+}
+
+static int slotIndex(NetThing &thing, const char *name) {
+  for (int i = 0; i < thing.profiler.slot_count; i++) {
+    if (strcmp(thing.profiler.names[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Hands json to psReceiveHandler() and returns the name of any slot other
+// than json_parse and the expected one whose count moved, or "" if only
+// the expected slot did.
+static std::string dispatch(NetThing &thing, const char *json, const char *slot) {
+  std::vector<unsigned long> before;
+  for (int i = 0; i < thing.profiler.slot_count; i++) {
+    before.push_back(thing.profiler.slots[i].count);
+  }
+  strcpy(packet, json);
+  thing.psReceiveHandler((uint8_t *)packet, strlen(packet));
+
+  int expected = slotIndex(thing, slot);
+  if (expected < 0) {
+    return std::string("no slot ") + slot;
+  }
+  if (thing.profiler.slots[expected].count != before[expected] + 1) {
+    return std::string(slot) + " not counted";
+  }
+  int parse = slotIndex(thing, "json_parse");
+  for (int i = 0; i < thing.profiler.slot_count; i++) {
+    if (i != expected && i != parse && thing.profiler.slots[i].count != before[i]) {
+      return thing.profiler.names[i];
+    }
+  }
+  return "";
+}
+
+static void writeFile(const char *path, const char *content) {
+  File f = RamFS.open(path, "w");
+  f.print(content);
+  f.close();
+}
+
+struct Route {
+  const char *json;
+  const char *slot;
+  const char *reply; // "" if the command sends nothing back
+};
+
+static const Route routes[] = {
+  {"{\"cmd\":\"file_data\",\"filename\":\"/x\",\"transfer\":\"none\",\"position\":0,\"data\":\"\"}",
+   "cmd_file_data", "file_write_error"},
+  {"{\"cmd\":\"file_delete\",\"filename\":\"/delete.txt\"}", "cmd_file_delete", "file_delete_ok"},
+  {"{\"cmd\":\"file_dir_query\",\"path\":\"/\"}", "cmd_file_dir_query", "file_dir_info"},
+  {"{\"cmd\":\"file_query\",\"filename\":\"/query.txt\"}", "cmd_file_query", "file_info"},
+  {"{\"cmd\":\"file_read\",\"filename\":\"/read.txt\"}", "cmd_file_read", "file_read_start"},
+  {"{\"cmd\":\"file_read_ack\",\"position\":0}", "cmd_file_read_ack", ""},
+  {"{\"cmd\":\"file_rename\",\"old_filename\":\"/rename.txt\",\"new_filename\":\"/renamed.txt\"}",
+   "cmd_file_rename", "file_rename_ok"},
+  {"{\"cmd\":\"file_sync_manifest\",\"seq\":5,\"files\":[]}", "cmd_file_sync_manifest", "file_sync_error"},
+  {"{\"cmd\":\"file_write\",\"filename\":\"/write.txt\",\"md5\":\"0123456789abcdef0123456789abcdef\",\"size\":3}",
+   "cmd_file_write", "file_continue"},
+  {"{\"cmd\":\"firmware_data\",\"position\":0,\"data\":\"\"}", "cmd_firmware_data", "firmware_write_error"},
+  {"{\"cmd\":\"firmware_write\",\"md5\":\"0123456789abcdef0123456789abcdef\",\"size\":1000}",
+   "cmd_firmware_write", "firmware_continue"},
+  {"{\"cmd\":\"keepalive\"}", "cmd_other", ""},
+  {"{\"cmd\":\"loop_profile_query\"}", "cmd_loop_profile_query", "loop_profile_info"},
+  {"{\"cmd\":\"net_latency_query\"}", "cmd_net_latency_query", "net_latency_info"},
+  {"{\"cmd\":\"net_latency_reset\"}", "cmd_net_latency_reset", "net_latency_reset_ok"},
+  {"{\"cmd\":\"net_metrics_ack\",\"seq\":1}", "cmd_net_metrics_ack", ""},
+  {"{\"cmd\":\"net_metrics_query\"}", "cmd_net_metrics_query", "net_metrics_info"},
+  {"{\"cmd\":\"net_metrics_schema_query\"}", "cmd_net_metrics_schema_query", "net_metrics_schema"},
+  {"{\"cmd\":\"net_metrics_subscribe\",\"interval\":0}", "cmd_net_metrics_subscribe", ""},
+  {"{\"cmd\":\"ping\",\"seq\":1}", "cmd_ping", "pong"},
+  {"{\"cmd\":\"pong\",\"seq\":1}", "cmd_pong", ""},
+  {"{\"cmd\":\"ready\"}", "cmd_other", ""},
+  {"{\"cmd\":\"system_query\"}", "cmd_system_query", "system_info"},
+  {"{\"cmd\":\"time\",\"time\":1700000000}", "cmd_time", ""},
+  {"{\"cmd\":\"trace_query\"}", "cmd_trace_query", "trace_data"},
+};
+
+TEST(commands_route_to_handler_and_slot) {
+  for (const Route &route : routes) {
+    RamFS.format();
+    writeFile("/delete.txt", "delete");
+    writeFile("/query.txt", "query");
+    writeFile("/read.txt", "read");
+    writeFile("/rename.txt", "rename");
+
+    NetThing thing;
+    thing.setFileSystem(RamFS);
+    std::string unexpected = dispatch(thing, route.json, route.slot);
+    if (!unexpected.empty()) {
+      printf("  %s: %s\n", route.json, unexpected.c_str());
+    }
+    CHECK_STR(unexpected.c_str(), "");
+
+    std::string reply = sentFrame(thing);
+    std::string want = route.reply[0] ? std::string("\"cmd\":\"") + route.reply + "\"" : "";
+    if (want.empty() ? !reply.empty() : reply.find(want) == std::string::npos) {
+      printf("  %s: replied %s\n", route.json, reply.c_str());
+      CHECK(false);
+    }
+  }
+  RamFS.format();
+}
+
+TEST(file_commands_ignored_without_file_sync) {
+  NetThing thing;
+  thing.setFileSystem(RamFS);
+  thing.allowFileSync(false);
+  CHECK_STR(dispatch(thing, "{\"cmd\":\"file_dir_query\",\"path\":\"/\"}", "cmd_file_dir_query").c_str(), "");
+  CHECK(sentFrame(thing).empty());
+}
+
+TEST(time_sets_the_clock) {
+  NetThing thing;
+  setTime(0);
+  CHECK_STR(dispatch(thing, "{\"cmd\":\"time\",\"time\":1700000000}", "cmd_time").c_str(), "");
+  CHECK(timeStatus() != timeNotSet);
+  CHECK(now() >= 1700000000);
+}
+
+TEST(restart_and_reset_share_a_slot) {
+  NetThing thing;
+  int requests = 0;
+  uint16_t last_reason = 0;
+  thing.onRestartRequest([&](bool immediate, bool firmware, uint16_t reason) {
+    requests++;
+    last_reason = reason;
+  });
+  CHECK_STR(dispatch(thing, "{\"cmd\":\"restart\"}", "cmd_restart").c_str(), "");
+  CHECK_EQ(requests, 1);
+  CHECK_EQ(last_reason, NETTHING_RESTART_REMOTE);
+  CHECK_STR(dispatch(thing, "{\"cmd\":\"reset\"}", "cmd_restart").c_str(), "");
+  CHECK_EQ(requests, 2);
+}
+
+TEST(unknown_commands_go_to_the_application) {
+  NetThing thing;
+  std::vector<std::string> received;
+  thing.onReceiveJson([&](const JsonDocument &doc) {
+    const char *cmd = doc["cmd"];
+    received.push_back(cmd ? cmd : "");
+  });
+  CHECK_STR(dispatch(thing, "{\"cmd\":\"lights_on\"}", "cb_receive_json").c_str(), "");
+  CHECK_STR(dispatch(thing, "{\"value\":1}", "cb_receive_json").c_str(), "");
+  CHECK_EQ(received.size(), 2);
+  CHECK_STR(received[0].c_str(), "lights_on");
+  CHECK_STR(received[1].c_str(), "");
+  CHECK(sentFrame(thing).empty());
+}
+
+TEST(unknown_commands_without_a_callback_count_as_other) {
+  NetThing thing;
+  CHECK_STR(dispatch(thing, "{\"cmd\":\"lights_on\"}", "cmd_other").c_str(), "");
+}
+
+TEST(command_key_is_configurable) {
+  NetThing thing;
+  thing.setCommandKey("type");
+  CHECK_STR(dispatch(thing, "{\"type\":\"ping\",\"seq\":3}", "cmd_ping").c_str(), "");
+  std::string reply = sentFrame(thing);
+  CHECK(reply.find("\"type\":\"pong\"") != std::string::npos);
+
+  // the default key is then just another field
+  std::vector<std::string> received;
+  thing.onReceiveJson([&](const JsonDocument &doc) { received.push_back("app"); });
+  CHECK_STR(dispatch(thing, "{\"cmd\":\"ping\"}", "cb_receive_json").c_str(), "");
+  CHECK_EQ(received.size(), 1);
+}
+
+int main() {
+  return runTests();
+}
@@ -0,0 +1,128 @@
+// file_read replies name the file as the server asked for it, and a read
+// that gets replaced is reported rather than dropped
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <ArduinoJson.h>
+
+#define private public
+#include "NetThing.hpp"
+#undef private
+
+#include "RamFS.hpp"
+#include "host.h"
+#include "test.hpp"
+
+static char packet[1024];
+
+// next frame queued for the server, control frames go out on channel 0
+static std::string sentFrame(NetThing &thing) {
+  cbuf &queue = thing.ps->tx_buffer;
+  if (queue.available() < 2) {
+    return "";
+  }
+  char header[2];
+  queue.read(header, 2);
+  size_t len = ((uint8_t)header[0] << 8) | (uint8_t)header[1];
+  std::string frame(len, '\0');
+  queue.read(&frame[0], len);
+  return frame;
+}
+
+static bool contains(const std::string &s, const char *part) {
+  return s.find(part) != std::string::npos;
+}
+
+static void receive(NetThing &thing, const char *json) {
+  strcpy(packet, json);
+  thing.psReceiveHandler((uint8_t *)packet, strlen(packet));
+}
+
+static void writeFile(const char *path, const char *content) {
+  File f = RamFS.open(path, "w");
+  f.print(content);
+  f.close();
+}
+
+static void setUp(NetThing &thing) {
+  RamFS.format();
+  writeFile("/a.txt", "first file");
+  writeFile("/b.txt", "second file");
+  thing.setFileSystem(RamFS);
+}
+
+TEST(replies_carry_the_requested_name) {
+  NetThing thing;
+  setUp(thing);
+  writeFile("/data/log.txt", "log");
+  thing.setFilenamePrefix("/data/");
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"log.txt\",\"transfer\":\"r1\"}");
+  std::string start = sentFrame(thing);
+  CHECK(contains(start, "\"cmd\":\"file_read_start\""));
+  CHECK(contains(start, "\"filename\":\"log.txt\""));
+
+  thing.sendFileReadChunk();
+  std::string data = sentFrame(thing);
+  CHECK(contains(data, "\"cmd\":\"file_read_data\""));
+  CHECK(contains(data, "\"filename\":\"log.txt\""));
+  CHECK(contains(data, "\"transfer\":\"r1\""));
+  CHECK(contains(data, "\"eof\":true"));
+}
+
+TEST(replaced_read_gets_an_error) {
+  NetThing thing;
+  setUp(thing);
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/a.txt\",\"transfer\":\"r1\"}");
+  CHECK(contains(sentFrame(thing), "\"cmd\":\"file_read_start\""));
+
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/b.txt\",\"transfer\":\"r2\"}");
+  std::string error = sentFrame(thing);
+  CHECK(contains(error, "\"cmd\":\"file_read_error\""));
+  CHECK(contains(error, "\"transfer\":\"r1\""));
+  CHECK(contains(error, "\"filename\":\"/a.txt\""));
+  std::string start = sentFrame(thing);
+  CHECK(contains(start, "\"cmd\":\"file_read_start\""));
+  CHECK(contains(start, "\"transfer\":\"r2\""));
+  CHECK(thing.file_reader->running());
+}
+
+TEST(repeated_read_restarts_quietly) {
+  NetThing thing;
+  setUp(thing);
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/a.txt\",\"transfer\":\"r1\"}");
+  sentFrame(thing);
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/a.txt\",\"transfer\":\"r1\",\"position\":4}");
+  std::string start = sentFrame(thing);
+  CHECK(contains(start, "\"cmd\":\"file_read_start\""));
+  CHECK(contains(start, "\"position\":4"));
+  CHECK(sentFrame(thing).empty());
+}
+
+TEST(reads_without_transfer_ids_are_told_apart_by_name) {
+  NetThing thing;
+  setUp(thing);
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/a.txt\"}");
+  sentFrame(thing);
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/a.txt\"}");
+  CHECK(contains(sentFrame(thing), "\"cmd\":\"file_read_start\""));
+
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/b.txt\"}");
+  std::string error = sentFrame(thing);
+  CHECK(contains(error, "\"cmd\":\"file_read_error\""));
+  CHECK(contains(error, "\"filename\":\"/a.txt\""));
+  CHECK(!contains(error, "\"transfer\""));
+  CHECK(contains(sentFrame(thing), "\"cmd\":\"file_read_start\""));
+}
+
+TEST(long_names_are_refused) {
+  NetThing thing;
+  setUp(thing);
+  receive(thing, "{\"cmd\":\"file_read\",\"filename\":\"/a_name_much_too_long_for_the_reader.txt\"}");
+  CHECK(contains(sentFrame(thing), "\"cmd\":\"file_read_error\""));
+  CHECK(!thing.file_reader->running());
+}
+
+int main() {
+  return runTests();
+}
@@ -0,0 +1,262 @@
+// keepalive, ping, pong and file_data chunks are handled without touching
+// the heap, as counted by AllocCounter through the malloc wrappers
+
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <ArduinoJson.h>
+#include <FSImpl.h>
+
+#define private public
+#include "NetThing.hpp"
+#undef private
+
+#include "base64.hpp"
+#include "host.h"
+#include "test.hpp"
+
+using namespace fs;
+
+// Flash-like file system: contents live in fixed storage so that, as with
+// LittleFS, writing a file doesn't allocate once it is open
+#define FLASHFS_FILES 4
+#define FLASHFS_FILE_SIZE 4096
+
+struct FlashFile {
+  char name[32];
+  uint8_t data[FLASHFS_FILE_SIZE];
+  size_t size;
+  bool used;
+};
+
+static FlashFile flash_files[FLASHFS_FILES];
+
+class FlashFileImpl : public FileImpl {
+ private:
+  FlashFile *file;
+  size_t pos = 0;
+ public:
+  FlashFileImpl(FlashFile *file) : file(file) {}
+  size_t write(const uint8_t *buf, size_t size) override {
+    if (pos + size > FLASHFS_FILE_SIZE) {
+      return 0;
+    }
+    memcpy(file->data + pos, buf, size);
+    pos += size;
+    if (pos > file->size) {
+      file->size = pos;
+    }
+    return size;
+  }
+  size_t read(uint8_t *buf, size_t size) override {
+    if (size > file->size - pos) {
+      size = file->size - pos;
+    }
+    memcpy(buf, file->data + pos, size);
+    pos += size;
+    return size;
+  }
+  void flush() override {}
+  bool seek(uint32_t offset, SeekMode mode) override {
+    size_t target = mode == SeekSet ? offset : mode == SeekCur ? pos + offset : file->size + offset;
+    if (target > file->size) {
+      return false;
+    }
+    pos = target;
+    return true;
+  }
+  size_t position() const override { return pos; }
+  size_t size() const override { return file->size; }
+  bool truncate(uint32_t size) override { return false; }
+  void close() override {}
+  const char *name() const override { return file->name; }
+  const char *fullName() const override { return file->name; }
+  bool isFile() const override { return true; }
+  bool isDirectory() const override { return false; }
+};
+
+class FlashFSImpl : public FSImpl {
+ private:
+  FlashFile *find(const char *path) {
+    for (int i = 0; i < FLASHFS_FILES; i++) {
+      if (flash_files[i].used && strcmp(flash_files[i].name, path) == 0) {
+        return &flash_files[i];
+      }
+    }
+    return NULL;
+  }
+ public:
+  bool setConfig(const FSConfig &cfg) override { return true; }
+  bool begin() override { return true; }
+  void end() override {}
+  bool format() override {
+    memset(flash_files, 0, sizeof(flash_files));
+    return true;
+  }
+  bool info(FSInfo &info) override {
+    info.totalBytes = FLASHFS_FILES * FLASHFS_FILE_SIZE;
+    info.usedBytes = 0;
+    info.blockSize = 4096;
+    info.pageSize = 256;
+    info.maxOpenFiles = FLASHFS_FILES;
+    info.maxPathLength = 32;
+    return true;
+  }
+  bool info64(FSInfo64 &info) override { return false; }
+  FileImplPtr open(const char *path, OpenMode open_mode, AccessMode access_mode) override {
+    FlashFile *file = find(path);
+    if (!file && (open_mode & OM_CREATE)) {
+      for (int i = 0; i < FLASHFS_FILES && !file; i++) {
+        if (!flash_files[i].used) {
+          file = &flash_files[i];
+          file->used = true;
+          file->size = 0;
+          strncpy(file->name, path, sizeof(file->name) - 1);
+          file->name[sizeof(file->name) - 1] = '\0';
+        }
+      }
+    }
+    if (!file) {
+      return FileImplPtr();
+    }
+    if (open_mode & OM_TRUNCATE) {
+      file->size = 0;
+    }
+    return std::make_shared<FlashFileImpl>(file);
+  }
+  bool exists(const char *path) override { return find(path) != NULL; }
+  DirImplPtr openDir(const char *path) override { return DirImplPtr(); }
+  bool rename(const char *path_from, const char *path_to) override {
+    FlashFile *file = find(path_from);
+    if (!file || find(path_to)) {
+      return false;
+    }
+    strncpy(file->name, path_to, sizeof(file->name) - 1);
+    return true;
+  }
+  bool remove(const char *path) override {
+    FlashFile *file = find(path);
+    if (file) {
+      file->used = false;
+    }
+    return file != NULL;
+  }
+  bool mkdir(const char *path) override { return true; }
+  bool rmdir(const char *path) override { return true; }
+};
+
+static FS FlashFS = FS(FSImplPtr(new FlashFSImpl()));
+
+static char packet[1024];
+
+// next frame queued for the server, control frames go out on channel 0
+static std::string sentFrame(NetThing &thing) {
+  cbuf &queue = thing.ps->tx_buffer;
+  if (queue.available() < 2) {
+    return "";
+  }
+  char header[2];
+  queue.read(header, 2);
+  size_t len = ((uint8_t)header[0] << 8) | (uint8_t)header[1];
+  std::string frame(len, '\0');
+  queue.read(&frame[0], len);
+  return frame;
+}
+
+static bool contains(const std::string &s, const char *part) {
+  return s.find(part) != std::string::npos;
+}
+
+// psReceiveHandler() parses in place, so every call gets a fresh copy
+static uint32_t receive(NetThing &thing, const char *json) {
+  strcpy(packet, json);
+  size_t len = strlen(packet);
+  uint32_t before = AllocCounter::count();
+  thing.psReceiveHandler((uint8_t *)packet, len);
+  return AllocCounter::count() - before;
+}
+
+static long hotPathAllocs(NetThing &thing) {
+  return thing.metrics.get(thing.metric_hot_path_allocs);
+}
+
+TEST(keepalive_does_not_allocate) {
+  NetThing thing;
+  CHECK_EQ(receive(thing, "{\"cmd\":\"keepalive\"}"), 0);
+  CHECK_EQ(hotPathAllocs(thing), 0);
+}
+
+TEST(ping_does_not_allocate) {
+  NetThing thing;
+  CHECK_EQ(receive(thing, "{\"cmd\":\"ping\",\"seq\":7,\"timestamp\":123456}"), 0);
+  std::string reply = sentFrame(thing);
+  CHECK(contains(reply, "\"cmd\":\"pong\""));
+  CHECK(contains(reply, "\"seq\":7"));
+  CHECK_EQ(hotPathAllocs(thing), 0);
+}
+
+TEST(pong_does_not_allocate) {
+  NetThing thing;
+  thing.setServer("127.0.0.1", 13260);
+  hostAdvanceMs(5000);
+  thing.sendPing();
+  std::string ping = sentFrame(thing);
+  CHECK(contains(ping, "\"cmd\":\"ping\""));
+  hostAdvanceMs(40);
+  char json[160];
+  snprintf(json, sizeof(json),
+           "{\"cmd\":\"pong\",\"seq\":%lu,\"timestamp\":%lu,\"rx_time\":1700000000020,\"tx_time\":1700000000021}",
+           thing.ping_seq, thing.last_ping_sent);
+  CHECK_EQ(receive(thing, json), 0);
+  CHECK(!thing.ping_outstanding);
+  CHECK(thing.timeSynced());
+}
+
+TEST(file_data_does_not_allocate) {
+  NetThing thing;
+  thing.setFileSystem(FlashFS);
+
+  // four 256 byte chunks, the second and fourth fill FileWriter's buffer
+  // and write it through to the file system
+  uint8_t content[1024];
+  for (size_t i = 0; i < sizeof(content); i++) {
+    content[i] = i * 7;
+  }
+  MD5Builder md5;
+  md5.begin();
+  md5.add(content, sizeof(content));
+  md5.calculate();
+
+  char json[sizeof(packet)];
+  snprintf(json, sizeof(json),
+           "{\"cmd\":\"file_write\",\"filename\":\"/data.bin\",\"md5\":\"%s\",\"size\":%u,\"transfer\":\"t1\"}",
+           md5.toString().c_str(), (unsigned)sizeof(content));
+  receive(thing, json);
+  CHECK(contains(sentFrame(thing), "\"cmd\":\"file_continue\""));
+
+  for (size_t position = 0; position < sizeof(content); position += 256) {
+    char b64[400];
+    encode_base64(content + position, 256, (unsigned char *)b64);
+    snprintf(json, sizeof(json),
+             "{\"cmd\":\"file_data\",\"filename\":\"/data.bin\",\"transfer\":\"t1\",\"position\":%u,\"data\":\"%s\"}",
+             (unsigned)position, b64);
+    CHECK_EQ(receive(thing, json), 0);
+    CHECK(contains(sentFrame(thing), "\"cmd\":\"file_continue\""));
+  }
+  CHECK_EQ(hotPathAllocs(thing), 0);
+
+  // the eof chunk commits, which may allocate
+  snprintf(json, sizeof(json),
+           "{\"cmd\":\"file_data\",\"filename\":\"/data.bin\",\"transfer\":\"t1\",\"position\":%u,\"data\":\"\",\"eof\":true}",
+           (unsigned)sizeof(content));
+  receive(thing, json);
+  CHECK(contains(sentFrame(thing), "\"cmd\":\"file_write_ok\""));
+  File f = FlashFS.open("/data.bin", "r");
+  CHECK_EQ(f.size(), sizeof(content));
+}
+
+int main() {
+  return runTests();
+}
@@ -0,0 +1,70 @@
+// a connect that falls due while Wi-Fi is down waits for linkUp() without
+// keeping a timer running
+
+#include <functional>
+#include <memory>
+#include <ArduinoJson.h>
+
+#define private public
+#include "NetThing.hpp"
+#undef private
+
+#include "host.h"
+#include "test.hpp"
+
+static void run(NetThing &thing, unsigned long ms) {
+  for (unsigned long t = 0; t < ms; t += 100) {
+    hostAdvanceMs(100);
+    thing.loop();
+  }
+}
+
+TEST(no_connect_timer_while_link_is_down) {
+  hostSetWiFiConnected(false);
+  NetThing thing;
+  thing.setServer("127.0.0.1", 13260);
+  thing.start();
+  run(thing, 60000);
+  PacketStream &ps = *thing.ps;
+  CHECK_EQ(ps.client.host_connects, 0);
+  CHECK(ps.link_wait);
+  CHECK(!ps.timers.active(ps.connect_timer));
+
+  hostSetWiFiConnected(true);
+  ps.linkUp();
+  CHECK(!ps.link_wait);
+  CHECK(ps.timers.active(ps.connect_timer));
+  CHECK(ps.timers.remaining(ps.connect_timer) <= (long)ps.reconnect_link_up_splay);
+  run(thing, ps.reconnect_link_up_splay + 200);
+  CHECK_EQ(ps.client.host_connects, 1);
+}
+
+TEST(link_up_without_an_owed_connect_does_nothing) {
+  hostSetWiFiConnected(true);
+  NetThing thing;
+  thing.setServer("127.0.0.1", 13260);
+  PacketStream &ps = *thing.ps;
+  ps.linkUp();
+  CHECK(!ps.timers.active(ps.connect_timer));
+  CHECK_EQ(ps.client.host_connects, 0);
+}
+
+TEST(stop_forgets_the_owed_connect) {
+  hostSetWiFiConnected(false);
+  NetThing thing;
+  thing.setServer("127.0.0.1", 13260);
+  thing.start();
+  run(thing, 60000);
+  PacketStream &ps = *thing.ps;
+  CHECK(ps.link_wait);
+  thing.stop();
+  hostSetWiFiConnected(true);
+  ps.linkUp();
+  CHECK(!ps.timers.active(ps.connect_timer));
+  run(thing, 5000);
+  CHECK_EQ(ps.client.host_connects, 0);
+}
+
+int main() {
+  return runTests();
+}
@@ -0,0 +1,161 @@
+#include <functional>
+#include <vector>
+
+#define private public
+#include "TimerWheel.hpp"
+#undef private
+
+#include "host.h"
+#include "test.hpp"
+
+// advances the clock a tick at a time, as loop() would run the wheel
+static void runFor(TimerWheel &wheel, unsigned long ms) {
+  for (unsigned long i = 0; i < ms; i += NETTHING_TIMER_TICK_MS) {
+    hostAdvanceMs(NETTHING_TIMER_TICK_MS);
+    wheel.run();
+  }
+}
+
+TEST(fires_on_time) {
+  TimerWheel wheel;
+  int fired = 0;
+  wheel.add(100, [&]() { fired++; });
+  runFor(wheel, 90);
+  CHECK_EQ(fired, 0);
+  runFor(wheel, 10);
+  CHECK_EQ(fired, 1);
+  runFor(wheel, 1000);
+  CHECK_EQ(fired, 1);
+  CHECK_EQ(wheel.count(), 0);
+}
+
+TEST(cascades_across_levels) {
+  // one deadline on each level and one beyond them on the overflow list
+  const unsigned long deadlines[] = {
+    630, // 63 ticks, level 0
+    40000, // 4000 ticks, level 1
+    2600000, // 260000 ticks, level 2
+    2700000, // 270000 ticks, overflow
+  };
+  TimerWheel wheel;
+  std::vector<unsigned long> fired_at;
+  unsigned long start = millis();
+  for (unsigned long deadline : deadlines) {
+    wheel.add(deadline, [&]() { fired_at.push_back(millis() - start); });
+  }
+  CHECK_EQ(wheel.timers[0].list, 63);
+  CHECK(wheel.timers[1].list >= TIMERWHEEL_SLOTS && wheel.timers[1].list < 2 * TIMERWHEEL_SLOTS);
+  CHECK(wheel.timers[2].list >= 2 * TIMERWHEEL_SLOTS && wheel.timers[2].list < TimerWheel::LIST_OVERFLOW);
+  CHECK_EQ(wheel.timers[3].list, TimerWheel::LIST_OVERFLOW);
+
+  runFor(wheel, 2800000);
+  CHECK_EQ(fired_at.size(), 4);
+  for (size_t i = 0; i < fired_at.size() && i < 4; i++) {
+    CHECK_EQ(fired_at[i], deadlines[i]);
+  }
+}
+
+TEST(cascade_keeps_order_within_a_slot) {
+  // both land in the same level 1 slot and must come out a tick apart
+  TimerWheel wheel;
+  std::vector<int> order;
+  wheel.add(1010, [&]() { order.push_back(2); });
+  wheel.add(1000, [&]() { order.push_back(1); });
+  runFor(wheel, 1000);
+  CHECK_EQ(order.size(), 1);
+  runFor(wheel, 10);
+  CHECK_EQ(order.size(), 2);
+  CHECK(order.size() == 2 && order[0] == 1 && order[1] == 2);
+}
+
+TEST(cancel_pending_timer) {
+  TimerWheel wheel;
+  int a = 0, b = 0;
+  // same slot, so cancelling one unlinks it from the middle of a list
+  int id_a = wheel.add(500, [&]() { a++; });
+  int id_b = wheel.add(500, [&]() { b++; });
+  CHECK(wheel.active(id_a));
+  CHECK(wheel.cancel(id_a));
+  CHECK(!wheel.active(id_a));
+  CHECK(!wheel.cancel(id_a));
+  CHECK_EQ(wheel.remaining(id_a), -1);
+  CHECK_EQ(wheel.count(), 1);
+  runFor(wheel, 500);
+  CHECK_EQ(a, 0);
+  CHECK_EQ(b, 1);
+  CHECK(!wheel.active(id_b));
+}
+
+TEST(cancel_on_a_coarse_level) {
+  TimerWheel wheel;
+  int fired = 0;
+  int id = wheel.add(100000, [&]() { fired++; });
+  CHECK(wheel.timers[id & 0xFF].list >= TIMERWHEEL_SLOTS);
+  CHECK(wheel.cancel(id));
+  CHECK_EQ(wheel.nextDeadline(), -1);
+  runFor(wheel, 110000);
+  CHECK_EQ(fired, 0);
+}
+
+TEST(stale_id_does_not_cancel_reused_timer) {
+  TimerWheel wheel;
+  int fired = 0;
+  int old_id = wheel.add(100, []() {});
+  CHECK(wheel.cancel(old_id));
+  int new_id = wheel.add(100, [&]() { fired++; });
+  CHECK((old_id & 0xFF) == (new_id & 0xFF));
+  CHECK(old_id != new_id);
+  CHECK(!wheel.cancel(old_id));
+  runFor(wheel, 100);
+  CHECK_EQ(fired, 1);
+}
+
+TEST(timer_cancels_itself_from_callback) {
+  TimerWheel wheel;
+  int fired = 0;
+  int id = -1;
+  id = wheel.add(100, [&]() {
+    fired++;
+    wheel.cancel(id);
+  }, 100);
+  runFor(wheel, 1000);
+  CHECK_EQ(fired, 1);
+  CHECK_EQ(wheel.count(), 0);
+}
+
+TEST(periodic_reschedule) {
+  TimerWheel wheel;
+  int fired = 0;
+  int id = wheel.add(300, [&]() { fired++; }, 100);
+  runFor(wheel, 250);
+  // pushing the deadline out keeps the period
+  CHECK(wheel.reschedule(id, 300));
+  runFor(wheel, 290);
+  CHECK_EQ(fired, 0);
+  runFor(wheel, 10);
+  CHECK_EQ(fired, 1);
+  runFor(wheel, 300);
+  CHECK_EQ(fired, 4);
+}
+
+TEST(tick_counter_rollover) {
+  // the tick counter wraps after 2^32 ticks, deadlines beyond it start on
+  // the overflow list and come down when the top level cascades at 0.
+  // millis() can't be wrapped here, unsigned long is 64 bits on the host.
+  TimerWheel wheel;
+  wheel.current_tick = 0xFFFFFFFF - 20;
+  int fired = 0;
+  int id = wheel.add(500, [&]() { fired++; });
+  CHECK_EQ(wheel.timers[id & 0xFF].list, TimerWheel::LIST_OVERFLOW);
+  CHECK_EQ(wheel.nextDeadline(), 500);
+  runFor(wheel, 490);
+  CHECK_EQ(fired, 0);
+  CHECK(wheel.current_tick < 50);
+  CHECK_EQ(wheel.remaining(id), 10);
+  runFor(wheel, 10);
+  CHECK_EQ(fired, 1);
+}
+
+int main() {
+  return runTests();
+}